@@ -0,0 +1,434 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+#include "p2pool.h"
+#include "params.h"
+#include "side_chain.h"
+#include "block_template.h"
+#include "pool_block.h"
+#include "mempool.h"
+#include "wallet.h"
+#include "keccak.h"
+#include "crypto.h"
+#include <chrono>
+#include <cinttypes>
+#include <random>
+
+static constexpr char log_category_prefix[] = "Benchmark ";
+
+// Address from README.md, benchmarks never connect to monerod or other p2pool nodes
+static constexpr char bench_wallet[] = "44MnN1f3Eto8DZYUWuE5XZNUtE3vcRzt2j6PzqWpPau34e6Cf4fAxt6X2MBmrm6F9YMEiMNjN6W4Shn4pLcfNAja621jwyg";
+
+namespace p2pool {
+
+// Runs hot code paths on synthetic data: a full PPLNS window of sidechain blocks with uncles
+// and a mempool with a configurable number of transactions
+class Benchmark
+{
+public:
+	Benchmark(p2pool* pool, uint32_t num_wallets, uint32_t num_transactions, uint32_t num_clients, uint32_t min_time_ms)
+		: m_pool(pool)
+		, m_numWallets(num_wallets)
+		, m_numTransactions(num_transactions)
+		, m_numClients(num_clients)
+		, m_minTimeMs(min_time_ms)
+		, m_rng(12345)
+	{
+	}
+
+	bool run();
+	bool save(const char* file_name) const;
+
+private:
+	struct Result
+	{
+		const char* m_name;
+		uint64_t m_iterations;
+		double m_nsPerOp;
+	};
+
+	template<typename T> void measure(const char* name, T&& func);
+
+	hash random_hash();
+	void generate_wallets();
+	void generate_chain();
+	void generate_mempool(Mempool& mempool);
+
+	p2pool* m_pool;
+	uint32_t m_numWallets;
+	uint32_t m_numTransactions;
+	uint32_t m_numClients;
+	uint32_t m_minTimeMs;
+
+	std::mt19937_64 m_rng;
+	std::vector<Wallet> m_wallets;
+	std::vector<Result> m_results;
+};
+
+hash Benchmark::random_hash()
+{
+	hash result;
+	for (size_t i = 0; i < HASH_SIZE; i += sizeof(uint64_t)) {
+		const uint64_t k = m_rng();
+		memcpy(result.h + i, &k, sizeof(uint64_t));
+	}
+	return result;
+}
+
+template<typename T>
+void Benchmark::measure(const char* name, T&& func)
+{
+	using namespace std::chrono;
+
+	// Warm-up
+	func();
+
+	// Double the batch size until the total time is long enough, so the clock isn't read on every call
+	uint64_t iterations = 0;
+	double total_ns = 0.0;
+
+	for (uint64_t batch = 1;; batch *= 2) {
+		const auto t1 = high_resolution_clock::now();
+		for (uint64_t i = 0; i < batch; ++i) {
+			func();
+		}
+		const auto t2 = high_resolution_clock::now();
+
+		iterations += batch;
+		total_ns += duration<double, std::nano>(t2 - t1).count();
+
+		if (total_ns >= m_minTimeMs * 1e6) {
+			break;
+		}
+	}
+
+	const double ns_per_op = total_ns / iterations;
+	m_results.push_back({ name, iterations, ns_per_op });
+
+	printf("%-40s %14.1f ns/op %12" PRIu64 " iterations\n", name, ns_per_op, iterations);
+}
+
+void Benchmark::generate_wallets()
+{
+	m_wallets.reserve(m_numWallets);
+
+	for (uint32_t i = 0; i < m_numWallets; ++i) {
+		hash spend_pub, view_pub, sec;
+		generate_keys(spend_pub, sec);
+		generate_keys(view_pub, sec);
+
+		Wallet w(nullptr);
+		w.assign(spend_pub, view_pub);
+		m_wallets.push_back(w);
+	}
+}
+
+// Builds m_chainWindowSize * 2 blocks on top of a genesis block, so the PPLNS window is full
+// Every 10th block has an orphaned sibling which is mined as an uncle by the next block
+void Benchmark::generate_chain()
+{
+	SideChain& sc = m_pool->side_chain();
+
+	const uint64_t num_blocks = sc.m_chainWindowSize * 2;
+	const uint64_t n = m_wallets.size();
+
+	auto create = [this, &sc, n, num_blocks](PoolBlock* parent, const std::vector<hash>& uncles) -> PoolBlock*
+	{
+		PoolBlock b;
+
+		b.m_sidechainId = random_hash();
+
+		// Skewed hashrate distribution: a few big miners and a long tail of small ones
+		const uint64_t k = m_rng() % n;
+		b.m_minerWallet = m_wallets[(k * (m_rng() % n)) / n];
+
+		b.m_verified = true;
+		b.m_invalid = false;
+
+		if (parent) {
+			b.m_parent = parent->m_sidechainId;
+			b.m_sidechainHeight = parent->m_sidechainHeight + 1;
+			b.m_txinGenHeight = parent->m_txinGenHeight + ((m_rng() % 12 == 0) ? 1 : 0);
+			b.m_timestamp = parent->m_timestamp + sc.m_targetBlockTime + (m_rng() % 3) - 1;
+			b.m_uncles = uncles;
+
+			if (!sc.get_difficulty(parent, sc.m_difficultyData, b.m_difficulty)) {
+				return nullptr;
+			}
+
+			b.m_cumulativeDifficulty = parent->m_cumulativeDifficulty + b.m_difficulty;
+			for (const hash& id : uncles) {
+				b.m_cumulativeDifficulty += sc.m_blocksById.at(id)->m_difficulty;
+			}
+		}
+		else {
+			b.m_txinGenHeight = 2400000;
+			b.m_timestamp = time(nullptr) - num_blocks * sc.m_targetBlockTime;
+			b.m_difficulty = sc.m_minDifficulty;
+			b.m_cumulativeDifficulty = sc.m_minDifficulty;
+		}
+
+		PoolBlock* block = sc.m_blockArena.create(std::move(b));
+		sc.m_blocksById.insert({ block->m_sidechainId, block });
+		sc.m_blocksByHeight[block->m_sidechainHeight].push_back(block);
+		return block;
+	};
+
+	PoolBlock* tip = create(nullptr, {});
+	std::vector<hash> uncles;
+
+	for (uint64_t i = 0; tip && (i < num_blocks); ++i) {
+		PoolBlock* parent = tip;
+		tip = create(parent, uncles);
+		uncles.clear();
+
+		if (tip && (m_rng() % 10 == 0)) {
+			PoolBlock* orphan = create(parent, {});
+			if (orphan) {
+				uncles.push_back(orphan->m_sidechainId);
+			}
+		}
+	}
+
+	if (!tip) {
+		LOGERR(1, "failed to generate sidechain");
+		panic();
+	}
+
+	for (auto& it : sc.m_blocksByHeight) {
+		for (PoolBlock* block : it.second) {
+			block->m_depth = tip->m_sidechainHeight - block->m_sidechainHeight;
+		}
+	}
+
+	sc.m_chainTip = tip;
+	if (!sc.get_difficulty(tip, sc.m_difficultyData, sc.m_curDifficulty)) {
+		LOGERR(1, "failed to calculate difficulty");
+		panic();
+	}
+	sc.update_tip_snapshot();
+
+	LOGINFO(0, "generated " << sc.m_blocksById.size() << " sidechain blocks, " << n << " wallets, next difficulty = " << sc.m_curDifficulty);
+}
+
+void Benchmark::generate_mempool(Mempool& mempool)
+{
+	for (uint32_t i = 0; i < m_numTransactions; ++i) {
+		TxMempoolData tx;
+		tx.id = random_hash();
+		tx.blob_size = 1500 + m_rng() % 3000;
+		tx.weight = tx.blob_size + ((m_rng() % 4 == 0) ? (m_rng() % 10000) : 0);
+		tx.fee = tx.weight * (20000 + m_rng() % 60000);
+		mempool.add(tx);
+	}
+}
+
+bool Benchmark::run()
+{
+	SideChain& sc = m_pool->side_chain();
+	BlockTemplate& tmpl = m_pool->block_template();
+
+	generate_wallets();
+	generate_chain();
+
+	std::vector<MinerShare> shares;
+
+	measure("SideChain::get_shares", [&sc, &shares]() { sc.get_shares(sc.m_chainTip, shares); });
+	measure("SideChain::get_shares (full window)", [&sc, &shares]() { sc.pplns_reset(); sc.get_shares(sc.m_chainTip, shares); });
+
+	difficulty_type diff;
+	measure("SideChain::get_difficulty", [&sc, &diff]() { sc.get_difficulty(sc.m_chainTip, sc.m_difficultyData, diff); });
+	measure("SideChain::recalculate_difficulty", [&sc, &diff]() { sc.recalculate_difficulty(sc.m_chainTip, sc.m_difficultyData, diff); });
+
+	Mempool mempool;
+	generate_mempool(mempool);
+
+	MinerData data;
+	data.major_version = HARDFORK_SUPPORTED_VERSION;
+	data.height = sc.m_chainTip->m_txinGenHeight + 1;
+	data.prev_id = random_hash();
+	data.seed_hash = random_hash();
+	data.difficulty = { 300000000000ULL, 0 };
+	data.median_weight = 300000;
+	data.already_generated_coins = 18000000000000000000ULL;
+	data.median_timestamp = time(nullptr) - 600;
+
+	Wallet miner_wallet = m_pool->params().m_wallet;
+
+	measure("BlockTemplate::update", [&tmpl, &data, &mempool, &miner_wallet]() { tmpl.update(data, mempool, &miner_wallet); });
+
+	std::vector<uint8_t> blobs;
+	uint64_t height;
+	difficulty_type sidechain_diff;
+	hash seed_hash;
+	size_t nonce_offset;
+	uint32_t template_id;
+	const uint32_t num_clients = m_numClients;
+
+	measure("BlockTemplate::get_hashing_blobs", [&]() { tmpl.get_hashing_blobs(0, num_clients, blobs, height, diff, sidechain_diff, seed_hash, nonce_offset, template_id); });
+
+	if (blobs.empty()) {
+		LOGERR(1, "get_hashing_blobs failed");
+		return false;
+	}
+
+	// The last template is a valid block on top of the generated chain
+	PoolBlock candidate(*std::atomic_load(&tmpl.m_job)->m_poolBlockTemplate);
+	candidate.m_sidechainId = random_hash();
+
+	candidate.m_verified = false;
+	candidate.m_invalid = false;
+	sc.verify(&candidate, shares);
+
+	if (!candidate.m_verified || candidate.m_invalid || !sc.verify_outputs(&candidate, shares)) {
+		LOGERR(1, "generated block didn't pass verification");
+		return false;
+	}
+
+	measure("SideChain::verify", [&sc, &candidate, &shares]()
+		{
+			candidate.m_verified = false;
+			candidate.m_invalid = false;
+			sc.verify(&candidate, shares);
+			sc.verify_outputs(&candidate, shares);
+		});
+
+	std::vector<uint8_t> blob = candidate.m_mainChainData;
+	blob.insert(blob.end(), candidate.m_sideChainData.begin(), candidate.m_sideChainData.end());
+
+	{
+		PoolBlock b;
+		const int result = b.deserialize(blob.data(), blob.size(), sc);
+		if (result != 0) {
+			LOGERR(1, "PoolBlock::deserialize failed, error " << result);
+			return false;
+		}
+	}
+
+	measure("PoolBlock::deserialize", [&sc, &blob]() { PoolBlock b; b.deserialize(blob.data(), blob.size(), sc); });
+	measure("PoolBlockView::parse", [&blob]() { PoolBlockView view; view.parse(blob.data(), blob.size()); });
+
+	const hash txkey_sec = candidate.m_txkeySec;
+	Wallet& w = m_wallets.front();
+	size_t output_index = 0;
+	hash eph_public_key;
+
+	// Different output index every time, otherwise Wallet returns the cached key
+	measure("Wallet::get_eph_public_key", [&w, &txkey_sec, &output_index, &eph_public_key]() { w.get_eph_public_key(txkey_sec, output_index++, eph_public_key); });
+
+	std::vector<hash> eph_public_keys;
+	measure("SideChain::get_eph_public_keys", [&txkey_sec, &shares, &eph_public_keys]() { SideChain::get_eph_public_keys(txkey_sec, shares, eph_public_keys); });
+
+	uint8_t buf[4096];
+	for (size_t i = 0; i < sizeof(buf); ++i) {
+		buf[i] = static_cast<uint8_t>(m_rng());
+	}
+
+	uint8_t md[HASH_SIZE * MAX_LANES];
+	measure("keccak (64 bytes)", [&buf, &md]() { keccak(buf, 64, md, HASH_SIZE); });
+	measure("keccak (4096 bytes)", [&buf, &md]() { keccak(buf, sizeof(buf), md, HASH_SIZE); });
+	measure("keccak_multi (64 bytes x 8)", [&buf, &md]() { keccak_multi(buf, 64, md, MAX_LANES); });
+
+	return true;
+}
+
+bool Benchmark::save(const char* file_name) const
+{
+	FILE* f = fopen(file_name, "w");
+	if (!f) {
+		LOGERR(1, "couldn't open " << file_name << " for writing");
+		return false;
+	}
+
+	fprintf(f, "{\"benchmarks\":[");
+	for (size_t i = 0, n = m_results.size(); i < n; ++i) {
+		const Result& r = m_results[i];
+		fprintf(f, "%s\n{\"name\":\"%s\",\"iterations\":%" PRIu64 ",\"ns_per_op\":%.1f}", i ? "," : "", r.m_name, r.m_iterations, r.m_nsPerOp);
+	}
+	fprintf(f, "\n]}\n");
+
+	fclose(f);
+
+	LOGINFO(0, "results saved to " << file_name);
+	return true;
+}
+
+} // namespace p2pool
+
+static void usage()
+{
+	printf(
+		"\nUsage:\n\n" \
+		"--wallets            Number of miner wallets in the generated sidechain, default is 500\n"
+		"--transactions       Number of transactions in the generated mempool, default is 2000\n"
+		"--clients            Number of hashing blobs per BlockTemplate::get_hashing_blobs call, default is 256\n"
+		"--time               Minimal time in milliseconds to run each benchmark, default is 500\n"
+		"--output             Name of the JSON file to write results to, default is p2pool_bench.json\n"
+		"--help               Show this help message\n\n"
+	);
+}
+
+int main(int argc, char* argv[])
+{
+	uint32_t num_wallets = 500;
+	uint32_t num_transactions = 2000;
+	uint32_t num_clients = 256;
+	uint32_t min_time_ms = 500;
+	const char* output = "p2pool_bench.json";
+
+	for (int i = 1; i < argc; ++i) {
+		if ((strcmp(argv[i], "--wallets") == 0) && (i + 1 < argc)) {
+			num_wallets = std::max(atoi(argv[++i]), 1);
+		}
+		else if ((strcmp(argv[i], "--transactions") == 0) && (i + 1 < argc)) {
+			num_transactions = std::max(atoi(argv[++i]), 0);
+		}
+		else if ((strcmp(argv[i], "--clients") == 0) && (i + 1 < argc)) {
+			num_clients = std::max(atoi(argv[++i]), 1);
+		}
+		else if ((strcmp(argv[i], "--time") == 0) && (i + 1 < argc)) {
+			min_time_ms = std::max(atoi(argv[++i]), 1);
+		}
+		else if ((strcmp(argv[i], "--output") == 0) && (i + 1 < argc)) {
+			output = argv[++i];
+		}
+		else {
+			usage();
+			return 0;
+		}
+	}
+
+	char* pool_argv[] = {
+		const_cast<char*>("p2pool_bench"),
+		const_cast<char*>("--wallet"), const_cast<char*>(bench_wallet),
+		const_cast<char*>("--light-mode"),
+		const_cast<char*>("--no-cache"),
+		const_cast<char*>("--loglevel"), const_cast<char*>("1"),
+		nullptr
+	};
+
+	p2pool::p2pool pool(static_cast<int>(p2pool::array_size(pool_argv) - 1), pool_argv);
+	p2pool::Benchmark bench(&pool, num_wallets, num_transactions, num_clients, min_time_ms);
+
+	if (!bench.run() || !bench.save(output)) {
+		return 1;
+	}
+
+	return 0;
+}
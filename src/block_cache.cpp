@@ -0,0 +1,388 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "block_cache.h"
+#include "pool_block.h"
+#include "keccak.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+static constexpr char log_category_prefix[] = "BlockCache ";
+static constexpr char cache_file_name[] = "p2pool.cache";
+static constexpr char cache_magic[8] = { 'P', '2', 'P', 'C', 'A', 'C', 'H', 'E' };
+
+constexpr uint32_t CACHE_VERSION = 3;
+constexpr uint64_t MIN_CAPACITY = 64ULL << 20;
+constexpr uint64_t MAX_CAPACITY = 4ULL << 30;
+
+// Same limit as in PoolBlock::deserialize()
+constexpr uint64_t MAX_BLOCK_SIZE = 128 * 1024;
+
+namespace p2pool {
+
+BlockCache::BlockCache(const std::vector<uint8_t>& consensus_id)
+#ifdef _WIN32
+	: m_file(INVALID_HANDLE_VALUE)
+	, m_mapping(nullptr)
+#else
+	: m_file(-1)
+#endif
+	, m_data(nullptr)
+	, m_capacity(0)
+	, m_removedSize(0)
+{
+	uv_mutex_init_checked(&m_lock);
+
+	if (consensus_id.size() == HASH_SIZE) {
+		memcpy(m_consensusId.h, consensus_id.data(), HASH_SIZE);
+	}
+
+	uint64_t file_size = 0;
+
+#ifdef _WIN32
+	m_file = CreateFileA(cache_file_name, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (m_file == INVALID_HANDLE_VALUE) {
+		LOGERR(1, "couldn't open " << cache_file_name << ", error " << static_cast<uint32_t>(GetLastError()));
+		return;
+	}
+
+	LARGE_INTEGER size;
+	if (GetFileSizeEx(m_file, &size)) {
+		file_size = static_cast<uint64_t>(size.QuadPart);
+	}
+#else
+	m_file = open(cache_file_name, O_RDWR | O_CREAT, 0600);
+	if (m_file < 0) {
+		LOGERR(1, "couldn't open " << cache_file_name << ", error " << errno);
+		return;
+	}
+
+	struct stat st;
+	if (fstat(m_file, &st) == 0) {
+		file_size = static_cast<uint64_t>(st.st_size);
+	}
+#endif
+
+	if (!map(std::min(std::max(file_size, MIN_CAPACITY), MAX_CAPACITY))) {
+		return;
+	}
+
+	if (!load_index()) {
+		LOGINFO(1, "creating new " << cache_file_name);
+		reset();
+	}
+
+	LOGINFO(1, "found " << m_index.size() << " cached blocks");
+}
+
+BlockCache::~BlockCache()
+{
+	flush();
+	unmap();
+
+#ifdef _WIN32
+	if (m_file != INVALID_HANDLE_VALUE) {
+		CloseHandle(m_file);
+	}
+#else
+	if (m_file >= 0) {
+		close(m_file);
+	}
+#endif
+
+	uv_mutex_destroy(&m_lock);
+}
+
+void BlockCache::store(const PoolBlock& block, const hash* seed, const hash* pow_hash)
+{
+	const uint64_t size = block.m_mainChainData.size() + block.m_sideChainData.size();
+	if (size > MAX_BLOCK_SIZE) {
+		LOGWARN(4, "block " << block.m_sidechainId << " is too big to be cached");
+		return;
+	}
+
+	MutexLock lock(m_lock);
+
+	if (!m_data || (m_index.find(block.m_sidechainId) != m_index.end())) {
+		return;
+	}
+
+	const uint64_t n = record_size(size);
+
+	if (sizeof(Header) + header()->m_dataSize + n > m_capacity) {
+		// Growing the file is cheaper than moving everything to reclaim a few removed blocks
+		if (m_removedSize >= m_capacity / 4) {
+			compact_nolock();
+		}
+
+		const uint64_t required_capacity = sizeof(Header) + header()->m_dataSize + n;
+		if (required_capacity > m_capacity) {
+			uint64_t new_capacity = m_capacity * 2;
+			while (new_capacity < required_capacity) {
+				new_capacity *= 2;
+			}
+
+			if ((new_capacity > MAX_CAPACITY) || !map(new_capacity)) {
+				LOGWARN(1, "couldn't grow " << cache_file_name << " to " << new_capacity << " bytes");
+				return;
+			}
+		}
+	}
+
+	const uint64_t offset = sizeof(Header) + header()->m_dataSize;
+	Record* r = record(offset);
+
+	r->m_size = static_cast<uint32_t>(size);
+	r->m_flags = 0;
+	r->m_id = block.m_sidechainId;
+
+	if (seed && pow_hash) {
+		r->m_flags |= Record::HAS_POW;
+		r->m_seed = *seed;
+		r->m_powHash = *pow_hash;
+	}
+	else {
+		r->m_seed = {};
+		r->m_powHash = {};
+	}
+
+	uint8_t* p = reinterpret_cast<uint8_t*>(r + 1);
+	memcpy(p, block.m_mainChainData.data(), block.m_mainChainData.size());
+	p += block.m_mainChainData.size();
+	memcpy(p, block.m_sideChainData.data(), block.m_sideChainData.size());
+	p += block.m_sideChainData.size();
+	memset(p, 0, n - sizeof(Record) - size);
+
+	r->m_checksum = checksum(r);
+
+	// The record becomes visible only after it's fully written
+	header()->m_dataSize += n;
+	m_index.emplace(block.m_sidechainId, offset);
+}
+
+hash BlockCache::checksum(const Record* r)
+{
+	const uint8_t* data = reinterpret_cast<const uint8_t*>(r + 1);
+	const uint32_t size = r->m_size;
+
+	hash result;
+	keccak_custom(
+		[data, size, r](int offset) -> uint8_t
+		{
+			const uint32_t k = static_cast<uint32_t>(offset);
+			if (k < size) {
+				return data[k];
+			}
+			if (k < size + HASH_SIZE) {
+				return r->m_seed.h[k - size];
+			}
+			return r->m_powHash.h[k - size - HASH_SIZE];
+		},
+		static_cast<int>(size + HASH_SIZE * 2), result.h, HASH_SIZE);
+
+	return result;
+}
+
+void BlockCache::remove(const hash& id)
+{
+	MutexLock lock(m_lock);
+
+	auto it = m_index.find(id);
+	if (it == m_index.end()) {
+		return;
+	}
+
+	Record* r = record(it->second);
+	r->m_flags |= Record::REMOVED;
+	m_removedSize += record_size(r->m_size);
+
+	m_index.erase(it);
+}
+
+void BlockCache::compact()
+{
+	MutexLock lock(m_lock);
+
+	// Only compact when at least half of the stored data is gone
+	if (m_data && (m_removedSize * 2 > header()->m_dataSize)) {
+		compact_nolock();
+	}
+}
+
+void BlockCache::compact_nolock()
+{
+	if (!m_data || !m_removedSize) {
+		return;
+	}
+
+	const uint64_t end = sizeof(Header) + header()->m_dataSize;
+	uint64_t dst = sizeof(Header);
+
+	for (uint64_t src = sizeof(Header); src < end;) {
+		const Record* r = record(src);
+		const uint64_t n = record_size(r->m_size);
+
+		if (!(r->m_flags & Record::REMOVED)) {
+			if (dst != src) {
+				memmove(m_data + dst, m_data + src, n);
+				m_index[record(dst)->m_id] = dst;
+			}
+			dst += n;
+		}
+
+		src += n;
+	}
+
+	LOGINFO(4, "compacted " << cache_file_name << ": " << end - sizeof(Header) << " -> " << dst - sizeof(Header) << " bytes");
+
+	header()->m_dataSize = dst - sizeof(Header);
+	m_removedSize = 0;
+}
+
+void BlockCache::flush()
+{
+	MutexLock lock(m_lock);
+
+	if (!m_data) {
+		return;
+	}
+
+#ifdef _WIN32
+	FlushViewOfFile(m_data, 0);
+#else
+	msync(m_data, sizeof(Header) + header()->m_dataSize, MS_SYNC);
+#endif
+}
+
+bool BlockCache::map(uint64_t capacity)
+{
+	unmap();
+
+#ifdef _WIN32
+	m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READWRITE, static_cast<DWORD>(capacity >> 32), static_cast<DWORD>(capacity), nullptr);
+	if (!m_mapping) {
+		LOGERR(1, "CreateFileMapping failed, error " << static_cast<uint32_t>(GetLastError()));
+		return false;
+	}
+
+	m_data = reinterpret_cast<uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, capacity));
+	if (!m_data) {
+		LOGERR(1, "MapViewOfFile failed, error " << static_cast<uint32_t>(GetLastError()));
+		CloseHandle(m_mapping);
+		m_mapping = nullptr;
+		return false;
+	}
+#else
+	struct stat st;
+	if ((fstat(m_file, &st) != 0) || (static_cast<uint64_t>(st.st_size) < capacity)) {
+		if (ftruncate(m_file, static_cast<off_t>(capacity)) != 0) {
+			LOGERR(1, "ftruncate failed, error " << errno);
+			return false;
+		}
+	}
+
+	void* p = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, m_file, 0);
+	if (p == MAP_FAILED) {
+		LOGERR(1, "mmap failed, error " << errno);
+		return false;
+	}
+
+	m_data = reinterpret_cast<uint8_t*>(p);
+#endif
+
+	m_capacity = capacity;
+	return true;
+}
+
+void BlockCache::unmap()
+{
+	if (!m_data) {
+		return;
+	}
+
+#ifdef _WIN32
+	UnmapViewOfFile(m_data);
+	CloseHandle(m_mapping);
+	m_mapping = nullptr;
+#else
+	munmap(m_data, m_capacity);
+#endif
+
+	m_data = nullptr;
+	m_capacity = 0;
+}
+
+void BlockCache::reset()
+{
+	Header* h = header();
+	memcpy(h->m_magic, cache_magic, sizeof(h->m_magic));
+	h->m_version = CACHE_VERSION;
+	h->m_reserved = 0;
+	h->m_dataSize = 0;
+	h->m_consensusId = m_consensusId;
+
+	m_index.clear();
+	m_removedSize = 0;
+}
+
+bool BlockCache::load_index()
+{
+	Header* h = header();
+
+	if (memcmp(h->m_magic, cache_magic, sizeof(h->m_magic)) ||
+		(h->m_version != CACHE_VERSION) ||
+		(h->m_consensusId != m_consensusId) ||
+		(h->m_dataSize > m_capacity - sizeof(Header)))
+	{
+		return false;
+	}
+
+	m_index.clear();
+	m_removedSize = 0;
+
+	const uint64_t end = sizeof(Header) + h->m_dataSize;
+
+	for (uint64_t offset = sizeof(Header); offset < end;) {
+		Record* r = record(offset);
+
+		if ((end - offset < sizeof(Record)) || (r->m_size > MAX_BLOCK_SIZE) || (record_size(r->m_size) > end - offset)) {
+			LOGWARN(1, cache_file_name << " is corrupted at offset " << offset << ", discarding the rest of it");
+			h->m_dataSize = offset - sizeof(Header);
+			break;
+		}
+
+		const uint64_t n = record_size(r->m_size);
+
+		if ((r->m_flags & Record::REMOVED) || !m_index.emplace(r->m_id, offset).second) {
+			r->m_flags |= Record::REMOVED;
+			m_removedSize += n;
+		}
+
+		offset += n;
+	}
+
+	return true;
+}
+
+} // namespace p2pool
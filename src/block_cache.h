@@ -0,0 +1,124 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "uv_util.h"
+#include <unordered_map>
+
+namespace p2pool {
+
+struct PoolBlock;
+
+// Memory-mapped append-only storage for sidechain blocks
+// SideChain writes every new block here and marks pruned blocks as deleted
+// Space taken by deleted blocks is reclaimed by compacting the file in place
+class BlockCache : public nocopy_nomove
+{
+public:
+	explicit BlockCache(const std::vector<uint8_t>& consensus_id);
+	~BlockCache();
+
+	FORCEINLINE bool ok() const { return m_data != nullptr; }
+
+	// PoW hash is saved with the block if it's known, so it doesn't need to be calculated again after restart
+	void store(const PoolBlock& block, const hash* seed = nullptr, const hash* pow_hash = nullptr);
+	void remove(const hash& id);
+	void compact();
+	void flush();
+
+	// Calls "callback(data, size, seed, pow_hash)" for every stored block, oldest first
+	// seed and pow_hash are nullptr if the block was stored without them or if the record's checksum doesn't match
+	template<typename T>
+	void load_all(T&& callback)
+	{
+		MutexLock lock(m_lock);
+
+		if (!m_data) {
+			return;
+		}
+
+		for (uint64_t offset = sizeof(Header), end = sizeof(Header) + header()->m_dataSize; offset < end;) {
+			const Record* r = record(offset);
+			if (!(r->m_flags & Record::REMOVED)) {
+				const bool has_pow = (r->m_flags & Record::HAS_POW) && (checksum(r) == r->m_checksum);
+				callback(reinterpret_cast<const uint8_t*>(r + 1), static_cast<size_t>(r->m_size), has_pow ? &r->m_seed : nullptr, has_pow ? &r->m_powHash : nullptr);
+			}
+			offset += record_size(r->m_size);
+		}
+	}
+
+private:
+	struct Header
+	{
+		char m_magic[8];
+		uint32_t m_version;
+		uint32_t m_reserved;
+		uint64_t m_dataSize;
+		hash m_consensusId;
+	};
+
+	struct Record
+	{
+		enum { REMOVED = 1, HAS_POW = 2 };
+
+		uint32_t m_size;
+		uint32_t m_flags;
+		hash m_id;
+		hash m_seed;
+		hash m_powHash;
+
+		// keccak of the block data, m_seed and m_powHash
+		hash m_checksum;
+	};
+
+	static_assert(sizeof(Header) % 8 == 0, "BlockCache::Header has invalid size, check your compiler options");
+	static_assert(sizeof(Record) % 8 == 0, "BlockCache::Record has invalid size, check your compiler options");
+
+	static FORCEINLINE uint64_t record_size(uint64_t size) { return sizeof(Record) + ((size + 7) & ~static_cast<uint64_t>(7)); }
+
+	FORCEINLINE Header* header() const { return reinterpret_cast<Header*>(m_data); }
+	FORCEINLINE Record* record(uint64_t offset) const { return reinterpret_cast<Record*>(m_data + offset); }
+
+	static hash checksum(const Record* r);
+
+	void compact_nolock();
+	bool map(uint64_t capacity);
+	void unmap();
+	void reset();
+	bool load_index();
+
+	uv_mutex_t m_lock;
+
+#ifdef _WIN32
+	HANDLE m_file;
+	HANDLE m_mapping;
+#else
+	int m_file;
+#endif
+
+	uint8_t* m_data;
+	uint64_t m_capacity;
+
+	hash m_consensusId;
+
+	// Offsets of all stored blocks which are not removed
+	std::unordered_map<hash, uint64_t> m_index;
+	uint64_t m_removedSize;
+};
+
+} // namespace p2pool
@@ -36,9 +36,8 @@ static constexpr char log_category_prefix[] = "BlockTemplate ";
 
 namespace p2pool {
 
-BlockTemplate::BlockTemplate(p2pool* pool)
-	: m_pool(pool)
-	, m_templateId(0)
+BlockTemplate::Job::Job()
+	: m_templateId(0)
 	, m_blockHeaderSize(0)
 	, m_minerTxOffsetInTemplate(0)
 	, m_minerTxSize(0)
@@ -50,26 +49,34 @@ BlockTemplate::BlockTemplate(p2pool* pool)
 	, m_difficulty{}
 	, m_seedHash{}
 	, m_timestamp(0)
+	, m_minerTxKeccakState{}
+	, m_minerTxKeccakStateInputLength(0)
 	, m_poolBlockTemplate(new PoolBlock())
 	, m_nextPayout(0)
 {
-	uv_rwlock_init_checked(&m_lock);
+}
+
+BlockTemplate::Job::~Job()
+{
+	delete m_poolBlockTemplate;
+}
+
+BlockTemplate::BlockTemplate(p2pool* pool)
+	: m_pool(pool)
+	, m_templateId(0)
+	, m_job(std::make_shared<Job>())
+{
+	uv_mutex_init_checked(&m_updateLock);
 
 	m_blockHeader.reserve(64);
 	m_minerTx.reserve(49152);
 	m_minerTxExtra.reserve(64);
 	m_transactionHashes.reserve(8192);
 	m_rewards.reserve(100);
-	m_blockTemplateBlob.reserve(65536);
-	m_merkleTreeMainBranch.reserve(HASH_SIZE * 10);
 	m_mempoolTxs.reserve(1024);
 	m_mempoolTxsOrder.reserve(1024);
 	m_shares.reserve(m_pool->side_chain().chain_window_size() * 2);
 
-	for (size_t i = 0; i < array_size(m_oldTemplates); ++i) {
-		m_oldTemplates[i] = new BlockTemplate(*this);
-	}
-
 #if TEST_MEMPOOL_PICKING_ALGORITHM
 	m_knapsack.reserve(512 * 309375);
 #endif
@@ -79,71 +86,7 @@ BlockTemplate::BlockTemplate(p2pool* pool)
 
 BlockTemplate::~BlockTemplate()
 {
-	for (size_t i = 0; i < array_size(m_oldTemplates); ++i) {
-		delete m_oldTemplates[i];
-	}
-
-	uv_rwlock_destroy(&m_lock);
-
-	delete m_poolBlockTemplate;
-}
-
-BlockTemplate::BlockTemplate(const BlockTemplate& b)
-	: m_poolBlockTemplate(new PoolBlock())
-{
-	uv_rwlock_init_checked(&m_lock);
-	*this = b;
-}
-
-BlockTemplate& BlockTemplate::operator=(const BlockTemplate& b)
-{
-	if (this == &b) {
-		return *this;
-	}
-
-	WriteLock lock(m_lock);
-
-	// b.m_lock should already be locked here, but try to lock it for reading anyway
-	const int lock_result = uv_rwlock_tryrdlock(&b.m_lock);
-
-	m_pool = b.m_pool;
-	m_templateId = b.m_templateId;
-	m_blockTemplateBlob = b.m_blockTemplateBlob;
-	m_merkleTreeMainBranch = b.m_merkleTreeMainBranch;
-	m_blockHeaderSize = b.m_blockHeaderSize;
-	m_minerTxOffsetInTemplate = b.m_minerTxOffsetInTemplate;
-	m_minerTxSize = b.m_minerTxSize;
-	m_nonceOffset = b.m_nonceOffset;
-	m_extraNonceOffsetInTemplate = b.m_extraNonceOffsetInTemplate;
-	m_numTransactionHashes = b.m_numTransactionHashes;
-	m_prevId = b.m_prevId;
-	m_height = b.m_height;
-	m_difficulty = b.m_difficulty;
-	m_seedHash = b.m_seedHash;
-	m_timestamp = b.m_timestamp;
-	m_txkeyPub = b.m_txkeyPub;
-	m_txkeySec = b.m_txkeySec;
-	*m_poolBlockTemplate = *b.m_poolBlockTemplate;
-	m_nextPayout = b.m_nextPayout;
-
-	m_minerTx.clear();
-	m_blockHeader.clear();
-	m_minerTxExtra.clear();
-	m_transactionHashes.clear();
-	m_rewards.clear();
-	m_mempoolTxs.clear();
-	m_mempoolTxsOrder.clear();
-	m_shares.clear();
-
-#if TEST_MEMPOOL_PICKING_ALGORITHM
-	m_knapsack.clear();
-#endif
-
-	if (lock_result == 0) {
-		uv_rwlock_rdunlock(&b.m_lock);
-	}
-
-	return *this;
+	uv_mutex_destroy(&m_updateLock);
 }
 
 static FORCEINLINE uint64_t get_base_reward(uint64_t already_generated_coins)
@@ -184,21 +127,16 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 		return;
 	}
 
-	// Block template construction is relatively slow, but it's better to keep the lock the whole time
-	// instead of using temporary variables and making a quick swap in the end
-	// 
-	// All readers will line up for the new template instead of using the outdated template
-	WriteLock lock(m_lock);
+	// Block template construction is relatively slow, so it's built into a new Job object
+	// Readers keep using the previous template until the new one is published in the end
+	MutexLock lock(m_updateLock);
 
-	if (m_templateId > 0) {
-		*m_oldTemplates[m_templateId % array_size(m_oldTemplates)] = *this;
-	}
-
-	++m_templateId;
+	std::shared_ptr<Job> job = std::make_shared<Job>();
+	job->m_templateId = ++m_templateId;
 
-	m_height = data.height;
-	m_difficulty = data.difficulty;
-	m_seedHash = data.seed_hash;
+	job->m_height = data.height;
+	job->m_difficulty = data.difficulty;
+	job->m_seedHash = data.seed_hash;
 
 	{
 		ReadLock mempool_lock(mempool.m_lock);
@@ -222,37 +160,37 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 		", weight = " << log::Gray() << total_tx_weight);
 
 	m_blockHeader.clear();
-	m_poolBlockTemplate->m_verified = false;
+	job->m_poolBlockTemplate->m_verified = false;
 
 	// Major and minor hardfork version
 	m_blockHeader.push_back(data.major_version);
 	m_blockHeader.push_back(HARDFORK_SUPPORTED_VERSION);
-	m_poolBlockTemplate->m_majorVersion = data.major_version;
-	m_poolBlockTemplate->m_minorVersion = HARDFORK_SUPPORTED_VERSION;
+	job->m_poolBlockTemplate->m_majorVersion = data.major_version;
+	job->m_poolBlockTemplate->m_minorVersion = HARDFORK_SUPPORTED_VERSION;
 
 	// Timestamp
-	m_timestamp = time(nullptr);
-	if (m_timestamp <= data.median_timestamp) {
-		LOGWARN(2, "timestamp adjusted from " << m_timestamp << " to " << data.median_timestamp + 1 << ". Fix your system time!");
-		m_timestamp = data.median_timestamp + 1;
+	job->m_timestamp = time(nullptr);
+	if (job->m_timestamp <= data.median_timestamp) {
+		LOGWARN(2, "timestamp adjusted from " << job->m_timestamp << " to " << data.median_timestamp + 1 << ". Fix your system time!");
+		job->m_timestamp = data.median_timestamp + 1;
 	}
 
-	writeVarint(m_timestamp, m_blockHeader);
-	m_poolBlockTemplate->m_timestamp = m_timestamp;
+	writeVarint(job->m_timestamp, m_blockHeader);
+	job->m_poolBlockTemplate->m_timestamp = job->m_timestamp;
 
 	// Previous block id
 	m_blockHeader.insert(m_blockHeader.end(), data.prev_id.h, data.prev_id.h + HASH_SIZE);
-	m_prevId = data.prev_id;
-	m_poolBlockTemplate->m_prevId = m_prevId;
+	job->m_prevId = data.prev_id;
+	job->m_poolBlockTemplate->m_prevId = job->m_prevId;
 
 	// Miner nonce
-	m_nonceOffset = m_blockHeader.size();
+	job->m_nonceOffset = m_blockHeader.size();
 	m_blockHeader.insert(m_blockHeader.end(), NONCE_SIZE, 0);
-	m_poolBlockTemplate->m_nonce = 0;
+	job->m_poolBlockTemplate->m_nonce = 0;
 
-	m_blockHeaderSize = m_blockHeader.size();
+	job->m_blockHeaderSize = m_blockHeader.size();
 
-	m_pool->side_chain().fill_sidechain_data(*m_poolBlockTemplate, miner_wallet, m_txkeySec, m_shares);
+	m_pool->side_chain().fill_sidechain_data(*job->m_poolBlockTemplate, miner_wallet, m_txkeySec, m_shares);
 	if (!SideChain::split_reward(max_reward, m_shares, m_rewards)) {
 		return;
 	}
@@ -264,7 +202,7 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 			return a;
 		});
 
-	if (!create_miner_tx(data, m_shares, max_reward_amounts_weight, true)) {
+	if (!create_miner_tx(data, m_shares, max_reward_amounts_weight, true, *job)) {
 		return;
 	}
 
@@ -280,7 +218,7 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 
 	// if a block doesn't get into the penalty zone, just pick all transactions
 	if (total_tx_weight + miner_tx_weight <= data.median_weight) {
-		m_numTransactionHashes = 0;
+		job->m_numTransactionHashes = 0;
 
 		final_fees = 0;
 		final_weight = miner_tx_weight;
@@ -288,7 +226,7 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 		m_transactionHashes.assign(HASH_SIZE, 0);
 		for (const TxMempoolData& tx : m_mempoolTxs) {
 			m_transactionHashes.insert(m_transactionHashes.end(), tx.id.h, tx.id.h + HASH_SIZE);
-			++m_numTransactionHashes;
+			++job->m_numTransactionHashes;
 
 			final_fees += tx.fee;
 			final_weight += tx.weight;
@@ -363,7 +301,7 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 		final_fees = 0;
 		final_weight = miner_tx_weight;
 
-		m_numTransactionHashes = m_mempoolTxsOrder.size();
+		job->m_numTransactionHashes = m_mempoolTxsOrder.size();
 		m_transactionHashes.assign(HASH_SIZE, 0);
 		for (size_t i = 0; i < m_mempoolTxsOrder.size(); ++i) {
 			const TxMempoolData& tx = m_mempoolTxs[m_mempoolTxsOrder[i]];
@@ -379,11 +317,11 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 		}
 
 #if TEST_MEMPOOL_PICKING_ALGORITHM
-		LOGINFO(3, "final_reward = " << final_reward << ", transactions = " << m_numTransactionHashes << ", final_weight = " << final_weight);
+		LOGINFO(3, "final_reward = " << final_reward << ", transactions = " << job->m_numTransactionHashes << ", final_weight = " << final_weight);
 
 		uint64_t final_reward2;
-		fill_optimal_knapsack(data, base_reward, miner_tx_weight, final_reward2, final_fees, final_weight);
-		LOGINFO(3, "best_reward  = " << final_reward2 << ", transactions = " << m_numTransactionHashes << ", final_weight = " << final_weight);
+		fill_optimal_knapsack(data, base_reward, miner_tx_weight, final_reward2, final_fees, final_weight, *job);
+		LOGINFO(3, "best_reward  = " << final_reward2 << ", transactions = " << job->m_numTransactionHashes << ", final_weight = " << final_weight);
 		if (final_reward2 < final_reward) {
 			LOGERR(1, "fill_optimal_knapsack has a bug, found solution is not optimal. Fix it!");
 		}
@@ -409,15 +347,15 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 		return;
 	}
 
-	m_nextPayout = 0;
+	job->m_nextPayout = 0;
 	for (size_t i = 0, n = m_shares.size(); i < n; ++i) {
 		if (*m_shares[i].m_wallet == m_pool->params().m_wallet) {
-			m_nextPayout = m_rewards[i];
+			job->m_nextPayout = m_rewards[i];
 			break;
 		}
 	}
 
-	if (!create_miner_tx(data, m_shares, max_reward_amounts_weight, false)) {
+	if (!create_miner_tx(data, m_shares, max_reward_amounts_weight, false, *job)) {
 		return;
 	}
 
@@ -426,41 +364,42 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 		return;
 	}
 
-	m_blockTemplateBlob = m_blockHeader;
-	m_extraNonceOffsetInTemplate += m_blockHeader.size();
-	m_minerTxOffsetInTemplate = m_blockHeader.size();
-	m_minerTxSize = m_minerTx.size();
-	m_blockTemplateBlob.insert(m_blockTemplateBlob.end(), m_minerTx.begin(), m_minerTx.end());
-	writeVarint(m_numTransactionHashes, m_blockTemplateBlob);
+	job->m_blockTemplateBlob.reserve(m_blockHeader.size() + m_minerTx.size() + 16 + m_transactionHashes.size());
+	job->m_blockTemplateBlob = m_blockHeader;
+	job->m_extraNonceOffsetInTemplate += m_blockHeader.size();
+	job->m_minerTxOffsetInTemplate = m_blockHeader.size();
+	job->m_minerTxSize = m_minerTx.size();
+	job->m_blockTemplateBlob.insert(job->m_blockTemplateBlob.end(), m_minerTx.begin(), m_minerTx.end());
+	writeVarint(job->m_numTransactionHashes, job->m_blockTemplateBlob);
 
 	// Miner tx hash is skipped here because it's not a part of block template
-	m_blockTemplateBlob.insert(m_blockTemplateBlob.end(), m_transactionHashes.begin() + HASH_SIZE, m_transactionHashes.end());
+	job->m_blockTemplateBlob.insert(job->m_blockTemplateBlob.end(), m_transactionHashes.begin() + HASH_SIZE, m_transactionHashes.end());
 
-	m_poolBlockTemplate->m_transactions.clear();
-	m_poolBlockTemplate->m_transactions.resize(1);
-	m_poolBlockTemplate->m_transactions.reserve(m_mempoolTxsOrder.size() + 1);
+	job->m_poolBlockTemplate->m_transactions.clear();
+	job->m_poolBlockTemplate->m_transactions.resize(1);
+	job->m_poolBlockTemplate->m_transactions.reserve(m_mempoolTxsOrder.size() + 1);
 	for (size_t i = 0, n = m_mempoolTxsOrder.size(); i < n;  ++i) {
-		m_poolBlockTemplate->m_transactions.push_back(m_mempoolTxs[m_mempoolTxsOrder[i]].id);
+		job->m_poolBlockTemplate->m_transactions.push_back(m_mempoolTxs[m_mempoolTxsOrder[i]].id);
 	}
 
-	m_poolBlockTemplate->m_minerWallet = *miner_wallet;
+	job->m_poolBlockTemplate->m_minerWallet = *miner_wallet;
 
-	m_poolBlockTemplate->serialize_sidechain_data();
-	m_poolBlockTemplate->m_sidechainId = calc_sidechain_hash();
-	const int sidechain_hash_offset = static_cast<int>(m_extraNonceOffsetInTemplate + m_poolBlockTemplate->m_extraNonceSize) + 2;
+	job->m_poolBlockTemplate->serialize_sidechain_data();
+	job->m_poolBlockTemplate->m_sidechainId = calc_sidechain_hash(*job);
+	const int sidechain_hash_offset = static_cast<int>(job->m_extraNonceOffsetInTemplate + job->m_poolBlockTemplate->m_extraNonceSize) + 2;
 
-	memcpy(m_blockTemplateBlob.data() + sidechain_hash_offset, m_poolBlockTemplate->m_sidechainId.h, HASH_SIZE);
-	memcpy(m_minerTx.data() + sidechain_hash_offset - m_minerTxOffsetInTemplate, m_poolBlockTemplate->m_sidechainId.h, HASH_SIZE);
+	memcpy(job->m_blockTemplateBlob.data() + sidechain_hash_offset, job->m_poolBlockTemplate->m_sidechainId.h, HASH_SIZE);
+	memcpy(m_minerTx.data() + sidechain_hash_offset - job->m_minerTxOffsetInTemplate, job->m_poolBlockTemplate->m_sidechainId.h, HASH_SIZE);
 
-	m_poolBlockTemplate->serialize_mainchain_data(0, 0, m_poolBlockTemplate->m_sidechainId);
+	job->m_poolBlockTemplate->serialize_mainchain_data(0, 0, job->m_poolBlockTemplate->m_sidechainId);
 
 #if POOL_BLOCK_DEBUG
-	if (m_poolBlockTemplate->m_mainChainData != m_blockTemplateBlob) {
+	if (job->m_poolBlockTemplate->m_mainChainData != job->m_blockTemplateBlob) {
 		LOGERR(1, "serialize_mainchain_data() has a bug, fix it! ");
-		LOGERR(1, "m_poolBlockTemplate->m_mainChainData.size() = " << m_poolBlockTemplate->m_mainChainData.size());
-		LOGERR(1, "m_blockTemplateBlob.size()         = " << m_blockTemplateBlob.size());
-		for (size_t i = 0, n = std::min(m_poolBlockTemplate->m_mainChainData.size(), m_blockTemplateBlob.size()); i < n; ++i) {
-			if (m_poolBlockTemplate->m_mainChainData[i] != m_blockTemplateBlob[i]) {
+		LOGERR(1, "m_poolBlockTemplate->m_mainChainData.size() = " << job->m_poolBlockTemplate->m_mainChainData.size());
+		LOGERR(1, "m_blockTemplateBlob.size()         = " << job->m_blockTemplateBlob.size());
+		for (size_t i = 0, n = std::min(job->m_poolBlockTemplate->m_mainChainData.size(), job->m_blockTemplateBlob.size()); i < n; ++i) {
+			if (job->m_poolBlockTemplate->m_mainChainData[i] != job->m_blockTemplateBlob[i]) {
 				LOGERR(1, "m_poolBlockTemplate->m_mainChainData is different at offset " << i);
 				break;
 			}
@@ -468,8 +407,8 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 	}
 
 	{
-		std::vector<uint8_t> buf = m_blockTemplateBlob;
-		buf.insert(buf.end(), m_poolBlockTemplate->m_sideChainData.begin(), m_poolBlockTemplate->m_sideChainData.end());
+		std::vector<uint8_t> buf = job->m_blockTemplateBlob;
+		buf.insert(buf.end(), job->m_poolBlockTemplate->m_sideChainData.begin(), job->m_poolBlockTemplate->m_sideChainData.end());
 
 		PoolBlock check;
 		const int result = check.deserialize(buf.data(), buf.size(), m_pool->side_chain());
@@ -482,15 +421,16 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 	}
 #endif
 
-	const hash minerTx_hash = calc_miner_tx_hash(0);
+	job->init_miner_tx_keccak_state();
+	const hash minerTx_hash = job->calc_miner_tx_hash(0);
 
 	memcpy(m_transactionHashes.data(), minerTx_hash.h, HASH_SIZE);
 
-	calc_merkle_tree_main_branch();
+	calc_merkle_tree_main_branch(*job);
 
 	LOGINFO(3, "final reward = " << log::Gray() << final_reward << log::NoColor() <<
 		", weight = " << log::Gray() << final_weight << log::NoColor() <<
-		", " << log::Gray() << m_numTransactionHashes << log::NoColor() <<
+		", " << log::Gray() << job->m_numTransactionHashes << log::NoColor() <<
 		" of " << log::Gray() << m_mempoolTxs.size() << log::NoColor() << " transactions included");
 
 	m_minerTx.clear();
@@ -501,10 +441,18 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 	m_mempoolTxs.clear();
 	m_mempoolTxsOrder.clear();
 	m_shares.clear();
+
+	// Keep the current template reachable by its id before replacing it
+	std::shared_ptr<const Job> prev_job = std::atomic_load(&m_job);
+	if (prev_job->m_templateId > 0) {
+		std::atomic_store(&m_oldJobs[prev_job->m_templateId % array_size(m_oldJobs)], prev_job);
+	}
+
+	std::atomic_store(&m_job, std::shared_ptr<const Job>(std::move(job)));
 }
 
 #if TEST_MEMPOOL_PICKING_ALGORITHM
-void BlockTemplate::fill_optimal_knapsack(const MinerData& data, uint64_t base_reward, uint64_t miner_tx_weight, uint64_t& best_reward, uint64_t& final_fees, uint64_t& final_weight)
+void BlockTemplate::fill_optimal_knapsack(const MinerData& data, uint64_t base_reward, uint64_t miner_tx_weight, uint64_t& best_reward, uint64_t& final_fees, uint64_t& final_weight, Job& job)
 {
 	// Find the maximum possible fee for every weight value and remember which tx leads to this fee/weight
 	// Run time is O(N*W) where N is the number of transactions and W is the maximum block weight
@@ -561,7 +509,7 @@ void BlockTemplate::fill_optimal_knapsack(const MinerData& data, uint64_t base_r
 		}
 	}
 
-	m_numTransactionHashes = 0;
+	job.m_numTransactionHashes = 0;
 
 	final_fees = 0;
 	final_weight = miner_tx_weight;
@@ -573,7 +521,7 @@ void BlockTemplate::fill_optimal_knapsack(const MinerData& data, uint64_t base_r
 			m_mempoolTxsOrder.push_back(i - 1);
 			const TxMempoolData& tx = m_mempoolTxs[i - 1];
 			m_transactionHashes.insert(m_transactionHashes.end(), tx.id.h, tx.id.h + HASH_SIZE);
-			++m_numTransactionHashes;
+			++job.m_numTransactionHashes;
 			best_weight -= tx.weight;
 			final_fees += tx.fee;
 			final_weight += tx.weight;
@@ -584,7 +532,7 @@ void BlockTemplate::fill_optimal_knapsack(const MinerData& data, uint64_t base_r
 }
 #endif
 
-bool BlockTemplate::create_miner_tx(const MinerData& data, const std::vector<MinerShare>& shares, uint64_t max_reward_amounts_weight, bool dry_run)
+bool BlockTemplate::create_miner_tx(const MinerData& data, const std::vector<MinerShare>& shares, uint64_t max_reward_amounts_weight, bool dry_run, Job& job)
 {
 	// Miner transaction (coinbase)
 	m_minerTx.clear();
@@ -606,13 +554,18 @@ bool BlockTemplate::create_miner_tx(const MinerData& data, const std::vector<Min
 
 	// txin_gen height
 	writeVarint(data.height, m_minerTx);
-	m_poolBlockTemplate->m_txinGenHeight = data.height;
+	job.m_poolBlockTemplate->m_txinGenHeight = data.height;
 
 	// Number of outputs (1 output per miner)
 	writeVarint(num_outputs, m_minerTx);
 
-	m_poolBlockTemplate->m_outputs.clear();
-	m_poolBlockTemplate->m_outputs.reserve(num_outputs);
+	job.m_poolBlockTemplate->m_outputs.clear();
+	job.m_poolBlockTemplate->m_outputs.reserve(num_outputs);
+
+	std::vector<hash> eph_public_keys;
+	if (!dry_run) {
+		SideChain::get_eph_public_keys(m_txkeySec, shares, eph_public_keys);
+	}
 
 	uint64_t reward_amounts_weight = 0;
 	for (size_t i = 0; i < num_outputs; ++i) {
@@ -627,10 +580,9 @@ bool BlockTemplate::create_miner_tx(const MinerData& data, const std::vector<Min
 			m_minerTx.insert(m_minerTx.end(), HASH_SIZE, 0);
 		}
 		else {
-			hash eph_public_key;
-			shares[i].m_wallet->get_eph_public_key(m_txkeySec, i, eph_public_key);
+			const hash& eph_public_key = eph_public_keys[i];
 			m_minerTx.insert(m_minerTx.end(), eph_public_key.h, eph_public_key.h + HASH_SIZE);
-			m_poolBlockTemplate->m_outputs.emplace_back(m_rewards[i], eph_public_key);
+			job.m_poolBlockTemplate->m_outputs.emplace_back(m_rewards[i], eph_public_key);
 		}
 	}
 
@@ -645,8 +597,8 @@ bool BlockTemplate::create_miner_tx(const MinerData& data, const std::vector<Min
 		return false;
 	}
 
-	m_poolBlockTemplate->m_txkeyPub = m_txkeyPub;
-	m_poolBlockTemplate->m_txkeySec = m_txkeySec;
+	job.m_poolBlockTemplate->m_txkeyPub = m_txkeyPub;
+	job.m_poolBlockTemplate->m_txkeySec = m_txkeySec;
 
 	// TX_EXTRA begin
 	m_minerTxExtra.clear();
@@ -665,7 +617,7 @@ bool BlockTemplate::create_miner_tx(const MinerData& data, const std::vector<Min
 	uint64_t extraNonceOffsetInMinerTx = m_minerTxExtra.size();
 	m_minerTxExtra.insert(m_minerTxExtra.end(), corrected_extra_nonce_size, 0);
 
-	m_poolBlockTemplate->m_extraNonceSize = corrected_extra_nonce_size;
+	job.m_poolBlockTemplate->m_extraNonceSize = corrected_extra_nonce_size;
 
 	m_minerTxExtra.push_back(TX_EXTRA_MERGE_MINING_TAG);
 	writeVarint(HASH_SIZE, m_minerTxExtra);
@@ -674,7 +626,7 @@ bool BlockTemplate::create_miner_tx(const MinerData& data, const std::vector<Min
 
 	writeVarint(m_minerTxExtra.size(), m_minerTx);
 	extraNonceOffsetInMinerTx += m_minerTx.size();
-	m_extraNonceOffsetInTemplate = extraNonceOffsetInMinerTx;
+	job.m_extraNonceOffsetInTemplate = extraNonceOffsetInMinerTx;
 	m_minerTx.insert(m_minerTx.end(), m_minerTxExtra.begin(), m_minerTxExtra.end());
 
 	m_minerTxExtra.clear();
@@ -686,80 +638,92 @@ bool BlockTemplate::create_miner_tx(const MinerData& data, const std::vector<Min
 	return true;
 }
 
-hash BlockTemplate::calc_sidechain_hash() const
+hash BlockTemplate::calc_sidechain_hash(const Job& job) const
 {
 	// Calculate side-chain hash (all block template bytes + all side-chain bytes + consensus ID, replacing NONCE, EXTRA_NONCE and HASH itself with 0's)
 	hash sidechain_hash;
-	const int sidechain_hash_offset = static_cast<int>(m_extraNonceOffsetInTemplate + m_poolBlockTemplate->m_extraNonceSize) + 2;
-	const int blob_size = static_cast<int>(m_blockTemplateBlob.size());
+	const size_t sidechain_hash_offset = job.m_extraNonceOffsetInTemplate + job.m_poolBlockTemplate->m_extraNonceSize + 2;
 
+	const std::vector<uint8_t>& sidechain_data = job.m_poolBlockTemplate->m_sideChainData;
 	const std::vector<uint8_t>& consensus_id = m_pool->side_chain().consensus_id();
 
-	keccak_custom([this, sidechain_hash_offset, blob_size, consensus_id](int offset) -> uint8_t {
-			uint32_t k = static_cast<uint32_t>(offset - static_cast<int>(m_nonceOffset));
-			if (k < NONCE_SIZE) {
-				return 0;
-			}
+	std::vector<uint8_t> buf;
+	buf.reserve(job.m_blockTemplateBlob.size() + sidechain_data.size() + consensus_id.size());
+	buf.assign(job.m_blockTemplateBlob.begin(), job.m_blockTemplateBlob.end());
+	buf.insert(buf.end(), sidechain_data.begin(), sidechain_data.end());
+	buf.insert(buf.end(), consensus_id.begin(), consensus_id.end());
 
-			k = static_cast<uint32_t>(offset - static_cast<int>(m_extraNonceOffsetInTemplate));
-			if (k < EXTRA_NONCE_SIZE) {
-				return 0;
-			}
+	memset(buf.data() + job.m_nonceOffset, 0, NONCE_SIZE);
+	memset(buf.data() + job.m_extraNonceOffsetInTemplate, 0, EXTRA_NONCE_SIZE);
+	memset(buf.data() + sidechain_hash_offset, 0, HASH_SIZE);
 
-			k = static_cast<uint32_t>(offset - sidechain_hash_offset);
-			if (k < HASH_SIZE) {
-				return 0;
-			}
+	keccak(buf.data(), static_cast<int>(buf.size()), sidechain_hash.h, HASH_SIZE);
 
-			if (offset < blob_size) {
-				return m_blockTemplateBlob[offset];
-			}
+	return sidechain_hash;
+}
 
-			const int side_chain_data_offsset = offset - blob_size;
-			const int side_chain_data_size = static_cast<int>(m_poolBlockTemplate->m_sideChainData.size());
-			if (side_chain_data_offsset < side_chain_data_size) {
-				return m_poolBlockTemplate->m_sideChainData[side_chain_data_offsset];
-			}
+void BlockTemplate::Job::init_miner_tx_keccak_state()
+{
+	// Absorb all full keccak blocks before extra_nonce once per template
+	const uint8_t* data = m_blockTemplateBlob.data() + m_minerTxOffsetInTemplate;
+	const uint8_t* in = data;
+	int inlen = static_cast<int>(m_extraNonceOffsetInTemplate - m_minerTxOffsetInTemplate);
 
-			const int consensus_id_offset = side_chain_data_offsset - side_chain_data_size;
-			return consensus_id[consensus_id_offset];
-		},
-		static_cast<int>(m_blockTemplateBlob.size() + m_poolBlockTemplate->m_sideChainData.size() + consensus_id.size()), sidechain_hash.h, HASH_SIZE);
+	memset(m_minerTxKeccakState, 0, sizeof(m_minerTxKeccakState));
+	keccak_step(in, inlen, m_minerTxKeccakState);
 
-	return sidechain_hash;
+	m_minerTxKeccakStateInputLength = static_cast<int>(in - data);
 }
 
-hash BlockTemplate::calc_miner_tx_hash(uint32_t extra_nonce) const
+// Hash of the base RCT part of the miner tx (single 0 byte)
+static constexpr uint8_t known_second_hash[HASH_SIZE] = {
+	188,54,120,158,122,30,40,20,54,70,66,41,130,143,129,125,102,18,247,180,119,214,101,145,255,150,169,224,100,188,201,138
+};
+
+hash BlockTemplate::Job::calc_miner_tx_hash(uint32_t extra_nonce) const
 {
 	// Calculate 3 partial hashes
 	uint8_t hashes[HASH_SIZE * 3];
 
-	const uint8_t* data = m_blockTemplateBlob.data() + m_minerTxOffsetInTemplate;
-
-	const int extra_nonce_offset = static_cast<int>(m_extraNonceOffsetInTemplate - m_minerTxOffsetInTemplate);
-	const uint8_t extra_nonce_buf[EXTRA_NONCE_SIZE] = {
-		static_cast<uint8_t>(extra_nonce >> 0),
-		static_cast<uint8_t>(extra_nonce >> 8),
-		static_cast<uint8_t>(extra_nonce >> 16),
-		static_cast<uint8_t>(extra_nonce >> 24)
-	};
+	const int extra_nonce_offset = static_cast<int>(m_extraNonceOffsetInTemplate - m_minerTxOffsetInTemplate) - m_minerTxKeccakStateInputLength;
 
 	// 1. Prefix (everything except vin_rct_type byte in the end)
-	// Apply extra_nonce in-place because we can't write to the block template here
-	keccak_custom([this, data, extra_nonce_offset, &extra_nonce_buf](int offset)
-		{
-			const uint32_t k = static_cast<uint32_t>(offset - extra_nonce_offset);
-			if (k < EXTRA_NONCE_SIZE) {
-				return extra_nonce_buf[k];
-			}
-			return data[offset];
-		},
-		static_cast<int>(m_minerTxSize) - 1, hashes, HASH_SIZE);
+	// Start from the cached state, only the blocks from extra_nonce onwards are hashed here
+	uint64_t st[25];
+	memcpy(st, m_minerTxKeccakState, sizeof(st));
+
+	const uint8_t* in = m_blockTemplateBlob.data() + m_minerTxOffsetInTemplate + m_minerTxKeccakStateInputLength;
+	int inlen = static_cast<int>(m_minerTxSize) - 1 - m_minerTxKeccakStateInputLength;
+
+	// Apply extra_nonce to a copy of the block(s) it's in because we can't write to the block template here
+	constexpr int rsiz = KeccakParams::HASH_DATA_AREA;
+	alignas(8) uint8_t buf[rsiz * 2];
+
+	const int patched_size = std::min(inlen, ((extra_nonce_offset + EXTRA_NONCE_SIZE + rsiz - 1) / rsiz) * rsiz);
+	memcpy(buf, in, patched_size);
+
+	buf[extra_nonce_offset + 0] = static_cast<uint8_t>(extra_nonce >> 0);
+	buf[extra_nonce_offset + 1] = static_cast<uint8_t>(extra_nonce >> 8);
+	buf[extra_nonce_offset + 2] = static_cast<uint8_t>(extra_nonce >> 16);
+	buf[extra_nonce_offset + 3] = static_cast<uint8_t>(extra_nonce >> 24);
+
+	const uint8_t* p = buf;
+	int n = patched_size;
+	keccak_step(p, n, st);
+
+	if (patched_size < inlen) {
+		in += patched_size;
+		inlen -= patched_size;
+		keccak_step(in, inlen, st);
+		keccak_finish(in, inlen, st);
+	}
+	else {
+		keccak_finish(p, n, st);
+	}
+
+	memcpy(hashes, st, HASH_SIZE);
 
 	// 2. Base RCT, single 0 byte in miner tx
-	static constexpr uint8_t known_second_hash[HASH_SIZE] = {
-		188,54,120,158,122,30,40,20,54,70,66,41,130,143,129,125,102,18,247,180,119,214,101,145,255,150,169,224,100,188,201,138
-	};
 	memcpy(hashes + HASH_SIZE, known_second_hash, HASH_SIZE);
 
 	// 3. Prunable RCT, empty in miner tx
@@ -772,11 +736,11 @@ hash BlockTemplate::calc_miner_tx_hash(uint32_t extra_nonce) const
 	return result;
 }
 
-void BlockTemplate::calc_merkle_tree_main_branch()
+void BlockTemplate::calc_merkle_tree_main_branch(Job& job)
 {
-	m_merkleTreeMainBranch.clear();
+	job.m_merkleTreeMainBranch.clear();
 
-	const uint64_t count = m_numTransactionHashes + 1;
+	const uint64_t count = job.m_numTransactionHashes + 1;
 	const uint8_t* h = m_transactionHashes.data();
 
 	hash root_hash;
@@ -785,80 +749,90 @@ void BlockTemplate::calc_merkle_tree_main_branch()
 		memcpy(root_hash.h, h, HASH_SIZE);
 	}
 	else if (count == 2) {
-		m_merkleTreeMainBranch.insert(m_merkleTreeMainBranch.end(), h + HASH_SIZE, h + HASH_SIZE * 2);
+		job.m_merkleTreeMainBranch.insert(job.m_merkleTreeMainBranch.end(), h + HASH_SIZE, h + HASH_SIZE * 2);
 		keccak(h, HASH_SIZE * 2, root_hash.h, HASH_SIZE);
 	}
 	else {
-		size_t i, j, cnt;
+		size_t cnt;
 
-		for (i = 0, cnt = 1; cnt <= count; ++i, cnt <<= 1) {}
+		for (cnt = 1; cnt <= count; cnt <<= 1) {}
 
 		cnt >>= 1;
 
 		std::vector<uint8_t> ints(cnt * HASH_SIZE);
-		memcpy(ints.data(), h, (cnt * 2 - count) * HASH_SIZE);
 
-		for (i = cnt * 2 - count, j = cnt * 2 - count; j < cnt; i += 2, ++j) {
-			if (i == 0) {
-				m_merkleTreeMainBranch.insert(m_merkleTreeMainBranch.end(), h + HASH_SIZE, h + HASH_SIZE * 2);
-			}
-			keccak(h + i * HASH_SIZE, HASH_SIZE * 2, ints.data() + j * HASH_SIZE, HASH_SIZE);
+		const size_t k = cnt * 2 - count;
+		memcpy(ints.data(), h, k * HASH_SIZE);
+
+		// Hashes on each tree level are independent, so they're calculated in parallel
+		if (k == 0) {
+			job.m_merkleTreeMainBranch.insert(job.m_merkleTreeMainBranch.end(), h + HASH_SIZE, h + HASH_SIZE * 2);
 		}
+		keccak_multi(h + k * HASH_SIZE, HASH_SIZE * 2, ints.data() + k * HASH_SIZE, static_cast<uint32_t>(cnt - k));
 
 		while (cnt > 2) {
 			cnt >>= 1;
-			for (i = 0, j = 0; j < cnt; i += 2, ++j) {
-				if (i == 0) {
-					m_merkleTreeMainBranch.insert(m_merkleTreeMainBranch.end(), ints.data() + HASH_SIZE, ints.data() + HASH_SIZE * 2);
-				}
-				keccak(ints.data() + i * HASH_SIZE, HASH_SIZE * 2, ints.data() + j * HASH_SIZE, HASH_SIZE);
-			}
+			job.m_merkleTreeMainBranch.insert(job.m_merkleTreeMainBranch.end(), ints.data() + HASH_SIZE, ints.data() + HASH_SIZE * 2);
+			keccak_multi(ints.data(), HASH_SIZE * 2, ints.data(), static_cast<uint32_t>(cnt));
 		}
 
-		m_merkleTreeMainBranch.insert(m_merkleTreeMainBranch.end(), ints.data() + HASH_SIZE, ints.data() + HASH_SIZE * 2);
+		job.m_merkleTreeMainBranch.insert(job.m_merkleTreeMainBranch.end(), ints.data() + HASH_SIZE, ints.data() + HASH_SIZE * 2);
 		keccak(ints.data(), HASH_SIZE * 2, root_hash.h, HASH_SIZE);
 	}
 }
 
-uint32_t BlockTemplate::get_hashing_blob(const uint32_t template_id, uint32_t extra_nonce, uint8_t (&blob)[128], uint64_t& height, difficulty_type& difficulty, difficulty_type& sidechain_difficulty, hash& seed_hash, size_t& nonce_offset) const
+std::shared_ptr<const BlockTemplate::Job> BlockTemplate::get_job(uint32_t template_id) const
 {
-	ReadLock lock(m_lock);
-
-	if (template_id == m_templateId) {
-		height = m_height;
-		difficulty = m_difficulty;
-		sidechain_difficulty = m_poolBlockTemplate->m_difficulty;
-		seed_hash = m_seedHash;
-		nonce_offset = m_nonceOffset;
+	std::shared_ptr<const Job> job = std::atomic_load(&m_job);
+	if (template_id == job->m_templateId) {
+		return job;
+	}
 
-		return get_hashing_blob_nolock(extra_nonce, blob);
+	job = std::atomic_load(&m_oldJobs[template_id % array_size(m_oldJobs)]);
+	if (job && (template_id == job->m_templateId)) {
+		return job;
 	}
 
-	const BlockTemplate* old = m_oldTemplates[template_id % array_size(m_oldTemplates)];
+	return std::shared_ptr<const Job>();
+}
 
-	if (old && (template_id == old->m_templateId)) {
-		return old->get_hashing_blob(template_id, extra_nonce, blob, height, difficulty, sidechain_difficulty, seed_hash, nonce_offset);
+uint32_t BlockTemplate::get_hashing_blob(const uint32_t template_id, uint32_t extra_nonce, uint8_t (&blob)[128], uint64_t& height, difficulty_type& difficulty, difficulty_type& sidechain_difficulty, hash& seed_hash, size_t& nonce_offset) const
+{
+	const std::shared_ptr<const Job> job = get_job(template_id);
+	if (!job) {
+		return 0;
 	}
 
-	return 0;
+	height = job->m_height;
+	difficulty = job->m_difficulty;
+	sidechain_difficulty = job->m_poolBlockTemplate->m_difficulty;
+	seed_hash = job->m_seedHash;
+	nonce_offset = job->m_nonceOffset;
+
+	return job->get_hashing_blob(extra_nonce, blob);
 }
 
 uint32_t BlockTemplate::get_hashing_blob(uint32_t extra_nonce, uint8_t (&blob)[128], uint64_t& height, difficulty_type& difficulty, difficulty_type& sidechain_difficulty, hash& seed_hash, size_t& nonce_offset, uint32_t& template_id) const
 {
-	ReadLock lock(m_lock);
+	const std::shared_ptr<const Job> job = std::atomic_load(&m_job);
 
-	height = m_height;
-	difficulty = m_difficulty;
-	sidechain_difficulty = m_poolBlockTemplate->m_difficulty;
-	seed_hash = m_seedHash;
-	nonce_offset = m_nonceOffset;
-	template_id = m_templateId;
+	height = job->m_height;
+	difficulty = job->m_difficulty;
+	sidechain_difficulty = job->m_poolBlockTemplate->m_difficulty;
+	seed_hash = job->m_seedHash;
+	nonce_offset = job->m_nonceOffset;
+	template_id = job->m_templateId;
 
-	return get_hashing_blob_nolock(extra_nonce, blob);
+	return job->get_hashing_blob(extra_nonce, blob);
 }
 
-uint32_t BlockTemplate::get_hashing_blob_nolock(uint32_t extra_nonce, uint8_t* blob) const
+uint32_t BlockTemplate::Job::get_hashing_blob(uint32_t extra_nonce, uint8_t* blob) const
 {
+	// No template was built yet
+	if (m_blockTemplateBlob.empty()) {
+		return 0;
+	}
+
 	uint8_t* p = blob;
 
 	// Block header
@@ -895,21 +869,83 @@ uint32_t BlockTemplate::get_hashing_blobs(uint32_t extra_nonce_start, uint32_t c
 		blobs.reserve(required_capacity * 2);
 	}
 
-	uint32_t blob_size = 0;
+	const std::shared_ptr<const Job> job = std::atomic_load(&m_job);
+
+	height = job->m_height;
+	difficulty = job->m_difficulty;
+	sidechain_difficulty = job->m_poolBlockTemplate->m_difficulty;
+	seed_hash = job->m_seedHash;
+	nonce_offset = job->m_nonceOffset;
+	template_id = job->m_templateId;
 
-	ReadLock lock(m_lock);
+	return job->get_hashing_blobs(extra_nonce_start, count, blobs);
+}
+
+uint32_t BlockTemplate::Job::get_hashing_blobs(uint32_t extra_nonce_start, uint32_t count, std::vector<uint8_t>& blobs) const
+{
+	// No template was built yet
+	if (m_blockTemplateBlob.empty() || !count) {
+		return 0;
+	}
+
+	// Same steps as in get_hashing_blob(), but every step hashes all blobs at once with keccak_multi()
+	const uint8_t* tail = m_blockTemplateBlob.data() + m_minerTxOffsetInTemplate + m_minerTxKeccakStateInputLength;
+	const int tail_size = static_cast<int>(m_minerTxSize) - 1 - m_minerTxKeccakStateInputLength;
+	const int extra_nonce_offset = static_cast<int>(m_extraNonceOffsetInTemplate - m_minerTxOffsetInTemplate) - m_minerTxKeccakStateInputLength;
 
-	height = m_height;
-	difficulty = m_difficulty;
-	sidechain_difficulty = m_poolBlockTemplate->m_difficulty;
-	seed_hash = m_seedHash;
-	nonce_offset = m_nonceOffset;
-	template_id = m_templateId;
+	std::vector<uint8_t> buf(static_cast<size_t>(count) * std::max<size_t>(tail_size, HASH_SIZE * 3));
+	std::vector<uint8_t> root_hashes(static_cast<size_t>(count) * HASH_SIZE);
+
+	// 1. Miner tx prefix, starting from the cached keccak state
+	for (uint32_t i = 0; i < count; ++i) {
+		const uint32_t extra_nonce = extra_nonce_start + i;
+		uint8_t* p = buf.data() + static_cast<size_t>(i) * tail_size;
+		memcpy(p, tail, tail_size);
+		p[extra_nonce_offset + 0] = static_cast<uint8_t>(extra_nonce >> 0);
+		p[extra_nonce_offset + 1] = static_cast<uint8_t>(extra_nonce >> 8);
+		p[extra_nonce_offset + 2] = static_cast<uint8_t>(extra_nonce >> 16);
+		p[extra_nonce_offset + 3] = static_cast<uint8_t>(extra_nonce >> 24);
+	}
+	keccak_multi(buf.data(), tail_size, root_hashes.data(), count, m_minerTxKeccakState);
+
+	// 2. Miner tx hashes
+	for (uint32_t i = 0; i < count; ++i) {
+		uint8_t* p = buf.data() + static_cast<size_t>(i) * HASH_SIZE * 3;
+		memcpy(p, root_hashes.data() + static_cast<size_t>(i) * HASH_SIZE, HASH_SIZE);
+		memcpy(p + HASH_SIZE, known_second_hash, HASH_SIZE);
+		memset(p + HASH_SIZE * 2, 0, HASH_SIZE);
+	}
+	keccak_multi(buf.data(), HASH_SIZE * 3, root_hashes.data(), count);
+
+	// 3. Merkle tree hashes
+	for (size_t k = 0; k < m_merkleTreeMainBranch.size(); k += HASH_SIZE) {
+		for (uint32_t i = 0; i < count; ++i) {
+			uint8_t* p = buf.data() + static_cast<size_t>(i) * HASH_SIZE * 2;
+			memcpy(p, root_hashes.data() + static_cast<size_t>(i) * HASH_SIZE, HASH_SIZE);
+			memcpy(p + HASH_SIZE, m_merkleTreeMainBranch.data() + k, HASH_SIZE);
+		}
+		keccak_multi(buf.data(), HASH_SIZE * 2, root_hashes.data(), count);
+	}
+
+	uint32_t blob_size = 0;
 
 	for (uint32_t i = 0; i < count; ++i) {
 		uint8_t blob[128];
-		blob_size = get_hashing_blob_nolock(extra_nonce_start + i, blob);
-		blobs.insert(blobs.end(), blob, blob + blob_size);
+		uint8_t* p = blob;
+
+		// Block header
+		memcpy(p, m_blockTemplateBlob.data(), m_blockHeaderSize);
+		p += m_blockHeaderSize;
+
+		// Merkle tree hash
+		memcpy(p, root_hashes.data() + static_cast<size_t>(i) * HASH_SIZE, HASH_SIZE);
+		p += HASH_SIZE;
+
+		// Total number of transactions in this block (including the miner tx)
+		writeVarint(m_numTransactionHashes + 1, [&p](uint8_t b) { *(p++) = b; });
+
+		blob_size = static_cast<uint32_t>(p - blob);
+		blobs.insert(blobs.end(), blob, p);
 	}
 
 	return blob_size;
@@ -917,77 +953,67 @@ uint32_t BlockTemplate::get_hashing_blobs(uint32_t extra_nonce_start, uint32_t c
 
 std::vector<uint8_t> BlockTemplate::get_block_template_blob(uint32_t template_id, size_t& nonce_offset, size_t& extra_nonce_offset) const
 {
-	ReadLock lock(m_lock);
-
-	if (template_id != m_templateId) {
-		const BlockTemplate* old = m_oldTemplates[template_id % array_size(m_oldTemplates)];
-		if (old && (template_id == old->m_templateId)) {
-			return old->get_block_template_blob(template_id, nonce_offset, extra_nonce_offset);
-		}
-
+	const std::shared_ptr<const Job> job = get_job(template_id);
+	if (!job) {
 		nonce_offset = 0;
 		extra_nonce_offset = 0;
 		return std::vector<uint8_t>();
 	}
 
-	nonce_offset = m_nonceOffset;
-	extra_nonce_offset = m_extraNonceOffsetInTemplate;
-	return m_blockTemplateBlob;
+	nonce_offset = job->m_nonceOffset;
+	extra_nonce_offset = job->m_extraNonceOffsetInTemplate;
+	return job->m_blockTemplateBlob;
 }
 
 void BlockTemplate::update_tx_keys()
 {
-	WriteLock lock(m_lock);
+	MutexLock lock(m_updateLock);
 
 	generate_keys(m_txkeyPub, m_txkeySec);
 }
 
 void BlockTemplate::submit_sidechain_block(uint32_t template_id, uint32_t nonce, uint32_t extra_nonce)
 {
-	WriteLock lock(m_lock);
+	const std::shared_ptr<const Job> job = get_job(template_id);
+	if (!job) {
+		return;
+	}
 
-	if (template_id == m_templateId) {
-		m_poolBlockTemplate->m_nonce = nonce;
-		m_poolBlockTemplate->m_extraNonce = extra_nonce;
-		memcpy(m_poolBlockTemplate->m_mainChainData.data() + m_nonceOffset, &nonce, NONCE_SIZE);
-		memcpy(m_poolBlockTemplate->m_mainChainData.data() + m_extraNonceOffsetInTemplate, &extra_nonce, NONCE_SIZE);
+	// Published templates are immutable, so nonce and extra_nonce go into a copy
+	PoolBlock block(*job->m_poolBlockTemplate);
 
-		SideChain& side_chain = m_pool->side_chain();
+	block.m_nonce = nonce;
+	block.m_extraNonce = extra_nonce;
+	memcpy(block.m_mainChainData.data() + job->m_nonceOffset, &nonce, NONCE_SIZE);
+	memcpy(block.m_mainChainData.data() + job->m_extraNonceOffsetInTemplate, &extra_nonce, NONCE_SIZE);
 
-#if POOL_BLOCK_DEBUG
-		{
-			std::vector<uint8_t> buf = m_poolBlockTemplate->m_mainChainData;
-			buf.insert(buf.end(), m_poolBlockTemplate->m_sideChainData.begin(), m_poolBlockTemplate->m_sideChainData.end());
+	SideChain& side_chain = m_pool->side_chain();
 
-			PoolBlock check;
-			const int result = check.deserialize(buf.data(), buf.size(), side_chain);
-			if (result != 0) {
-				LOGERR(1, "pool block blob generation and/or parsing is broken, error " << result);
-			}
+#if POOL_BLOCK_DEBUG
+	{
+		std::vector<uint8_t> buf = block.m_mainChainData;
+		buf.insert(buf.end(), block.m_sideChainData.begin(), block.m_sideChainData.end());
 
-			hash pow_hash;
-			if (!check.get_pow_hash(m_pool->hasher(), m_seedHash, pow_hash)) {
-				LOGERR(1, "PoW check failed for the sidechain block. Fix it! ");
-			}
-			else if (!check.m_difficulty.check_pow(pow_hash)) {
-				LOGERR(1, "Sidechain block has wrong PoW. Fix it! ");
-			}
+		PoolBlock check;
+		const int result = check.deserialize(buf.data(), buf.size(), side_chain);
+		if (result != 0) {
+			LOGERR(1, "pool block blob generation and/or parsing is broken, error " << result);
 		}
-#endif
 
-		m_poolBlockTemplate->m_verified = true;
-		if (!side_chain.block_seen(*m_poolBlockTemplate)) {
-			m_poolBlockTemplate->m_wantBroadcast = true;
-			side_chain.add_block(*m_poolBlockTemplate);
+		hash pow_hash;
+		if (!check.get_pow_hash(m_pool->hasher(), job->m_seedHash, pow_hash)) {
+			LOGERR(1, "PoW check failed for the sidechain block. Fix it! ");
+		}
+		else if (!check.m_difficulty.check_pow(pow_hash)) {
+			LOGERR(1, "Sidechain block has wrong PoW. Fix it! ");
 		}
-		return;
 	}
+#endif
 
-	BlockTemplate* old = m_oldTemplates[template_id % array_size(m_oldTemplates)];
-
-	if (old && (template_id == old->m_templateId)) {
-		old->submit_sidechain_block(template_id, nonce, extra_nonce);
-		return;
+	block.m_verified = true;
+	if (!side_chain.block_seen(block)) {
+		block.m_wantBroadcast = true;
+		side_chain.add_block(std::move(block));
 	}
 }
 
@@ -18,6 +18,7 @@
 #pragma once
 
 #include "uv_util.h"
+#include <memory>
 
 #define TEST_MEMPOOL_PICKING_ALGORITHM 0
 
@@ -29,15 +30,12 @@ class Wallet;
 struct PoolBlock;
 struct MinerShare;
 
-class BlockTemplate
+class BlockTemplate : public nocopy_nomove
 {
 public:
 	explicit BlockTemplate(p2pool* pool);
 	~BlockTemplate();
 
-	BlockTemplate(const BlockTemplate& b);
-	BlockTemplate& operator=(const BlockTemplate& b);
-
 	void update(const MinerData& data, const Mempool& mempool, Wallet* miner_wallet);
 
 	uint32_t get_hashing_blob(const uint32_t template_id, uint32_t extra_nonce, uint8_t (&blob)[128], uint64_t& height, difficulty_type& difficulty, difficulty_type& sidechain_difficulty, hash& seed_hash, size_t& nonce_offset) const;
@@ -48,56 +46,80 @@ public:
 	std::vector<uint8_t> get_block_template_blob(uint32_t template_id, size_t& nonce_offset, size_t& extra_nonce_offset) const;
 	void update_tx_keys();
 
-	FORCEINLINE uint64_t height() const { return m_height; }
-	FORCEINLINE time_t timestamp() const { return m_timestamp; }
-	FORCEINLINE difficulty_type difficulty() const { return m_difficulty; }
+	FORCEINLINE uint64_t height() const { return std::atomic_load(&m_job)->m_height; }
+	FORCEINLINE time_t timestamp() const { return std::atomic_load(&m_job)->m_timestamp; }
+	FORCEINLINE difficulty_type difficulty() const { return std::atomic_load(&m_job)->m_difficulty; }
 
 	void submit_sidechain_block(uint32_t template_id, uint32_t nonce, uint32_t extra_nonce);
 
-	FORCEINLINE uint64_t next_payout() const { return m_nextPayout; }
+	FORCEINLINE uint64_t next_payout() const { return std::atomic_load(&m_job)->m_nextPayout; }
 
 private:
 	p2pool* m_pool;
 
+	// p2pool_bench reads the finished template
+	friend class Benchmark;
+
 private:
-	bool create_miner_tx(const MinerData& data, const std::vector<MinerShare>& shares, uint64_t max_reward_amounts_weight, bool dry_run);
-	hash calc_sidechain_hash() const;
-	hash calc_miner_tx_hash(uint32_t extra_nonce) const;
-	void calc_merkle_tree_main_branch();
+	// Finished block template, never modified after it's published
+	struct Job : public nocopy_nomove
+	{
+		Job();
+		~Job();
 
-	uint32_t get_hashing_blob_nolock(uint32_t extra_nonce, uint8_t* blob) const;
+		void init_miner_tx_keccak_state();
+		hash calc_miner_tx_hash(uint32_t extra_nonce) const;
+		uint32_t get_hashing_blob(uint32_t extra_nonce, uint8_t* blob) const;
+		uint32_t get_hashing_blobs(uint32_t extra_nonce_start, uint32_t count, std::vector<uint8_t>& blobs) const;
 
-	mutable uv_rwlock_t m_lock;
+		uint32_t m_templateId;
 
-	uint32_t m_templateId;
+		std::vector<uint8_t> m_blockTemplateBlob;
+		std::vector<uint8_t> m_merkleTreeMainBranch;
 
-	std::vector<uint8_t> m_blockTemplateBlob;
-	std::vector<uint8_t> m_merkleTreeMainBranch;
+		size_t m_blockHeaderSize;
+		size_t m_minerTxOffsetInTemplate;
+		size_t m_minerTxSize;
+		size_t m_nonceOffset;
+		size_t m_extraNonceOffsetInTemplate;
 
-	size_t m_blockHeaderSize;
-	size_t m_minerTxOffsetInTemplate;
-	size_t m_minerTxSize;
-	size_t m_nonceOffset;
-	size_t m_extraNonceOffsetInTemplate;
+		size_t m_numTransactionHashes;
+		hash m_prevId;
+		uint64_t m_height;
+		difficulty_type m_difficulty;
+		hash m_seedHash;
 
-	size_t m_numTransactionHashes;
-	hash m_prevId;
-	uint64_t m_height;
-	difficulty_type m_difficulty;
-	hash m_seedHash;
+		uint64_t m_timestamp;
 
-	uint64_t m_timestamp;
+		// Keccak state after absorbing the first m_minerTxKeccakStateInputLength bytes of the miner tx
+		uint64_t m_minerTxKeccakState[25];
+		int m_minerTxKeccakStateInputLength;
 
-	hash m_txkeyPub;
-	hash m_txkeySec;
+		PoolBlock* m_poolBlockTemplate;
+
+		uint64_t m_nextPayout;
+	};
 
-	PoolBlock* m_poolBlockTemplate;
+	bool create_miner_tx(const MinerData& data, const std::vector<MinerShare>& shares, uint64_t max_reward_amounts_weight, bool dry_run, Job& job);
+	hash calc_sidechain_hash(const Job& job) const;
+	void calc_merkle_tree_main_branch(Job& job);
 
-	BlockTemplate* m_oldTemplates[4] = {};
+	std::shared_ptr<const Job> get_job(uint32_t template_id) const;
+
+	// Serializes update() and update_tx_keys(), readers never take it
+	uv_mutex_t m_updateLock;
+
+	uint32_t m_templateId;
+
+	hash m_txkeyPub;
+	hash m_txkeySec;
 
-	uint64_t m_nextPayout;
+	// Current template and a ring of previous templates for shares submitted with old template ids
+	// Both are only accessed with std::atomic_load/std::atomic_store
+	std::shared_ptr<const Job> m_job;
+	std::shared_ptr<const Job> m_oldJobs[4];
 
-	// Temp vectors, will be cleaned up after use and skipped in copy constructor/assignment operators
+	// Temp vectors used by update(), will be cleaned up after use
 	std::vector<uint8_t> m_minerTx;
 	std::vector<uint8_t> m_blockHeader;
 	std::vector<uint8_t> m_minerTxExtra;
@@ -108,7 +130,7 @@ private:
 	std::vector<MinerShare> m_shares;
 
 #if TEST_MEMPOOL_PICKING_ALGORITHM
-	void fill_optimal_knapsack(const MinerData& data, uint64_t base_reward, uint64_t miner_tx_weight, uint64_t& best_reward, uint64_t& final_fees, uint64_t& final_weight);
+	void fill_optimal_knapsack(const MinerData& data, uint64_t base_reward, uint64_t miner_tx_weight, uint64_t& best_reward, uint64_t& final_fees, uint64_t& final_weight, Job& job);
 
 	std::vector<uint32_t> m_knapsack;
 #endif
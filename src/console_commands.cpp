@@ -21,6 +21,7 @@
 #include "stratum_server.h"
 #include "p2p_server.h"
 #include "side_chain.h"
+#include "hashing_executor.h"
 #include <iostream>
 
 static constexpr char log_category_prefix[] = "ConsoleCommands ";
@@ -62,6 +63,7 @@ void ConsoleCommands::run()
 	constexpr char loglevel[]  = "loglevel";
 	constexpr char addpeers[]  = "addpeers";
 	constexpr char droppeers[] = "droppeers";
+	constexpr char dump_workers[] = "dump_workers";
 
 	do {
 		std::getline(std::cin, command);
@@ -77,6 +79,7 @@ void ConsoleCommands::run()
 			if (m_pool->p2p_server()) {
 				m_pool->p2p_server()->print_status();
 			}
+			m_pool->hashing_executor()->print_status();
 			continue;
 		}
 
@@ -102,6 +105,14 @@ void ConsoleCommands::run()
 			continue;
 		}
 
+		if (command.find(dump_workers) == 0) {
+			if (m_pool->stratum_server()) {
+				const char* file_name = (command.length() > sizeof(dump_workers)) ? (command.c_str() + sizeof(dump_workers)) : "p2pool_workers.json";
+				m_pool->stratum_server()->dump_workers(file_name);
+			}
+			continue;
+		}
+
 		LOGWARN(0, "Unknown command " << command);
 	} while (true);
 }
@@ -20,6 +20,7 @@
 #include "keccak.h"
 #include "uv_util.h"
 #include <random>
+#include <unordered_map>
 
 extern "C" {
 #include "crypto-ops.h"
@@ -164,4 +165,226 @@ bool derive_public_key(const hash& derivation, size_t output_index, const hash&
 	return true;
 }
 
+namespace {
+
+// txkey_sec is public in P2Pool (it's a part of sidechain data), so variable-time scalar multiplication is safe to use with it
+// Public keys are decompressed once, and the results are shared by all block templates and verifications
+class KeyCache : public nocopy_nomove
+{
+public:
+	KeyCache()
+		: m_maxDerivations(MIN_DERIVATIONS)
+		, m_maxPublicKeys(MIN_PUBLIC_KEYS)
+	{
+		uv_rwlock_init_checked(&m_lock);
+	}
+
+	~KeyCache()
+	{
+		uv_rwlock_destroy(&m_lock);
+	}
+
+	void derive_eph_public_keys(const hash& txkey_sec, const std::vector<hash>& view_keys, const std::vector<hash>& spend_keys, std::vector<hash>& eph_public_keys)
+	{
+		const size_t n = std::min(view_keys.size(), spend_keys.size());
+
+		eph_public_keys.clear();
+		eph_public_keys.resize(n);
+
+		std::vector<Output> outputs(n);
+
+		// Everything that's already cached
+		{
+			ReadLock lock(m_lock);
+
+			for (size_t i = 0; i < n; ++i) {
+				Output& out = outputs[i];
+
+				auto it = m_derivations.find(DerivationKey{ txkey_sec, view_keys[i] });
+				if (it != m_derivations.end()) {
+					out.derivation = it->second;
+					out.has_derivation = true;
+				}
+				else {
+					auto it2 = m_viewKeys.find(view_keys[i]);
+					if (it2 != m_viewKeys.end()) {
+						out.view_key = it2->second;
+						out.has_view_key = true;
+					}
+				}
+
+				auto it3 = m_spendKeys.find(spend_keys[i]);
+				if (it3 != m_spendKeys.end()) {
+					out.spend_key = it3->second;
+					out.has_spend_key = true;
+				}
+			}
+		}
+
+		// Variable-time code gives the same result as ge_scalarmult() only when the top bit of the scalar is not set
+		const bool vartime = (txkey_sec.h[HASH_SIZE - 1] < 0x80);
+
+		size_t num_new_entries = 0;
+
+		for (size_t i = 0; i < n; ++i) {
+			Output& out = outputs[i];
+
+			if (!out.has_derivation) {
+				if (!vartime) {
+					generate_key_derivation(view_keys[i], txkey_sec, out.derivation);
+				}
+				else {
+					if (!out.has_view_key) {
+						ge_p3 point;
+						out.view_key.valid = (ge_frombytes_vartime(&point, view_keys[i].h) == 0);
+						if (out.view_key.valid) {
+							ge_dsm_precomp(out.view_key.table, &point);
+						}
+						out.new_view_key = true;
+						++num_new_entries;
+					}
+
+					// Derivation stays empty if the view key is invalid, the same way it does in generate_key_derivation()
+					if (out.view_key.valid) {
+						static constexpr uint8_t zero[HASH_SIZE] = {};
+
+						ge_p2 point2;
+						ge_p1p1 point3;
+
+						ge_double_scalarmult_precomp_vartime2(&point2, txkey_sec.h, out.view_key.table, zero, out.view_key.table);
+						ge_mul8(&point3, &point2);
+						ge_p1p1_to_p2(&point2, &point3);
+						ge_tobytes(out.derivation.h, &point2);
+					}
+				}
+				out.new_derivation = true;
+				++num_new_entries;
+			}
+
+			if (!out.has_spend_key) {
+				ge_p3 point;
+				out.spend_key.valid = (ge_frombytes_vartime(&point, spend_keys[i].h) == 0);
+				if (out.spend_key.valid) {
+					ge_p3_to_cached(&out.spend_key.point, &point);
+				}
+				out.new_spend_key = true;
+				++num_new_entries;
+			}
+
+			// Same as derive_public_key()
+			if (out.spend_key.valid) {
+				uint8_t scalar[HASH_SIZE];
+				ge_p3 point1;
+				ge_p1p1 point2;
+				ge_p2 point3;
+
+				derivation_to_scalar(out.derivation, i, scalar);
+				ge_scalarmult_base(&point1, scalar);
+				ge_add(&point2, &point1, &out.spend_key.point);
+				ge_p1p1_to_p2(&point3, &point2);
+				ge_tobytes(eph_public_keys[i].h, &point3);
+			}
+		}
+
+		if (num_new_entries == 0) {
+			return;
+		}
+
+		WriteLock lock(m_lock);
+
+		// n is the payout count of the PPLNS window, so the caches grow with it and never get smaller than one window
+		m_maxDerivations = std::max<size_t>(m_maxDerivations, n * DERIVATIONS_PER_PAYOUT);
+		m_maxPublicKeys = std::max<size_t>(m_maxPublicKeys, n * PUBLIC_KEYS_PER_PAYOUT);
+
+		// Caches are simply cleared when they're full, entries from the current PPLNS window will be back quickly
+		if (m_derivations.size() + n > m_maxDerivations) m_derivations.clear();
+		if (m_viewKeys.size() + n > m_maxPublicKeys) m_viewKeys.clear();
+		if (m_spendKeys.size() + n > m_maxPublicKeys) m_spendKeys.clear();
+
+		for (size_t i = 0; i < n; ++i) {
+			const Output& out = outputs[i];
+			if (out.new_derivation) m_derivations.emplace(DerivationKey{ txkey_sec, view_keys[i] }, out.derivation);
+			if (out.new_view_key) m_viewKeys.emplace(view_keys[i], out.view_key);
+			if (out.new_spend_key) m_spendKeys.emplace(spend_keys[i], out.spend_key);
+		}
+	}
+
+private:
+	enum {
+		MIN_DERIVATIONS = 1 << 16,
+		MIN_PUBLIC_KEYS = 1 << 12,
+
+		// Derivations depend on txkey_sec, so keep enough of them for a few block templates
+		DERIVATIONS_PER_PAYOUT = 16,
+
+		// Room for miners joining and leaving the window without a full clear
+		PUBLIC_KEYS_PER_PAYOUT = 2,
+	};
+
+	struct DerivationKey
+	{
+		hash txkey_sec;
+		hash view_key;
+
+		FORCEINLINE bool operator==(const DerivationKey& k) const { return (txkey_sec == k.txkey_sec) && (view_key == k.view_key); }
+	};
+
+	struct DerivationKeyHash
+	{
+		FORCEINLINE size_t operator()(const DerivationKey& k) const
+		{
+			// Both keys are random, so a few bytes from each are good enough
+			uint64_t a, b;
+			memcpy(&a, k.txkey_sec.h, sizeof(a));
+			memcpy(&b, k.view_key.h, sizeof(b));
+			return static_cast<size_t>(a ^ (b * 0x9E3779B97F4A7C15ULL));
+		}
+	};
+
+	struct ViewKey
+	{
+		bool valid;
+		ge_dsmp table;
+	};
+
+	struct SpendKey
+	{
+		bool valid;
+		ge_cached point;
+	};
+
+	struct Output
+	{
+		Output() : derivation(), view_key(), spend_key(), has_derivation(false), has_view_key(false), has_spend_key(false), new_derivation(false), new_view_key(false), new_spend_key(false) {}
+
+		hash derivation;
+		ViewKey view_key;
+		SpendKey spend_key;
+
+		bool has_derivation;
+		bool has_view_key;
+		bool has_spend_key;
+
+		bool new_derivation;
+		bool new_view_key;
+		bool new_spend_key;
+	};
+
+	uv_rwlock_t m_lock;
+	size_t m_maxDerivations;
+	size_t m_maxPublicKeys;
+	std::unordered_map<DerivationKey, hash, DerivationKeyHash> m_derivations;
+	std::unordered_map<hash, ViewKey> m_viewKeys;
+	std::unordered_map<hash, SpendKey> m_spendKeys;
+};
+
+static KeyCache keyCache;
+
+}
+
+void derive_eph_public_keys(const hash& txkey_sec, const std::vector<hash>& view_keys, const std::vector<hash>& spend_keys, std::vector<hash>& eph_public_keys)
+{
+	keyCache.derive_eph_public_keys(txkey_sec, view_keys, spend_keys, eph_public_keys);
+}
+
 } // namespace p2pool
@@ -23,4 +23,8 @@ void generate_keys(hash& pub, hash& sec);
 bool generate_key_derivation(const hash& key1, const hash& key2, hash& derivation);
 bool derive_public_key(const hash& derivation, size_t output_index, const hash& base, hash& derived_key);
 
+// Calculates one-time public keys for all outputs of a transaction in one pass, output i goes to (view_keys[i], spend_keys[i])
+// Gives the same results as generate_key_derivation() + derive_public_key() for each output, but caches key derivations and decompressed public keys
+void derive_eph_public_keys(const hash& txkey_sec, const std::vector<hash>& view_keys, const std::vector<hash>& spend_keys, std::vector<hash>& eph_public_keys);
+
 } // namespace p2pool
@@ -0,0 +1,203 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "difficulty_window.h"
+
+namespace p2pool {
+
+DifficultyWindow::DifficultyWindow()
+	: m_nodes(1, Node{})
+	, m_root(0)
+	, m_seed(0x9E3779B9U)
+{
+}
+
+void DifficultyWindow::clear()
+{
+	m_nodes.resize(1);
+	m_freeNodes.clear();
+	m_root = 0;
+}
+
+void DifficultyWindow::insert(uint64_t timestamp, const difficulty_type& cumulative_diff)
+{
+	uint32_t t;
+	if (m_freeNodes.empty()) {
+		t = static_cast<uint32_t>(m_nodes.size());
+		m_nodes.emplace_back();
+	}
+	else {
+		t = m_freeNodes.back();
+		m_freeNodes.pop_back();
+	}
+
+	// xorshift32
+	m_seed ^= m_seed << 13;
+	m_seed ^= m_seed >> 17;
+	m_seed ^= m_seed << 5;
+
+	Node& node = m_nodes[t];
+	node.m_timestamp = timestamp;
+	node.m_cumulativeDiff = cumulative_diff;
+	node.m_priority = m_seed;
+	node.m_left = 0;
+	node.m_right = 0;
+	update(t);
+
+	uint32_t left, right;
+	split(m_root, timestamp, cumulative_diff, left, right);
+	m_root = merge(merge(left, t), right);
+}
+
+bool DifficultyWindow::erase(uint64_t timestamp, const difficulty_type& cumulative_diff)
+{
+	uint32_t left, mid, right;
+	split(m_root, timestamp, cumulative_diff, left, right);
+
+	// "mid" gets all entries equal to (timestamp, cumulative_diff)
+	difficulty_type next_diff = cumulative_diff;
+	next_diff += difficulty_type(1, 0);
+
+	if (next_diff.lo || next_diff.hi) {
+		split(right, timestamp, next_diff, mid, right);
+	}
+	else if (timestamp < std::numeric_limits<uint64_t>::max()) {
+		split(right, timestamp + 1, difficulty_type(), mid, right);
+	}
+	else {
+		mid = right;
+		right = 0;
+	}
+
+	const bool found = (mid != 0);
+	if (found) {
+		m_freeNodes.push_back(mid);
+		mid = merge(m_nodes[mid].m_left, m_nodes[mid].m_right);
+	}
+
+	m_root = merge(merge(left, mid), right);
+	return found;
+}
+
+uint64_t DifficultyWindow::timestamp_at(size_t index) const
+{
+	uint32_t t = m_root;
+	while (t) {
+		const Node& node = m_nodes[t];
+		const uint32_t left_size = m_nodes[node.m_left].m_size;
+		if (index < left_size) {
+			t = node.m_left;
+		}
+		else if (index == left_size) {
+			return node.m_timestamp;
+		}
+		else {
+			index -= left_size + 1;
+			t = node.m_right;
+		}
+	}
+	return 0;
+}
+
+bool DifficultyWindow::get_range(uint64_t timestamp1, uint64_t timestamp2, difficulty_type& min_diff, difficulty_type& max_diff)
+{
+	if (timestamp1 > timestamp2) {
+		return false;
+	}
+
+	uint32_t left, mid, right;
+	split(m_root, timestamp1, difficulty_type(), left, mid);
+
+	if (timestamp2 < std::numeric_limits<uint64_t>::max()) {
+		split(mid, timestamp2 + 1, difficulty_type(), mid, right);
+	}
+	else {
+		right = 0;
+	}
+
+	const bool found = (mid != 0);
+	if (found) {
+		min_diff = m_nodes[mid].m_minDiff;
+		max_diff = m_nodes[mid].m_maxDiff;
+	}
+
+	m_root = merge(merge(left, mid), right);
+	return found;
+}
+
+void DifficultyWindow::update(uint32_t t)
+{
+	Node& node = m_nodes[t];
+	node.m_size = 1;
+	node.m_minDiff = node.m_cumulativeDiff;
+	node.m_maxDiff = node.m_cumulativeDiff;
+
+	for (uint32_t child : { node.m_left, node.m_right }) {
+		if (child) {
+			const Node& c = m_nodes[child];
+			node.m_size += c.m_size;
+			if (c.m_minDiff < node.m_minDiff) {
+				node.m_minDiff = c.m_minDiff;
+			}
+			if (node.m_maxDiff < c.m_maxDiff) {
+				node.m_maxDiff = c.m_maxDiff;
+			}
+		}
+	}
+}
+
+// Splits the subtree into entries < (timestamp, cumulative_diff) and entries >= (timestamp, cumulative_diff)
+void DifficultyWindow::split(uint32_t t, uint64_t timestamp, const difficulty_type& cumulative_diff, uint32_t& left, uint32_t& right)
+{
+	if (!t) {
+		left = 0;
+		right = 0;
+		return;
+	}
+
+	Node& node = m_nodes[t];
+	if ((node.m_timestamp < timestamp) || ((node.m_timestamp == timestamp) && (node.m_cumulativeDiff < cumulative_diff))) {
+		split(node.m_right, timestamp, cumulative_diff, m_nodes[t].m_right, right);
+		left = t;
+	}
+	else {
+		split(node.m_left, timestamp, cumulative_diff, left, m_nodes[t].m_left);
+		right = t;
+	}
+
+	update(t);
+}
+
+uint32_t DifficultyWindow::merge(uint32_t left, uint32_t right)
+{
+	if (!left || !right) {
+		return left ? left : right;
+	}
+
+	if (m_nodes[left].m_priority > m_nodes[right].m_priority) {
+		m_nodes[left].m_right = merge(m_nodes[left].m_right, right);
+		update(left);
+		return left;
+	}
+
+	m_nodes[right].m_left = merge(left, m_nodes[right].m_left);
+	update(right);
+	return right;
+}
+
+} // namespace p2pool
@@ -0,0 +1,66 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+namespace p2pool {
+
+// Multiset of (timestamp, cumulative difficulty) pairs ordered by timestamp
+// It's a treap augmented with subtree sizes and min/max cumulative difficulties,
+// so all operations SideChain::get_difficulty() needs are O(log N)
+class DifficultyWindow : public nocopy_nomove
+{
+public:
+	DifficultyWindow();
+
+	void clear();
+	FORCEINLINE size_t size() const { return m_nodes[m_root].m_size; }
+
+	void insert(uint64_t timestamp, const difficulty_type& cumulative_diff);
+	bool erase(uint64_t timestamp, const difficulty_type& cumulative_diff);
+
+	// Returns the timestamp at "index" in the sorted order
+	uint64_t timestamp_at(size_t index) const;
+
+	// Finds min/max cumulative difficulties among all entries with timestamp1 <= timestamp <= timestamp2
+	bool get_range(uint64_t timestamp1, uint64_t timestamp2, difficulty_type& min_diff, difficulty_type& max_diff);
+
+private:
+	struct Node
+	{
+		uint64_t m_timestamp;
+		difficulty_type m_cumulativeDiff;
+		difficulty_type m_minDiff;
+		difficulty_type m_maxDiff;
+		uint32_t m_priority;
+		uint32_t m_size;
+		uint32_t m_left;
+		uint32_t m_right;
+	};
+
+	// Node 0 is a sentinel (empty subtree)
+	std::vector<Node> m_nodes;
+	std::vector<uint32_t> m_freeNodes;
+	uint32_t m_root;
+	uint32_t m_seed;
+
+	void update(uint32_t t);
+	void split(uint32_t t, uint64_t timestamp, const difficulty_type& cumulative_diff, uint32_t& left, uint32_t& right);
+	uint32_t merge(uint32_t left, uint32_t right);
+};
+
+} // namespace p2pool
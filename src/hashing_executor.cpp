@@ -0,0 +1,245 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "hashing_executor.h"
+
+static constexpr char log_category_prefix[] = "HashingExecutor ";
+
+namespace p2pool {
+
+// Maximum number of queued jobs for each priority class
+static constexpr size_t MAX_QUEUE_SIZE[static_cast<size_t>(HashingExecutor::Priority::COUNT)] = { 1024, 256, 256 };
+
+static constexpr const char* PRIORITY_NAMES[static_cast<size_t>(HashingExecutor::Priority::COUNT)] = { "local shares", "tip blocks  ", "sync blocks " };
+
+HashingExecutor::CompletionQueue::CompletionQueue(uv_loop_t* loop)
+{
+	uv_mutex_init_checked(&m_lock);
+
+	const int err = uv_async_init(loop, &m_async, on_finished);
+	if (err) {
+		LOGERR(1, "uv_async_init failed, error " << uv_err_name(err));
+		panic();
+	}
+	m_async.data = this;
+}
+
+HashingExecutor::CompletionQueue::~CompletionQueue()
+{
+	uv_mutex_destroy(&m_lock);
+}
+
+void HashingExecutor::CompletionQueue::close()
+{
+	uv_close(reinterpret_cast<uv_handle_t*>(&m_async), nullptr);
+}
+
+void HashingExecutor::CompletionQueue::cancel_pending()
+{
+	std::vector<Finished> finished;
+	{
+		MutexLock lock(m_lock);
+		finished.swap(m_finished);
+	}
+
+	for (const Finished& job : finished) {
+		if (job.after_work_cb) {
+			job.after_work_cb(job.req, UV_ECANCELED);
+		}
+	}
+}
+
+void HashingExecutor::CompletionQueue::push(uv_work_t* req, uv_after_work_cb after_work_cb, int status)
+{
+	{
+		MutexLock lock(m_lock);
+		m_finished.push_back(Finished{ req, after_work_cb, status });
+	}
+
+	if (uv_is_closing(reinterpret_cast<uv_handle_t*>(&m_async))) {
+		return;
+	}
+
+	const int err = uv_async_send(&m_async);
+	if (err) {
+		LOGERR(1, "uv_async_send failed, error " << uv_err_name(err));
+	}
+}
+
+void HashingExecutor::CompletionQueue::on_finished()
+{
+	std::vector<Finished> finished;
+	{
+		MutexLock lock(m_lock);
+		finished.swap(m_finished);
+	}
+
+	for (const Finished& job : finished) {
+		if (job.after_work_cb) {
+			job.after_work_cb(job.req, job.status);
+		}
+	}
+}
+
+HashingExecutor::HashingExecutor(uint32_t num_threads)
+	: m_stopped(false)
+	, m_stats{}
+{
+	uv_mutex_init_checked(&m_lock);
+	uv_cond_init(&m_cond);
+
+	m_threads.resize(std::max(num_threads, 1U));
+
+	for (uv_thread_t& t : m_threads) {
+		const int err = uv_thread_create(&t, run_wrapper, this);
+		if (err) {
+			LOGERR(1, "failed to start worker thread, error " << uv_err_name(err));
+			panic();
+		}
+	}
+
+	LOGINFO(1, "started " << m_threads.size() << " hashing threads");
+}
+
+HashingExecutor::~HashingExecutor()
+{
+	stop();
+
+	uv_cond_destroy(&m_cond);
+	uv_mutex_destroy(&m_lock);
+}
+
+void HashingExecutor::stop()
+{
+	{
+		MutexLock lock(m_lock);
+		if (m_stopped) {
+			return;
+		}
+		m_stopped = true;
+	}
+	uv_cond_broadcast(&m_cond);
+
+	for (uv_thread_t& t : m_threads) {
+		uv_thread_join(&t);
+	}
+
+	// Jobs that never started are handed back as cancelled, so their owners can free them
+	for (std::deque<Job>& queue : m_queues) {
+		for (const Job& job : queue) {
+			finish(job, UV_ECANCELED);
+		}
+		queue.clear();
+	}
+}
+
+int HashingExecutor::queue_work(CompletionQueue* completion_queue, uv_work_t* req, Priority priority, uv_work_cb work_cb, uv_after_work_cb after_work_cb)
+{
+	const size_t k = static_cast<size_t>(priority);
+	{
+		MutexLock lock(m_lock);
+
+		std::deque<Job>& queue = m_queues[k];
+		Stats& stats = m_stats[k];
+
+		if (m_stopped || (queue.size() >= MAX_QUEUE_SIZE[k])) {
+			++stats.jobs_rejected;
+			return UV_EBUSY;
+		}
+
+		queue.push_back(Job{ completion_queue, req, work_cb, after_work_cb, uv_hrtime() });
+		stats.max_queue_depth = std::max<uint64_t>(stats.max_queue_depth, queue.size());
+	}
+
+	uv_cond_signal(&m_cond);
+	return 0;
+}
+
+void HashingExecutor::print_status()
+{
+	MutexLock lock(m_lock);
+
+	for (size_t i = 0; i < static_cast<size_t>(Priority::COUNT); ++i) {
+		const Stats& s = m_stats[i];
+		const uint64_t avg_wait = s.jobs_done ? (s.total_wait_time / s.jobs_done) : 0;
+
+		LOGINFO(0, PRIORITY_NAMES[i] <<
+			": queued = " << m_queues[i].size() << '/' << MAX_QUEUE_SIZE[i] <<
+			", max queued = " << s.max_queue_depth <<
+			", done = " << s.jobs_done <<
+			", rejected = " << s.jobs_rejected <<
+			", wait time = " << avg_wait / 1000 << " us (average), " << s.max_wait_time / 1000 << " us (max)"
+		);
+	}
+}
+
+void HashingExecutor::run()
+{
+	for (;;) {
+		Job job;
+		{
+			MutexLock lock(m_lock);
+
+			std::deque<Job>* queue = nullptr;
+			Stats* stats = nullptr;
+
+			for (;;) {
+				if (m_stopped) {
+					return;
+				}
+
+				for (size_t i = 0; i < static_cast<size_t>(Priority::COUNT); ++i) {
+					if (!m_queues[i].empty()) {
+						queue = m_queues + i;
+						stats = m_stats + i;
+						break;
+					}
+				}
+
+				if (queue) {
+					break;
+				}
+
+				uv_cond_wait(&m_cond, &m_lock);
+			}
+
+			job = queue->front();
+			queue->pop_front();
+
+			const uint64_t wait_time = uv_hrtime() - job.queued_time;
+			++stats->jobs_done;
+			stats->total_wait_time += wait_time;
+			stats->max_wait_time = std::max(stats->max_wait_time, wait_time);
+		}
+
+		job.work_cb(job.req);
+		finish(job, 0);
+	}
+}
+
+void HashingExecutor::finish(const Job& job, int status)
+{
+	if (job.completion_queue) {
+		job.completion_queue->push(job.req, job.after_work_cb, status);
+	}
+	else if (job.after_work_cb) {
+		job.after_work_cb(job.req, status);
+	}
+}
+
+} // namespace p2pool
@@ -0,0 +1,119 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "uv_util.h"
+#include <deque>
+
+namespace p2pool {
+
+// Dedicated threads for RandomX hashing jobs, used instead of libuv's thread pool
+// Jobs are picked in priority order: local miner shares first, then sidechain blocks which extend the current tip, then sync backlog
+// Every priority class has a bounded queue, so a flood of blocks can't delay shares indefinitely
+class HashingExecutor : public nocopy_nomove
+{
+public:
+	enum class Priority {
+		LOCAL_SHARE,
+		TIP_BLOCK,
+		SYNC_BLOCK,
+		COUNT
+	};
+
+	// Finished jobs are handed back to the event loop that queued them,
+	// so after_work_cb is called in that loop's thread, just like with uv_queue_work()
+	// Jobs dropped at shutdown get after_work_cb with UV_ECANCELED status, which must only free the job's data
+	class CompletionQueue : public nocopy_nomove
+	{
+	public:
+		explicit CompletionQueue(uv_loop_t* loop);
+		~CompletionQueue();
+
+		void close();
+
+		// Cancels jobs which were not handed back yet, must be called after the event loop has stopped
+		void cancel_pending();
+
+	private:
+		friend class HashingExecutor;
+
+		struct Finished
+		{
+			uv_work_t* req;
+			uv_after_work_cb after_work_cb;
+			int status;
+		};
+
+		static void on_finished(uv_async_t* handle) { reinterpret_cast<CompletionQueue*>(handle->data)->on_finished(); }
+		void on_finished();
+		void push(uv_work_t* req, uv_after_work_cb after_work_cb, int status);
+
+		uv_async_t m_async;
+		uv_mutex_t m_lock;
+		std::vector<Finished> m_finished;
+	};
+
+	explicit HashingExecutor(uint32_t num_threads);
+	~HashingExecutor();
+
+	// Waits for running jobs and cancels queued ones
+	void stop();
+
+	// Returns 0 or UV_EBUSY if the queue for this priority is full
+	// Jobs without a completion queue get after_work_cb in the worker thread, right after work_cb (or in stop() if they're cancelled)
+	int queue_work(CompletionQueue* completion_queue, uv_work_t* req, Priority priority, uv_work_cb work_cb, uv_after_work_cb after_work_cb);
+
+	uint32_t num_threads() const { return static_cast<uint32_t>(m_threads.size()); }
+
+	void print_status();
+
+private:
+	static void run_wrapper(void* arg) { reinterpret_cast<HashingExecutor*>(arg)->run(); }
+	void run();
+
+	struct Job
+	{
+		CompletionQueue* completion_queue;
+		uv_work_t* req;
+		uv_work_cb work_cb;
+		uv_after_work_cb after_work_cb;
+		uint64_t queued_time;
+	};
+
+	static void finish(const Job& job, int status);
+
+	struct Stats
+	{
+		uint64_t jobs_done;
+		uint64_t jobs_rejected;
+		uint64_t max_queue_depth;
+		uint64_t total_wait_time;
+		uint64_t max_wait_time;
+	};
+
+	uv_mutex_t m_lock;
+	uv_cond_t m_cond;
+	bool m_stopped;
+
+	std::deque<Job> m_queues[static_cast<size_t>(Priority::COUNT)];
+	Stats m_stats[static_cast<size_t>(Priority::COUNT)];
+
+	std::vector<uv_thread_t> m_threads;
+};
+
+} // namespace p2pool
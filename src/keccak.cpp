@@ -17,6 +17,14 @@
 
 #include "common.h"
 #include "keccak.h"
+#include "keccak_lanes.inl"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define KECCAK_SSE2
+#endif
+
+static constexpr char log_category_prefix[] = "Keccak ";
 
 namespace p2pool {
 
@@ -144,6 +152,39 @@ NOINLINE void keccakf(uint64_t* st)
 	}
 }
 
+NOINLINE void keccak_step(const uint8_t* &in, int &inlen, uint64_t (&st)[25])
+{
+	constexpr int rsiz = KeccakParams::HASH_DATA_AREA;
+	constexpr int rsizw = rsiz / 8;
+
+	for (; inlen >= rsiz; inlen -= rsiz, in += rsiz) {
+		for (int i = 0; i < rsizw; i++) {
+			st[i] ^= ((uint64_t*)in)[i];
+		}
+		keccakf(st);
+	}
+}
+
+NOINLINE void keccak_finish(const uint8_t* in, int inlen, uint64_t (&st)[25])
+{
+	constexpr int rsiz = KeccakParams::HASH_DATA_AREA;
+	constexpr int rsizw = rsiz / 8;
+
+	// last block and padding
+	alignas(8) uint8_t temp[144];
+
+	memcpy(temp, in, inlen);
+	temp[inlen++] = 1;
+	memset(temp + inlen, 0, rsiz - inlen);
+	temp[rsiz - 1] |= 0x80;
+
+	for (int i = 0; i < rsizw; i++) {
+		st[i] ^= ((uint64_t*)temp)[i];
+	}
+
+	keccakf(st);
+}
+
 NOINLINE void keccak(const uint8_t* in, int inlen, uint8_t* md, int mdlen)
 {
 	uint64_t st[25];
@@ -182,4 +223,247 @@ void keccak(const uint8_t *in, int inlen, uint8_t (&md)[200])
 	keccak(in, inlen, md, 200);
 }
 
+// Defined in keccak_avx2.cpp and keccak_avx512.cpp, they return nullptr if the compiler doesn't support these instructions
+keccakf_lanes_func keccakf_x4_avx2_func();
+keccakf_lanes_func keccakf_x8_avx512_func();
+
+#ifdef KECCAK_SSE2
+struct KeccakSSE2
+{
+	typedef __m128i type;
+	enum { LANES = 2 };
+
+	static FORCEINLINE type load(const uint64_t* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+	static FORCEINLINE void store(uint64_t* p, type a) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), a); }
+	static FORCEINLINE type set1(uint64_t a) { return _mm_set1_epi64x(static_cast<int64_t>(a)); }
+	static FORCEINLINE type XOR(type a, type b) { return _mm_xor_si128(a, b); }
+
+	// a ^ (~b & c)
+	static FORCEINLINE type CHI(type a, type b, type c) { return _mm_xor_si128(a, _mm_andnot_si128(b, c)); }
+
+	template<int n> static FORCEINLINE type rol(type a) { return _mm_or_si128(_mm_slli_epi64(a, n), _mm_srli_epi64(a, 64 - n)); }
+};
+
+static void keccakf_x2_sse2(uint64_t* st)
+{
+	keccakf_lanes<KeccakSSE2>(st);
+}
+#endif
+
+static void cpu_has_avx2_avx512(bool& avx2, bool& avx512)
+{
+	avx2 = false;
+	avx512 = false;
+
+#if defined(_MSC_VER) && defined(_M_X64)
+	int info[4];
+
+	__cpuid(info, 0);
+	if (info[0] < 7) {
+		return;
+	}
+
+	// OS must save YMM/ZMM registers
+	__cpuid(info, 1);
+	if ((info[2] & (1 << 27)) == 0) {
+		return;
+	}
+	const uint64_t xcr0 = _xgetbv(0);
+
+	__cpuidex(info, 7, 0);
+	avx2 = ((info[1] & (1 << 5)) != 0) && ((xcr0 & 0x06) == 0x06);
+	avx512 = ((info[1] & (1 << 16)) != 0) && ((xcr0 & 0xE6) == 0xE6);
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+	__builtin_cpu_init();
+	avx2 = __builtin_cpu_supports("avx2");
+	avx512 = __builtin_cpu_supports("avx512f");
+#endif
+}
+
+template<int L>
+static void keccak_lanes(keccakf_lanes_func f, const uint8_t* in, int inlen, uint8_t* md, const uint64_t* st0)
+{
+	constexpr int rsiz = KeccakParams::HASH_DATA_AREA;
+	constexpr int rsizw = rsiz / 8;
+
+	alignas(64) uint64_t st[25 * L];
+
+	if (st0) {
+		for (int i = 0; i < 25; ++i) {
+			for (int k = 0; k < L; ++k) {
+				st[i * L + k] = st0[i];
+			}
+		}
+	}
+	else {
+		memset(st, 0, sizeof(st));
+	}
+
+	const int msg_size = inlen;
+	int offset = 0;
+
+	for (; inlen >= rsiz; inlen -= rsiz, offset += rsiz) {
+		for (int k = 0; k < L; ++k) {
+			const uint8_t* p = in + k * msg_size + offset;
+			for (int i = 0; i < rsizw; ++i) {
+				uint64_t w;
+				memcpy(&w, p + i * 8, sizeof(w));
+				st[i * L + k] ^= w;
+			}
+		}
+		f(st);
+	}
+
+	// last block and padding
+	for (int k = 0; k < L; ++k) {
+		alignas(8) uint8_t temp[144];
+
+		memcpy(temp, in + k * msg_size + offset, inlen);
+		temp[inlen] = 1;
+		memset(temp + inlen + 1, 0, rsiz - inlen - 1);
+		temp[rsiz - 1] |= 0x80;
+
+		for (int i = 0; i < rsizw; ++i) {
+			st[i * L + k] ^= reinterpret_cast<uint64_t*>(temp)[i];
+		}
+	}
+
+	f(st);
+
+	for (int k = 0; k < L; ++k) {
+		for (int i = 0; i < static_cast<int>(HASH_SIZE / sizeof(uint64_t)); ++i) {
+			memcpy(md + k * HASH_SIZE + i * sizeof(uint64_t), &st[i * L + k], sizeof(uint64_t));
+		}
+	}
+}
+
+static bool keccak_multi_self_test(keccakf_lanes_func f, int lanes)
+{
+	constexpr int MAX_SIZE = KeccakParams::HASH_DATA_AREA * 3;
+
+	// Message sizes around block boundaries
+	static constexpr int sizes[] = { 0, 1, 31, 32, 64, 96, 135, 136, 137, 271, 272, 273, MAX_SIZE - 1 };
+
+	uint8_t in[MAX_SIZE * KeccakParams::MAX_LANES];
+	uint8_t md[HASH_SIZE * KeccakParams::MAX_LANES];
+	uint8_t check[HASH_SIZE];
+
+	uint64_t x = 0x9E3779B97F4A7C15ULL;
+	for (uint8_t& b : in) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		b = static_cast<uint8_t>(x);
+	}
+
+	uint64_t st0[25];
+	for (int i = 0; i < 25; ++i) {
+		st0[i] = i * 0x0101010101010101ULL;
+	}
+
+	for (int size : sizes) {
+		for (int j = 0; j < 2; ++j) {
+			const uint64_t* st = j ? st0 : nullptr;
+
+			switch (lanes) {
+			case 2: keccak_lanes<2>(f, in, size, md, st); break;
+			case 4: keccak_lanes<4>(f, in, size, md, st); break;
+			case 8: keccak_lanes<8>(f, in, size, md, st); break;
+			default: return false;
+			}
+
+			for (int k = 0; k < lanes; ++k) {
+				keccak_lanes<1>(keccakf, in + k * size, size, check, st);
+				if (memcmp(md + k * HASH_SIZE, check, HASH_SIZE) != 0) {
+					return false;
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+struct KeccakMulti
+{
+	KeccakMulti() : x2(nullptr), x4(nullptr), x8(nullptr)
+	{
+		// Keccak-256 of an empty string, checks the scalar implementation the others are compared to
+		static constexpr uint8_t empty_hash[HASH_SIZE] = {
+			0xc5,0xd2,0x46,0x01,0x86,0xf7,0x23,0x3c,0x92,0x7e,0x7d,0xb2,0xdc,0xc7,0x03,0xc0,
+			0xe5,0x00,0xb6,0x53,0xca,0x82,0x27,0x3b,0x7b,0xfa,0xd8,0x04,0x5d,0x85,0xa4,0x70
+		};
+
+		const uint8_t empty[1] = {};
+		uint8_t h[HASH_SIZE];
+		keccak(empty, 0, h, HASH_SIZE);
+		if (memcmp(h, empty_hash, HASH_SIZE) != 0) {
+			LOGERR(1, "scalar keccak is broken, fix it!");
+			return;
+		}
+
+		bool avx2, avx512;
+		cpu_has_avx2_avx512(avx2, avx512);
+
+#ifdef KECCAK_SSE2
+		x2 = keccakf_x2_sse2;
+#endif
+		if (avx2) {
+			x4 = keccakf_x4_avx2_func();
+		}
+		if (avx512) {
+			x8 = keccakf_x8_avx512_func();
+		}
+
+		// Don't use SIMD code which gives results different from the scalar code
+		if (x2 && !keccak_multi_self_test(x2, 2)) {
+			LOGERR(1, "2-lane keccak self-test failed, it won't be used");
+			x2 = nullptr;
+		}
+		if (x4 && !keccak_multi_self_test(x4, 4)) {
+			LOGERR(1, "4-lane (AVX2) keccak self-test failed, it won't be used");
+			x4 = nullptr;
+		}
+		if (x8 && !keccak_multi_self_test(x8, 8)) {
+			LOGERR(1, "8-lane (AVX-512) keccak self-test failed, it won't be used");
+			x8 = nullptr;
+		}
+
+		LOGINFO(4, "keccak_multi: " << (x8 ? "AVX-512 " : "") << (x4 ? "AVX2 " : "") << (x2 ? "SSE2 " : "") << "scalar");
+	}
+
+	keccakf_lanes_func x2;
+	keccakf_lanes_func x4;
+	keccakf_lanes_func x8;
+};
+
+void keccak_multi(const uint8_t* in, int inlen, uint8_t* md, uint32_t count, const uint64_t* st)
+{
+	static const KeccakMulti impl;
+
+	uint32_t i = 0;
+
+	if (impl.x8) {
+		for (; i + 8 <= count; i += 8) {
+			keccak_lanes<8>(impl.x8, in + static_cast<size_t>(i) * inlen, inlen, md + i * HASH_SIZE, st);
+		}
+	}
+
+	if (impl.x4) {
+		for (; i + 4 <= count; i += 4) {
+			keccak_lanes<4>(impl.x4, in + static_cast<size_t>(i) * inlen, inlen, md + i * HASH_SIZE, st);
+		}
+	}
+
+	if (impl.x2) {
+		for (; i + 2 <= count; i += 2) {
+			keccak_lanes<2>(impl.x2, in + static_cast<size_t>(i) * inlen, inlen, md + i * HASH_SIZE, st);
+		}
+	}
+
+	for (; i < count; ++i) {
+		keccak_lanes<1>(keccakf, in + static_cast<size_t>(i) * inlen, inlen, md + i * HASH_SIZE, st);
+	}
+}
+
 } // namespace p2pool
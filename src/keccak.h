@@ -22,10 +22,22 @@ namespace p2pool {
 enum KeccakParams {
 	HASH_DATA_AREA = 136,
 	ROUNDS = 24,
+	MAX_LANES = 8,
 };
 
 void keccakf(uint64_t* st);
 void keccak(const uint8_t *in, int inlen, uint8_t *md, int mdlen);
+
+// Incremental keccak with HASH_DATA_AREA rate (32 and 200 byte outputs)
+// keccak_step() absorbs all full blocks and advances "in" and "inlen" past them
+void keccak_step(const uint8_t* &in, int &inlen, uint64_t (&st)[25]);
+void keccak_finish(const uint8_t* in, int inlen, uint64_t (&st)[25]);
+
+// Hashes "count" messages of "inlen" bytes each, stored one after another in "in", into 32-byte digests stored one after another in "md"
+// Up to MAX_LANES messages are hashed in parallel if the CPU supports it (SSE2/AVX2/AVX-512)
+// If "st" is not null, all messages are hashed starting from this keccak state (see keccak_step)
+// "md" can overlap with "in" as long as digest k doesn't overlap messages k+1 and later (merkle tree levels)
+void keccak_multi(const uint8_t* in, int inlen, uint8_t* md, uint32_t count, const uint64_t* st = nullptr);
 void keccak(const uint8_t* in, int inlen, uint8_t (&md)[200]);
 
 template<typename T>
@@ -0,0 +1,64 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Only system headers here, see keccak_lanes.inl
+#include <stdint.h>
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+#include "keccak_lanes.inl"
+
+namespace p2pool {
+
+struct KeccakAVX2
+{
+	typedef __m256i type;
+	enum { LANES = 4 };
+
+	static type load(const uint64_t* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+	static void store(uint64_t* p, type a) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), a); }
+	static type set1(uint64_t a) { return _mm256_set1_epi64x(static_cast<int64_t>(a)); }
+	static type XOR(type a, type b) { return _mm256_xor_si256(a, b); }
+
+	// a ^ (~b & c)
+	static type CHI(type a, type b, type c) { return _mm256_xor_si256(a, _mm256_andnot_si256(b, c)); }
+
+	template<int n> static type rol(type a) { return _mm256_or_si256(_mm256_slli_epi64(a, n), _mm256_srli_epi64(a, 64 - n)); }
+};
+
+static void keccakf_x4_avx2(uint64_t* st)
+{
+	keccakf_lanes<KeccakAVX2>(st);
+}
+
+keccakf_lanes_func keccakf_x4_avx2_func() { return keccakf_x4_avx2; }
+
+} // namespace p2pool
+
+#else
+
+namespace p2pool {
+
+typedef void (*keccakf_lanes_func)(uint64_t* st);
+
+// Compiler doesn't support AVX2
+keccakf_lanes_func keccakf_x4_avx2_func() { return nullptr; }
+
+} // namespace p2pool
+
+#endif
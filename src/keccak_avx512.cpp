@@ -0,0 +1,65 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Only system headers here, see keccak_lanes.inl
+#include <stdint.h>
+
+#if defined(__AVX512F__)
+
+#include <immintrin.h>
+#include "keccak_lanes.inl"
+
+namespace p2pool {
+
+struct KeccakAVX512
+{
+	typedef __m512i type;
+	enum { LANES = 8 };
+
+	static type load(const uint64_t* p) { return _mm512_loadu_si512(p); }
+	static void store(uint64_t* p, type a) { _mm512_storeu_si512(p, a); }
+	static type set1(uint64_t a) { return _mm512_set1_epi64(static_cast<int64_t>(a)); }
+	static type XOR(type a, type b) { return _mm512_xor_si512(a, b); }
+
+	// a ^ (~b & c) in one instruction
+	static type CHI(type a, type b, type c) { return _mm512_ternarylogic_epi64(a, b, c, 0xD2); }
+
+	// _mm512_rol_epi64 triggers a false -Wuninitialized in GCC 12 headers, the zero-masked version is the same instruction
+	template<int n> static type rol(type a) { return _mm512_maskz_rol_epi64(0xFF, a, n); }
+};
+
+static void keccakf_x8_avx512(uint64_t* st)
+{
+	keccakf_lanes<KeccakAVX512>(st);
+}
+
+keccakf_lanes_func keccakf_x8_avx512_func() { return keccakf_x8_avx512; }
+
+} // namespace p2pool
+
+#else
+
+namespace p2pool {
+
+typedef void (*keccakf_lanes_func)(uint64_t* st);
+
+// Compiler doesn't support AVX-512
+keccakf_lanes_func keccakf_x8_avx512_func() { return nullptr; }
+
+} // namespace p2pool
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// This file is included by the translation units compiled with -mavx2/-mavx512f
+// so it must not pull in any other p2pool headers: all inline functions there would get compiled with these instructions too
+
+namespace p2pool {
+
+extern const uint64_t keccakf_rndc[24];
+
+typedef void (*keccakf_lanes_func)(uint64_t* st);
+
+// Keccak-f[1600] for V::LANES independent states at once
+// States are interleaved: st[i * V::LANES + k] is word i of state k
+// V provides the vector type and load/store/set1/XOR/CHI/rol operations
+template<typename V>
+static inline void keccakf_lanes(uint64_t* st)
+{
+	typedef typename V::type T;
+
+	T a[25];
+	for (int i = 0; i < 25; ++i) {
+		a[i] = V::load(st + i * V::LANES);
+	}
+
+#define ROL(x, n) V::template rol<n>(x)
+
+	for (int round = 0; round < 24; ++round) {
+		T bc[5];
+
+		// Theta
+		for (int i = 0; i < 5; ++i) {
+			bc[i] = V::XOR(V::XOR(V::XOR(a[i], a[i + 5]), V::XOR(a[i + 10], a[i + 15])), a[i + 20]);
+		}
+
+		for (int i = 0; i < 5; ++i) {
+			const T t = V::XOR(bc[(i + 4) % 5], ROL(bc[(i + 1) % 5], 1));
+			a[i +  0] = V::XOR(a[i +  0], t);
+			a[i +  5] = V::XOR(a[i +  5], t);
+			a[i + 10] = V::XOR(a[i + 10], t);
+			a[i + 15] = V::XOR(a[i + 15], t);
+			a[i + 20] = V::XOR(a[i + 20], t);
+		}
+
+		// Rho Pi
+		const T t = a[1];
+		a[ 1] = ROL(a[ 6], 44);
+		a[ 6] = ROL(a[ 9], 20);
+		a[ 9] = ROL(a[22], 61);
+		a[22] = ROL(a[14], 39);
+		a[14] = ROL(a[20], 18);
+		a[20] = ROL(a[ 2], 62);
+		a[ 2] = ROL(a[12], 43);
+		a[12] = ROL(a[13], 25);
+		a[13] = ROL(a[19],  8);
+		a[19] = ROL(a[23], 56);
+		a[23] = ROL(a[15], 41);
+		a[15] = ROL(a[ 4], 27);
+		a[ 4] = ROL(a[24], 14);
+		a[24] = ROL(a[21],  2);
+		a[21] = ROL(a[ 8], 55);
+		a[ 8] = ROL(a[16], 45);
+		a[16] = ROL(a[ 5], 36);
+		a[ 5] = ROL(a[ 3], 28);
+		a[ 3] = ROL(a[18], 21);
+		a[18] = ROL(a[17], 15);
+		a[17] = ROL(a[11], 10);
+		a[11] = ROL(a[ 7],  6);
+		a[ 7] = ROL(a[10],  3);
+		a[10] = ROL(t, 1);
+
+		// Chi
+		for (int j = 0; j < 25; j += 5) {
+			const T b0 = a[j + 0];
+			const T b1 = a[j + 1];
+			const T b2 = a[j + 2];
+			const T b3 = a[j + 3];
+			const T b4 = a[j + 4];
+
+			a[j + 0] = V::CHI(b0, b1, b2);
+			a[j + 1] = V::CHI(b1, b2, b3);
+			a[j + 2] = V::CHI(b2, b3, b4);
+			a[j + 3] = V::CHI(b3, b4, b0);
+			a[j + 4] = V::CHI(b4, b0, b1);
+		}
+
+		// Iota
+		a[0] = V::XOR(a[0], V::set1(keccakf_rndc[round]));
+	}
+
+#undef ROL
+
+	for (int i = 0; i < 25; ++i) {
+		V::store(st + i * V::LANES, a[i]);
+	}
+}
+
+} // namespace p2pool
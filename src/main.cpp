@@ -27,11 +27,14 @@ static void usage()
 		"--rpc-port           monerod RPC API port number, default is 18081\n"
 		"--zmq-port           monerod ZMQ pub port number, default is 18083 (same port as in monerod's \"--zmq-pub\" command line parameter)\n"
 		"--stratum            Comma-separated list of IP:port for stratum server to listen on\n"
+		"--stratum-threads    Number of event loop threads for stratum server, default is 1 (more than 1 requires SO_REUSEPORT support)\n"
+		"--stratum-shares-per-minute Enable variable difficulty for stratum clients, targeting this many shares per minute per connection\n"
 		"--p2p                Comma-separated list of IP:port for p2p server to listen on\n"
 		"--addpeers           Comma-separated list of IP:port of other p2pool nodes to connect to\n"
 		"--light-mode         Don't allocate RandomX dataset, saves 2GB of RAM\n"
 		"--loglevel           Verbosity of the log, integer number between 0 and 5\n"
 		"--config             Name of the p2pool config file\n"
+		"--no-cache           Disable p2pool.cache (sidechain blocks are downloaded again on every restart)\n"
 		"--help               Show this help message\n\n"
 		"Example command line:\n\n"
 		"%s --host 127.0.0.1 --rpc-port 18081 --zmq-port 18083 --wallet YOUR_WALLET_ADDRESS --stratum [::]:3333,0.0.0.0:3333 --p2p [::]:37890,0.0.0.0:37890\n\n",
@@ -18,6 +18,7 @@
 #include "common.h"
 #include "mempool.h"
 #include "util.h"
+#include "keccak.h"
 
 static constexpr char log_category_prefix[] = "Mempool ";
 
@@ -53,4 +54,58 @@ void Mempool::swap(std::vector<TxMempoolData>& transactions)
 	m_transactions.swap(transactions);
 }
 
+void Mempool::calc_short_ids(uint64_t salt, const hash* ids, size_t count, std::vector<uint64_t>& short_ids)
+{
+	constexpr int MSG_SIZE = sizeof(salt) + HASH_SIZE;
+
+	std::vector<uint8_t> buf(count * MSG_SIZE);
+
+	uint8_t* p = buf.data();
+	for (size_t i = 0; i < count; ++i, p += MSG_SIZE) {
+		memcpy(p, &salt, sizeof(salt));
+		memcpy(p + sizeof(salt), ids[i].h, HASH_SIZE);
+	}
+
+	// Digests are written over the messages, digest k never overlaps message k + 1
+	keccak_multi(buf.data(), MSG_SIZE, buf.data(), static_cast<uint32_t>(count));
+
+	short_ids.resize(count);
+
+	p = buf.data();
+	for (size_t i = 0; i < count; ++i, p += HASH_SIZE) {
+		uint64_t k;
+		memcpy(&k, p, sizeof(k));
+		short_ids[i] = k & ((1ULL << (SHORT_ID_SIZE * 8)) - 1);
+	}
+}
+
+void Mempool::get_short_ids(uint64_t salt, std::vector<std::pair<uint64_t, hash>>& result) const
+{
+	std::vector<hash> ids;
+	{
+		ReadLock lock(m_lock);
+
+		ids.reserve(m_transactions.size());
+		for (const TxMempoolData& tx : m_transactions) {
+			ids.push_back(tx.id);
+		}
+	}
+
+	std::vector<uint64_t> short_ids;
+	calc_short_ids(salt, ids.data(), ids.size(), short_ids);
+
+	result.clear();
+	result.reserve(ids.size());
+
+	for (size_t i = 0, n = ids.size(); i < n; ++i) {
+		result.emplace_back(short_ids[i], ids[i]);
+	}
+
+	std::sort(result.begin(), result.end(),
+		[](const std::pair<uint64_t, hash>& a, const std::pair<uint64_t, hash>& b)
+		{
+			return a.first < b.first;
+		});
+}
+
 } // namespace p2pool
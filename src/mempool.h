@@ -32,6 +32,15 @@ public:
 	void add(const TxMempoolData& tx);
 	void swap(std::vector<TxMempoolData>& transactions);
 
+	// Short transaction IDs for compact block relay: first SHORT_ID_SIZE bytes of keccak(salt|id)
+	// Salt is chosen by the sender for every block, so collisions can't be prepared in advance
+	enum { SHORT_ID_SIZE = 6 };
+
+	static void calc_short_ids(uint64_t salt, const hash* ids, size_t count, std::vector<uint64_t>& short_ids);
+
+	// Short IDs and full IDs of all transactions in the mempool, sorted by short ID
+	void get_short_ids(uint64_t salt, std::vector<std::pair<uint64_t, hash>>& result) const;
+
 public:
 	mutable uv_rwlock_t m_lock;
 	std::vector<TxMempoolData> m_transactions;
@@ -22,6 +22,7 @@
 #include "keccak.h"
 #include "side_chain.h"
 #include "pool_block.h"
+#include "mempool.h"
 #include <fstream>
 #include <numeric>
 
@@ -31,22 +32,89 @@ static constexpr char saved_peer_list_file_name[] = "p2pool_peers.txt";
 static constexpr int DEFAULT_BACKLOG = 16;
 static constexpr uint64_t DEFAULT_BAN_TIME = 600;
 
+// BLOCK_REQUEST for this id is answered with FEATURES message, it can't be a real block id (keccak hash)
+static constexpr uint8_t features_request_id[32] = { 'P', '2', 'P', 'o', 'o', 'l', ' ', 'f', 'e', 'a', 't', 'u', 'r', 'e', 's' };
+
+// Every peer can send this many BLOCK_RANGE_REQUEST messages in 10 seconds, the rest are answered with empty responses
+static constexpr uint32_t MAX_BLOCK_RANGE_REQUESTS = 16;
+
+// BLOCK_RANGE_RESPONSE can have this many uncles per requested block, and no more than this many bytes in total
+static constexpr uint64_t MAX_BLOCK_RANGE_UNCLES = 8;
+static constexpr uint64_t MAX_BLOCK_RANGE_RESPONSE_SIZE = 64ULL << 20;
+
+// Transactions of this many last compact blocks are kept for COMPACT_BLOCK_TX_REQUEST
+static constexpr size_t MAX_COMPACT_BLOCK_TXS = 16;
+
 #include "tcp_server.inl"
 
 namespace p2pool {
 
+// Transaction hashes in one COMPACT_BLOCK_TX_RESPONSE must fit in the buffer
+static constexpr uint32_t MAX_COMPACT_BLOCK_TX_REQUEST = (P2P_BUF_SIZE - 1 - sizeof(uint32_t) - HASH_SIZE - sizeof(uint32_t)) / HASH_SIZE;
+
+// Raw data of one or more blocks (oldest first) copied from the receive buffer, and the block they're deserialized into
+struct P2PServer::IncomingBlock
+{
+	IncomingBlock() : m_rangeStart(), m_rangeSize(0), m_pipelinedId(), m_compactId(), m_compactRebuildFailed(false), m_inFlightId() {}
+
+	void clear()
+	{
+		m_blob.clear();
+		m_blocks.clear();
+		m_missingBlocks.clear();
+		m_rangeStart = {};
+		m_rangeSize = 0;
+		m_pipelinedId = {};
+		m_compactId = {};
+		m_compactRebuildFailed = false;
+		m_inFlightId = {};
+	}
+
+	std::vector<uint8_t> m_blob;
+
+	// Offset and size of every block in m_blob
+	std::vector<std::pair<uint32_t, uint32_t>> m_blocks;
+
+	// Blocks are deserialized here and moved to SideChain, so buffers of a moved-from block are allocated at the exact size next time
+	PoolBlock m_block;
+
+	// Blocks to request when these blocks are added, m_rangeStart is requested with BLOCK_RANGE_REQUEST if the peer supports it
+	std::vector<hash> m_missingBlocks;
+	hash m_rangeStart;
+	uint32_t m_rangeSize;
+
+	// Parent of the oldest block in BLOCK_RANGE_RESPONSE, it was requested as soon as the first message arrived
+	hash m_pipelinedId;
+
+	// Id of the compact block this block was rebuilt from, the full block is requested if the rebuilt block doesn't match it
+	hash m_compactId;
+	bool m_compactRebuildFailed;
+
+	// Id of a single block which is in P2PServer::m_blocksInFlight until this block is released
+	hash m_inFlightId;
+};
+
+// Number of blocks to request to fill the gap between our chain tip and the block at "height"
+static uint32_t block_range_size(uint64_t height, uint64_t tip_height)
+{
+	if (height <= tip_height + 1) {
+		return 1;
+	}
+	return static_cast<uint32_t>(std::min<uint64_t>(height - tip_height - 1, P2PServer::MAX_BLOCK_RANGE));
+}
+
 P2PServer::P2PServer(p2pool* pool)
 	: TCPServer(P2PClient::allocate, pool->params().m_p2pAddresses)
 	, m_pool(pool)
 	, m_rd{}
 	, m_rng(m_rd())
-	, m_block(new PoolBlock())
 	, m_timer{}
 	, m_peerId(m_rng())
 	, m_peerListLastSaved(0)
+	, m_hashingCompletions(&m_loop)
 {
 	uv_mutex_init_checked(&m_rngLock);
-	uv_mutex_init_checked(&m_blockLock);
+	uv_mutex_init_checked(&m_incomingBlocksLock);
 	uv_mutex_init_checked(&m_peerListLock);
 	uv_mutex_init_checked(&m_broadcastLock);
 
@@ -79,15 +147,57 @@ P2PServer::~P2PServer()
 {
 	uv_timer_stop(&m_timer);
 	uv_close(reinterpret_cast<uv_handle_t*>(&m_broadcastAsync), nullptr);
+	m_hashingCompletions.close();
 
 	shutdown_tcp();
 
+	m_hashingCompletions.cancel_pending();
+
 	uv_mutex_destroy(&m_rngLock);
-	uv_mutex_destroy(&m_blockLock);
 	uv_mutex_destroy(&m_peerListLock);
 	uv_mutex_destroy(&m_broadcastLock);
 
-	delete m_block;
+	for (IncomingBlock* incoming_block : m_incomingBlocks) {
+		delete incoming_block;
+	}
+	uv_mutex_destroy(&m_incomingBlocksLock);
+}
+
+P2PServer::IncomingBlock* P2PServer::get_incoming_block()
+{
+	{
+		MutexLock lock(m_incomingBlocksLock);
+
+		if (!m_incomingBlocks.empty()) {
+			IncomingBlock* incoming_block = m_incomingBlocks.back();
+			m_incomingBlocks.pop_back();
+			return incoming_block;
+		}
+	}
+
+	return new IncomingBlock();
+}
+
+void P2PServer::release_incoming_block(IncomingBlock* incoming_block)
+{
+	// Keep enough parse buffers for a burst of broadcasts, but don't hold on to memory after it
+	constexpr size_t MAX_INCOMING_BLOCKS = 32;
+
+	if (!incoming_block->m_inFlightId.empty()) {
+		m_blocksInFlight.erase(incoming_block->m_inFlightId);
+	}
+
+	{
+		MutexLock lock(m_incomingBlocksLock);
+
+		if (m_incomingBlocks.size() < MAX_INCOMING_BLOCKS) {
+			incoming_block->clear();
+			m_incomingBlocks.push_back(incoming_block);
+			return;
+		}
+	}
+
+	delete incoming_block;
 }
 
 void P2PServer::connect_to_peers(const std::string& peer_list)
@@ -384,7 +494,42 @@ void P2PServer::broadcast(const PoolBlock& block)
 	data->ancestor_hashes = block.m_uncles;
 	data->ancestor_hashes.push_back(block.m_parent);
 
-	LOGINFO(5, "Broadcasting block " << block.m_sidechainId << ": " << data->pruned_blob.size() << '/' << data->blob.size() << " bytes (pruned/full)");
+	data->id = block.m_sidechainId;
+
+	// Compact blob is the pruned blob with transaction hashes replaced by short IDs:
+	// block id | salt | prefix size | pruned blob up to the transaction list | transaction count | short IDs | side chain data
+	// m_transactions[0] is the miner tx which is not in the transaction list
+	const size_t num_transactions = block.m_transactions.size() - 1;
+	if (num_transactions > 0) {
+		data->transactions.assign(block.m_transactions.begin() + 1, block.m_transactions.end());
+
+		const size_t tx_list_size = block.m_mainChainData.size() - (block.m_mainChainHeaderSize + block.m_mainChainMinerTxSize);
+		const uint32_t prefix_size = static_cast<uint32_t>(data->pruned_blob.size() - block.m_sideChainData.size() - tx_list_size);
+
+		const uint64_t salt = get_random64();
+
+		std::vector<uint64_t> short_ids;
+		Mempool::calc_short_ids(salt, data->transactions.data(), num_transactions, short_ids);
+
+		std::vector<uint8_t>& c = data->compact_blob;
+		c.reserve(HASH_SIZE + sizeof(salt) + sizeof(uint32_t) * 2 + prefix_size + num_transactions * Mempool::SHORT_ID_SIZE + block.m_sideChainData.size());
+
+		c.assign(block.m_sidechainId.h, block.m_sidechainId.h + HASH_SIZE);
+		c.insert(c.end(), reinterpret_cast<const uint8_t*>(&salt), reinterpret_cast<const uint8_t*>(&salt) + sizeof(salt));
+		c.insert(c.end(), reinterpret_cast<const uint8_t*>(&prefix_size), reinterpret_cast<const uint8_t*>(&prefix_size) + sizeof(prefix_size));
+		c.insert(c.end(), data->pruned_blob.begin(), data->pruned_blob.begin() + prefix_size);
+
+		const uint32_t n = static_cast<uint32_t>(num_transactions);
+		c.insert(c.end(), reinterpret_cast<const uint8_t*>(&n), reinterpret_cast<const uint8_t*>(&n) + sizeof(n));
+
+		for (uint64_t k : short_ids) {
+			c.insert(c.end(), reinterpret_cast<const uint8_t*>(&k), reinterpret_cast<const uint8_t*>(&k) + Mempool::SHORT_ID_SIZE);
+		}
+
+		c.insert(c.end(), block.m_sideChainData.begin(), block.m_sideChainData.end());
+	}
+
+	LOGINFO(5, "Broadcasting block " << block.m_sidechainId << ": " << data->compact_blob.size() << '/' << data->pruned_blob.size() << '/' << data->blob.size() << " bytes (compact/pruned/full)");
 
 	{
 		MutexLock lock(m_broadcastLock);
@@ -438,6 +583,35 @@ void P2PServer::on_broadcast()
 			}
 		});
 
+	for (Broadcast* data : broadcast_queue) {
+		if (!data->compact_blob.empty()) {
+			if (m_compactBlockTxs.size() >= MAX_COMPACT_BLOCK_TXS) {
+				m_compactBlockTxs.erase(m_compactBlockTxs.begin());
+			}
+			m_compactBlockTxs.push_back({ data->id, data->transactions });
+		}
+	}
+
+	// Blobs are shared by all peers without copying, only the message header is written for every peer
+	struct Payloads
+	{
+		SharedPayload full;
+		SharedPayload pruned;
+		SharedPayload compact;
+	};
+
+	std::vector<Payloads> payloads(broadcast_queue.size());
+
+	for (size_t i = 0; i < broadcast_queue.size(); ++i) {
+		Broadcast* data = broadcast_queue[i];
+
+		payloads[i].full = std::make_shared<std::vector<uint8_t>>(std::move(data->blob));
+		payloads[i].pruned = std::make_shared<std::vector<uint8_t>>(std::move(data->pruned_blob));
+		if (!data->compact_blob.empty()) {
+			payloads[i].compact = std::make_shared<std::vector<uint8_t>>(std::move(data->compact_blob));
+		}
+	}
+
 	MutexLock lock(m_clientsListLock);
 
 	for (P2PClient* client = static_cast<P2PClient*>(m_connectedClientsList->m_next); client != m_connectedClientsList; client = static_cast<P2PClient*>(client->m_next)) {
@@ -445,45 +619,49 @@ void P2PServer::on_broadcast()
 			continue;
 		}
 
-		for (Broadcast* data : broadcast_queue) {
-			send(client, [client, data](void* buf) {
-				uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
-				uint8_t* p = p0;
+		for (size_t i = 0; i < broadcast_queue.size(); ++i) {
+			const Broadcast* data = broadcast_queue[i];
 
-				bool send_pruned = true;
-				{
-					ReadLock lock(client->m_broadcastedHashesLock);
-					for (const hash& id : data->ancestor_hashes) {
-						if (client->m_broadcastedHashes.find(id) == client->m_broadcastedHashes.end()) {
-							send_pruned = false;
-							break;
-						}
-					}
+			bool send_pruned = true;
+			for (const hash& id : data->ancestor_hashes) {
+				if (!client->m_knownBlocks.contains(id)) {
+					send_pruned = false;
+					break;
 				}
+			}
 
-				if (send_pruned) {
-					LOGINFO(5, "sending BLOCK_BROADCAST (pruned) to " << log::Gray() << static_cast<char*>(client->m_addrString));
-					*(p++) = static_cast<uint8_t>(MessageId::BLOCK_BROADCAST);
+			MessageId message_id = MessageId::BLOCK_BROADCAST;
+			const SharedPayload* payload;
 
-					*reinterpret_cast<uint32_t*>(p) = static_cast<uint32_t>(data->pruned_blob.size());
-					p += sizeof(uint32_t);
+			if (send_pruned && payloads[i].compact && (client->m_peerFeatures & FEATURE_COMPACT_BLOCKS)) {
+				LOGINFO(5, "sending COMPACT_BLOCK_BROADCAST to " << log::Gray() << static_cast<char*>(client->m_addrString));
+				message_id = MessageId::COMPACT_BLOCK_BROADCAST;
+				payload = &payloads[i].compact;
+			}
+			else if (send_pruned) {
+				LOGINFO(5, "sending BLOCK_BROADCAST (pruned) to " << log::Gray() << static_cast<char*>(client->m_addrString));
+				payload = &payloads[i].pruned;
+			}
+			else {
+				LOGINFO(5, "sending BLOCK_BROADCAST (full)   to " << log::Gray() << static_cast<char*>(client->m_addrString));
+				payload = &payloads[i].full;
+			}
 
-					memcpy(p, data->pruned_blob.data(), data->pruned_blob.size());
-					p += data->pruned_blob.size();
-				}
-				else {
-					LOGINFO(5, "sending BLOCK_BROADCAST (full)   to " << log::Gray() << static_cast<char*>(client->m_addrString));
-					*(p++) = static_cast<uint8_t>(MessageId::BLOCK_BROADCAST);
+			send(client,
+				[message_id, payload](void* buf)
+				{
+					uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
+					uint8_t* p = p0;
 
-					*reinterpret_cast<uint32_t*>(p) = static_cast<uint32_t>(data->blob.size());
+					*(p++) = static_cast<uint8_t>(message_id);
+
+					*reinterpret_cast<uint32_t*>(p) = static_cast<uint32_t>((*payload)->size());
 					p += sizeof(uint32_t);
 
-					memcpy(p, data->blob.data(), data->blob.size());
-					p += data->blob.size();
-				}
+					return p - p0;
+				}, *payload);
 
-				return p - p0;
-				});
+			client->m_knownBlocks.insert(data->id);
 		}
 	}
 }
@@ -497,7 +675,7 @@ uint64_t P2PServer::get_random64()
 void P2PServer::print_status()
 {
 	LOGINFO(0, "status" <<
-		"\nConnections    = " << m_numConnections << " (" << m_numIncomingConnections << " incoming)" <<
+		"\nConnections    = " << m_numConnections.load() << " (" << m_numIncomingConnections.load() << " incoming)" <<
 		"\nPeer list size = " << m_peerList.size()
 	);
 }
@@ -555,6 +733,76 @@ void P2PServer::download_missing_blocks()
 	}
 }
 
+P2PServer::KnownBlocks::KnownBlocks()
+{
+	clear();
+}
+
+void P2PServer::KnownBlocks::clear()
+{
+	m_ringPos = 0;
+	m_size = 0;
+	memset(m_table, 0, sizeof(m_table));
+}
+
+size_t P2PServer::KnownBlocks::home_slot(const hash& id)
+{
+	uint64_t k;
+	memcpy(&k, id.h, sizeof(k));
+	return static_cast<size_t>(k % TABLE_SIZE);
+}
+
+size_t P2PServer::KnownBlocks::find_slot(const hash& id) const
+{
+	// The table is never more than half full, so there is always an empty slot to stop at
+	for (size_t i = home_slot(id);; i = (i + 1) % TABLE_SIZE) {
+		const uint16_t k = m_table[i];
+		if (!k || (m_ring[k - 1] == id)) {
+			return i;
+		}
+	}
+}
+
+void P2PServer::KnownBlocks::erase_slot(size_t slot)
+{
+	// Backward shift deletion: move entries up to keep every probe sequence unbroken
+	for (size_t i = (slot + 1) % TABLE_SIZE; m_table[i]; i = (i + 1) % TABLE_SIZE) {
+		const size_t home = home_slot(m_ring[m_table[i] - 1]);
+
+		const bool can_move = (slot < i) ? ((home <= slot) || (home > i)) : ((home <= slot) && (home > i));
+		if (can_move) {
+			m_table[slot] = m_table[i];
+			slot = i;
+		}
+	}
+	m_table[slot] = 0;
+}
+
+void P2PServer::KnownBlocks::insert(const hash& id)
+{
+	size_t slot = find_slot(id);
+	if (m_table[slot]) {
+		return;
+	}
+
+	if (m_size >= CAPACITY) {
+		erase_slot(find_slot(m_ring[m_ringPos]));
+		slot = find_slot(id);
+	}
+	else {
+		++m_size;
+	}
+
+	m_ring[m_ringPos] = id;
+	m_table[slot] = static_cast<uint16_t>(m_ringPos + 1);
+	m_ringPos = (m_ringPos + 1) % CAPACITY;
+}
+
+bool P2PServer::KnownBlocks::contains(const hash& id) const
+{
+	return m_table[find_slot(id)] != 0;
+}
+
 P2PServer::P2PClient::P2PClient()
 	: m_peerId(0)
 	, m_expectedMessage(MessageId::HANDSHAKE_CHALLENGE)
@@ -563,13 +811,20 @@ P2PServer::P2PClient::P2PClient()
 	, m_handshakeComplete(false)
 	, m_listenPort(-1)
 	, m_lastPeerListRequest(0)
+	, m_peerFeatures(0)
+	, m_blockRange(nullptr)
+	, m_blockRangeBlocks(0)
+	, m_blockRangeBytes(0)
+	, m_blockRangeRequestsTime(0)
+	, m_blockRangeRequestsReceived(0)
+	, m_compactBlockId()
+	, m_compactBlockTxOffset(0)
 {
-	uv_rwlock_init_checked(&m_broadcastedHashesLock);
 }
 
 P2PServer::P2PClient::~P2PClient()
 {
-	uv_rwlock_destroy(&m_broadcastedHashesLock);
+	delete m_blockRange;
 }
 
 void P2PServer::P2PClient::reset()
@@ -584,8 +839,23 @@ void P2PServer::P2PClient::reset()
 	m_listenPort = -1;
 	m_lastPeerListRequest = 0;
 
-	WriteLock lock(m_broadcastedHashesLock);
-	m_broadcastedHashes.clear();
+	m_peerFeatures = 0;
+
+	delete m_blockRange;
+	m_blockRange = nullptr;
+	m_blockRangeRequests.clear();
+	m_blockRangeBlocks = 0;
+	m_blockRangeBytes = 0;
+	m_blockRangeRequestsTime = 0;
+	m_blockRangeRequestsReceived = 0;
+
+	m_compactBlockId = {};
+	m_compactBlockBlob.clear();
+	m_compactBlockTxOffset = 0;
+	m_compactBlockMissingTxs.clear();
+	m_compactFallbackIds.clear();
+
+	m_knownBlocks.clear();
 }
 
 bool P2PServer::P2PClient::on_connect()
@@ -704,7 +974,7 @@ bool P2PServer::P2PClient::on_read(char* data, uint32_t size)
 				const uint32_t block_size = *reinterpret_cast<uint32_t*>(buf + 1);
 				if (bytes_left >= 1 + sizeof(uint32_t) + block_size) {
 					bytes_read = 1 + sizeof(uint32_t) + block_size;
-					if (!on_block_broadcast(buf + 1 + sizeof(uint32_t), block_size)) {
+					if (!on_block_broadcast(buf + 1 + sizeof(uint32_t), block_size, false)) {
 						ban(DEFAULT_BAN_TIME);
 						server->remove_peer_from_list(this);
 						return false;
@@ -726,6 +996,96 @@ bool P2PServer::P2PClient::on_read(char* data, uint32_t size)
 			}
 			break;
 
+		case MessageId::FEATURES:
+			LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent FEATURES");
+
+			if (bytes_left >= 1 + sizeof(uint32_t)) {
+				bytes_read = 1 + sizeof(uint32_t);
+				if (!on_features(buf + 1)) {
+					ban(DEFAULT_BAN_TIME);
+					server->remove_peer_from_list(this);
+					return false;
+				}
+			}
+			break;
+
+		case MessageId::BLOCK_RANGE_REQUEST:
+			LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent BLOCK_RANGE_REQUEST");
+
+			if (bytes_left >= 1 + HASH_SIZE + sizeof(uint32_t)) {
+				bytes_read = 1 + HASH_SIZE + sizeof(uint32_t);
+				if (!on_block_range_request(buf + 1)) {
+					ban(DEFAULT_BAN_TIME);
+					server->remove_peer_from_list(this);
+					return false;
+				}
+			}
+			break;
+
+		case MessageId::BLOCK_RANGE_RESPONSE:
+			LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent BLOCK_RANGE_RESPONSE");
+
+			if (bytes_left >= 1 + sizeof(uint32_t)) {
+				const uint32_t payload_size = *reinterpret_cast<uint32_t*>(buf + 1);
+				if (bytes_left >= 1 + sizeof(uint32_t) + payload_size) {
+					bytes_read = 1 + sizeof(uint32_t) + payload_size;
+					if (!on_block_range_response(buf + 1 + sizeof(uint32_t), payload_size)) {
+						ban(DEFAULT_BAN_TIME);
+						server->remove_peer_from_list(this);
+						return false;
+					}
+				}
+			}
+			break;
+
+		case MessageId::COMPACT_BLOCK_BROADCAST:
+			LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent COMPACT_BLOCK_BROADCAST");
+
+			if (bytes_left >= 1 + sizeof(uint32_t)) {
+				const uint32_t payload_size = *reinterpret_cast<uint32_t*>(buf + 1);
+				if (bytes_left >= 1 + sizeof(uint32_t) + payload_size) {
+					bytes_read = 1 + sizeof(uint32_t) + payload_size;
+					if (!on_compact_block_broadcast(buf + 1 + sizeof(uint32_t), payload_size)) {
+						ban(DEFAULT_BAN_TIME);
+						server->remove_peer_from_list(this);
+						return false;
+					}
+				}
+			}
+			break;
+
+		case MessageId::COMPACT_BLOCK_TX_REQUEST:
+			LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent COMPACT_BLOCK_TX_REQUEST");
+
+			if (bytes_left >= 1 + sizeof(uint32_t)) {
+				const uint32_t payload_size = *reinterpret_cast<uint32_t*>(buf + 1);
+				if (bytes_left >= 1 + sizeof(uint32_t) + payload_size) {
+					bytes_read = 1 + sizeof(uint32_t) + payload_size;
+					if (!on_compact_block_tx_request(buf + 1 + sizeof(uint32_t), payload_size)) {
+						ban(DEFAULT_BAN_TIME);
+						server->remove_peer_from_list(this);
+						return false;
+					}
+				}
+			}
+			break;
+
+		case MessageId::COMPACT_BLOCK_TX_RESPONSE:
+			LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent COMPACT_BLOCK_TX_RESPONSE");
+
+			if (bytes_left >= 1 + sizeof(uint32_t)) {
+				const uint32_t payload_size = *reinterpret_cast<uint32_t*>(buf + 1);
+				if (bytes_left >= 1 + sizeof(uint32_t) + payload_size) {
+					bytes_read = 1 + sizeof(uint32_t) + payload_size;
+					if (!on_compact_block_tx_response(buf + 1 + sizeof(uint32_t), payload_size)) {
+						ban(DEFAULT_BAN_TIME);
+						server->remove_peer_from_list(this);
+						return false;
+					}
+				}
+			}
+			break;
+
 		case MessageId::PEER_LIST_RESPONSE:
 			LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent PEER_LIST_RESPONSE");
 
@@ -828,27 +1188,30 @@ void P2PServer::P2PClient::send_handshake_solution(const uint8_t (&challenge)[CH
 			const std::vector<uint8_t>& consensus_id = work->server->m_pool->side_chain().consensus_id();
 			const int consensus_id_size = static_cast<int>(consensus_id.size());
 
-			for (size_t iter = 1;; ++iter, ++work->salt) {
-				uint64_t k = work->salt;
-				for (size_t i = 0; i < CHALLENGE_SIZE; ++i) {
-					work->solution_salt[i] = k & 0xFF;
-					k >>= 8;
-				}
+			// Try MAX_LANES salts at once, keccak_multi() hashes them in parallel
+			constexpr uint32_t N = KeccakParams::MAX_LANES;
+			const int msg_size = CHALLENGE_SIZE * 2 + consensus_id_size;
 
-				keccak_custom(
-					[work, &consensus_id, consensus_id_size](int offset) -> uint8_t
-					{
-						if (offset < CHALLENGE_SIZE) {
-							return work->challenge[offset];
-						}
-						offset -= CHALLENGE_SIZE;
+			std::vector<uint8_t> msgs(static_cast<size_t>(msg_size) * N);
+			for (uint32_t j = 0; j < N; ++j) {
+				uint8_t* p = msgs.data() + static_cast<size_t>(j) * msg_size;
+				memcpy(p, work->challenge, CHALLENGE_SIZE);
+				memcpy(p + CHALLENGE_SIZE, consensus_id.data(), consensus_id_size);
+			}
+
+			uint8_t solutions[HASH_SIZE * N];
 
-						if (offset < consensus_id_size) {
-							return consensus_id[offset];
-						}
+			for (size_t iter = 1;; iter += N, work->salt += N) {
+				for (uint32_t j = 0; j < N; ++j) {
+					uint8_t* salt = msgs.data() + static_cast<size_t>(j) * msg_size + CHALLENGE_SIZE + consensus_id_size;
+					uint64_t k = work->salt + j;
+					for (size_t i = 0; i < CHALLENGE_SIZE; ++i) {
+						salt[i] = k & 0xFF;
+						k >>= 8;
+					}
+				}
 
-						return work->solution_salt[offset - consensus_id_size];
-					}, CHALLENGE_SIZE * 2 + static_cast<int>(consensus_id.size()), work->solution.h, HASH_SIZE);
+				keccak_multi(msgs.data(), msg_size, solutions, N);
 
 				// We might've been disconnected while working on the challenge, do nothing in this case
 				if (work->client->m_resetCounter.load() != work->reset_counter) {
@@ -860,14 +1223,21 @@ void P2PServer::P2PClient::send_handshake_solution(const uint8_t (&challenge)[CH
 					return;
 				}
 
-				uint64_t* value = reinterpret_cast<uint64_t*>(work->solution.h);
+				for (uint32_t j = 0; j < N; ++j) {
+					const uint8_t* solution = solutions + j * HASH_SIZE;
 
-				uint64_t high;
-				umul128(value[HASH_SIZE / sizeof(uint64_t) - 1], CHALLENGE_DIFFICULTY, &high);
+					uint64_t value;
+					memcpy(&value, solution + HASH_SIZE - sizeof(uint64_t), sizeof(uint64_t));
 
-				if (high == 0) {
-					LOGINFO(5, "found handshake challenge solution after " << iter << " iterations");
-					return;
+					uint64_t high;
+					umul128(value, CHALLENGE_DIFFICULTY, &high);
+
+					if (high == 0) {
+						memcpy(work->solution.h, solution, HASH_SIZE);
+						memcpy(work->solution_salt, msgs.data() + static_cast<size_t>(j) * msg_size + CHALLENGE_SIZE + consensus_id_size, CHALLENGE_SIZE);
+						LOGINFO(5, "found handshake challenge solution after " << iter + j << " iterations");
+						return;
+					}
 				}
 			}
 		},
@@ -1046,6 +1416,13 @@ void P2PServer::P2PClient::on_after_handshake(uint8_t* &p)
 	memcpy(p, &port, sizeof(port));
 	p += sizeof(port);
 
+	// Sent before the chain tip request, so FEATURES arrives before the chain tip and its missing blocks can be requested in ranges
+	LOGINFO(5, "sending BLOCK_REQUEST for features");
+	*(p++) = static_cast<uint8_t>(MessageId::BLOCK_REQUEST);
+
+	memcpy(p, features_request_id, HASH_SIZE);
+	p += HASH_SIZE;
+
 	LOGINFO(5, "sending BLOCK_REQUEST for the chain tip");
 	*(p++) = static_cast<uint8_t>(MessageId::BLOCK_REQUEST);
 
@@ -1072,18 +1449,43 @@ bool P2PServer::P2PClient::on_listen_port(const uint8_t* buf)
 
 bool P2PServer::P2PClient::on_block_request(const uint8_t* buf)
 {
+	P2PServer* server = static_cast<P2PServer*>(m_owner);
+
+	if (memcmp(buf, features_request_id, HASH_SIZE) == 0) {
+		return server->send(this,
+			[](void* buf)
+			{
+				uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
+				uint8_t* p = p0;
+
+				LOGINFO(5, "sending FEATURES");
+				*(p++) = static_cast<uint8_t>(MessageId::FEATURES);
+
+				const uint32_t features = FEATURE_BLOCK_RANGE | FEATURE_COMPACT_BLOCKS;
+				memcpy(p, &features, sizeof(features));
+				p += sizeof(features);
+
+				return p - p0;
+			});
+	}
+
 	hash id;
 	memcpy(id.h, buf, HASH_SIZE);
 
-	P2PServer* server = static_cast<P2PServer*>(m_owner);
-
 	std::vector<uint8_t> blob;
 	if (!server->m_pool->side_chain().get_block_blob(id, blob) && !id.empty()) {
 		LOGWARN(5, "got a request for block with id " << id << " but couldn't find it");
 	}
 
+	// Block data is written directly from this buffer, it's not copied into the write buffer
+	const SharedPayload payload = std::make_shared<std::vector<uint8_t>>(std::move(blob));
+
+	if (!payload->empty() && !id.empty()) {
+		m_knownBlocks.insert(id);
+	}
+
 	return server->send(this,
-		[this, &blob](void* buf)
+		[&payload](void* buf)
 		{
 			uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
 			uint8_t* p = p0;
@@ -1091,14 +1493,11 @@ bool P2PServer::P2PClient::on_block_request(const uint8_t* buf)
 			LOGINFO(5, "sending BLOCK_RESPONSE");
 			*(p++) = static_cast<uint8_t>(MessageId::BLOCK_RESPONSE);
 
-			*reinterpret_cast<uint32_t*>(p) = static_cast<uint32_t>(blob.size());
+			*reinterpret_cast<uint32_t*>(p) = static_cast<uint32_t>(payload->size());
 			p += sizeof(uint32_t);
 
-			memcpy(p, blob.data(), blob.size());
-			p += blob.size();
-
 			return p - p0;
-		});
+		}, payload);
 }
 
 bool P2PServer::P2PClient::on_block_response(const uint8_t* buf, uint32_t size)
@@ -1108,20 +1507,25 @@ bool P2PServer::P2PClient::on_block_response(const uint8_t* buf, uint32_t size)
 		return true;
 	}
 
-	P2PServer* server = static_cast<P2PServer*>(m_owner);
-
-	MutexLock lock(server->m_blockLock);
+	PoolBlockView view;
 
-	const int result = server->m_block->deserialize(buf, size, server->m_pool->side_chain());
+	const int result = view.parse(buf, size);
 	if (result != 0) {
 		LOGWARN(3, "peer " << static_cast<char*>(m_addrString) << " sent an invalid block, error " << result);
 		return false;
 	}
 
-	return handle_incoming_block_async();
+	// Full block for a compact block which couldn't be rebuilt, it's a new tip and must be relayed like the broadcast it replaces
+	auto it = std::find(m_compactFallbackIds.begin(), m_compactFallbackIds.end(), view.m_sidechainId);
+	if (it != m_compactFallbackIds.end()) {
+		m_compactFallbackIds.erase(it);
+		return handle_incoming_block_async(view, true, false);
+	}
+
+	return handle_incoming_block_async(view, false, false);
 }
 
-bool P2PServer::P2PClient::on_block_broadcast(const uint8_t* buf, uint32_t size)
+bool P2PServer::P2PClient::on_block_broadcast(const uint8_t* buf, uint32_t size, bool compact)
 {
 	if (!size) {
 		LOGWARN(3, "peer " << static_cast<char*>(m_addrString) << " broadcasted an empty block");
@@ -1130,65 +1534,584 @@ bool P2PServer::P2PClient::on_block_broadcast(const uint8_t* buf, uint32_t size)
 
 	P2PServer* server = static_cast<P2PServer*>(m_owner);
 
-	MutexLock lock(server->m_blockLock);
+	// Most broadcasts are duplicates of blocks received from other peers, or stale
+	// Both are rejected before anything is copied and before the keccak hash is checked
+	PoolBlockView view;
 
-	const int result = server->m_block->deserialize(buf, size, server->m_pool->side_chain());
+	const int result = view.parse(buf, size);
 	if (result != 0) {
+		if (compact) {
+			LOGINFO(4, "compact block " << m_compactBlockId << " couldn't be rebuilt, requesting the full block");
+			return send_compact_fallback_request(m_compactBlockId);
+		}
 		LOGWARN(3, "peer " << static_cast<char*>(m_addrString) << " sent an invalid block, error " << result);
 		return false;
 	}
 
-	{
-		WriteLock lock2(m_broadcastedHashesLock);
-		m_broadcastedHashes.insert(server->m_block->m_sidechainId);
-	}
+	m_knownBlocks.insert(view.m_sidechainId);
 
-	if ((server->m_block->m_prevId != server->m_pool->miner_data().prev_id) &&
-		(server->m_block->m_txinGenHeight < server->m_pool->miner_data().height)){
+	if ((view.m_prevId != server->m_pool->miner_data().prev_id) &&
+		(view.m_txinGenHeight < server->m_pool->miner_data().height)){
 		LOGINFO(4, "peer " << static_cast<char*>(m_addrString) << " broadcasted a stale block, ignoring it");
 		return true;
 	}
 
-	server->m_block->m_wantBroadcast = true;
+	return handle_incoming_block_async(view, true, compact);
+}
 
-	return handle_incoming_block_async();
+bool P2PServer::P2PClient::on_features(const uint8_t* buf)
+{
+	memcpy(&m_peerFeatures, buf, sizeof(m_peerFeatures));
+	LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " supports features " << m_peerFeatures);
+	return true;
 }
 
-bool P2PServer::P2PClient::on_peer_list_request(const uint8_t*)
+bool P2PServer::P2PClient::on_block_range_request(const uint8_t* buf)
 {
+	hash id;
+	memcpy(id.h, buf, HASH_SIZE);
+
+	uint32_t count;
+	memcpy(&count, buf + HASH_SIZE, sizeof(count));
+
+	if ((count == 0) || (count > MAX_BLOCK_RANGE)) {
+		LOGWARN(4, "peer " << static_cast<char*>(m_addrString) << " requested an invalid block range (" << count << " blocks)");
+		return false;
+	}
+
 	P2PServer* server = static_cast<P2PServer*>(m_owner);
 
-	Peer peers[PEER_LIST_RESPONSE_MAX_PEERS];
-	uint32_t num_selected_peers = 0;
-	{
-		MutexLock lock(server->m_clientsListLock);
+	const time_t cur_time = time(nullptr);
+	if (cur_time >= m_blockRangeRequestsTime + 10) {
+		m_blockRangeRequestsTime = cur_time;
+		m_blockRangeRequestsReceived = 0;
+	}
 
-		// Send every 4th peer on average, selected at random
-		const uint32_t n = server->m_numConnections;
-		const uint32_t peers_to_send_target = std::min<uint32_t>(PEER_LIST_RESPONSE_MAX_PEERS, std::max<uint32_t>(1, n / 4));
+	std::vector<std::vector<uint8_t>> blobs;
 
-		for (P2PClient* client = static_cast<P2PClient*>(server->m_connectedClientsList->m_next); client != server->m_connectedClientsList; client = static_cast<P2PClient*>(client->m_next)) {
-			if (client->m_listenPort < 0) {
-				continue;
-			}
+	if (++m_blockRangeRequestsReceived <= MAX_BLOCK_RANGE_REQUESTS) {
+		server->m_pool->side_chain().get_block_range_blobs(id, count, blobs);
+	}
+	else {
+		LOGWARN(4, "peer " << static_cast<char*>(m_addrString) << " sent too many BLOCK_RANGE_REQUEST messages, sending an empty response");
+	}
 
-			uint64_t hi;
-			umul128(server->get_random64(), n, &hi);
+	// The response is split into messages which fit in the buffer, the last one is marked
+	// Every message has at least 1 block, except when there are no blocks at all
+	constexpr size_t HEADER_SIZE = 1 + sizeof(uint32_t) + 1;
 
-			if ((hi < peers_to_send_target) && (client->m_addr != m_addr)) {
-				peers[num_selected_peers++] = { client->m_isV6, client->m_addr, client->m_listenPort, 0 };
+	for (size_t i = 0, n = blobs.size();;) {
+		size_t j = i;
+		size_t total_size = HEADER_SIZE;
 
-				if (num_selected_peers >= PEER_LIST_RESPONSE_MAX_PEERS) {
-					break;
-				}
+		for (; j < n; ++j) {
+			const size_t k = sizeof(uint32_t) + blobs[j].size();
+			if (total_size + k > P2P_BUF_SIZE) {
+				break;
 			}
+			total_size += k;
 		}
-	}
 
-	return server->send(this,
-		[&peers, num_selected_peers](void* buf)
-		{
-			uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
+		// This block alone doesn't fit in a message, skip it
+		if ((j == i) && (j < n)) {
+			++i;
+			continue;
+		}
+
+		const bool last = (j == n);
+
+		const bool result = server->send(this,
+			[&blobs, i, j, last, total_size](void* buf)
+			{
+				uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
+				uint8_t* p = p0;
+
+				LOGINFO(5, "sending BLOCK_RANGE_RESPONSE (" << j - i << " blocks)");
+				*(p++) = static_cast<uint8_t>(MessageId::BLOCK_RANGE_RESPONSE);
+
+				const uint32_t payload_size = static_cast<uint32_t>(total_size - 1 - sizeof(uint32_t));
+				memcpy(p, &payload_size, sizeof(uint32_t));
+				p += sizeof(uint32_t);
+
+				*(p++) = last ? 1 : 0;
+
+				for (size_t k = i; k < j; ++k) {
+					const uint32_t blob_size = static_cast<uint32_t>(blobs[k].size());
+					memcpy(p, &blob_size, sizeof(uint32_t));
+					p += sizeof(uint32_t);
+
+					memcpy(p, blobs[k].data(), blob_size);
+					p += blob_size;
+				}
+
+				return p - p0;
+			});
+
+		if (!result) {
+			return false;
+		}
+
+		if (last) {
+			return true;
+		}
+
+		i = j;
+	}
+}
+
+bool P2PServer::P2PClient::on_block_range_response(const uint8_t* buf, uint32_t size)
+{
+	if (m_blockRangeRequests.empty()) {
+		LOGWARN(4, "peer " << static_cast<char*>(m_addrString) << " sent an unexpected BLOCK_RANGE_RESPONSE");
+		return false;
+	}
+
+	if (size == 0) {
+		LOGWARN(4, "peer " << static_cast<char*>(m_addrString) << " sent an empty BLOCK_RANGE_RESPONSE");
+		return false;
+	}
+
+	P2PServer* server = static_cast<P2PServer*>(m_owner);
+	SideChain& side_chain = server->m_pool->side_chain();
+
+	const bool last = (buf[0] != 0);
+
+	const uint8_t* p = buf + 1;
+	const uint8_t* const buf_end = buf + size;
+
+	bool first_block = false;
+	if (!m_blockRange) {
+		m_blockRange = server->get_incoming_block();
+		m_blockRangeBlocks = 0;
+		m_blockRangeBytes = 0;
+		first_block = true;
+	}
+
+	IncomingBlock* incoming_block = m_blockRange;
+
+	const uint64_t max_blocks = static_cast<uint64_t>(m_blockRangeRequests.front()) * (1 + MAX_BLOCK_RANGE_UNCLES);
+	const uint64_t max_bytes = std::min<uint64_t>(max_blocks * P2P_BUF_SIZE, MAX_BLOCK_RANGE_RESPONSE_SIZE);
+
+	while (p < buf_end) {
+		uint32_t block_size;
+		if (static_cast<size_t>(buf_end - p) < sizeof(block_size)) {
+			return false;
+		}
+		memcpy(&block_size, p, sizeof(block_size));
+		p += sizeof(block_size);
+
+		if (static_cast<size_t>(buf_end - p) < block_size) {
+			return false;
+		}
+
+		++m_blockRangeBlocks;
+		m_blockRangeBytes += block_size;
+
+		if ((m_blockRangeBlocks > max_blocks) || (m_blockRangeBytes > max_bytes)) {
+			LOGWARN(3, "peer " << static_cast<char*>(m_addrString) << " sent too much data in BLOCK_RANGE_RESPONSE (" << m_blockRangeBlocks << " blocks, " << m_blockRangeBytes << " bytes)");
+			return false;
+		}
+
+		PoolBlockView view;
+
+		const int result = view.parse(p, block_size);
+		if (result != 0) {
+			LOGWARN(3, "peer " << static_cast<char*>(m_addrString) << " sent an invalid block, error " << result);
+			return false;
+		}
+
+		// Blocks come oldest first, so the next range can be requested right away
+		// It will be downloaded while this range is being added
+		if (first_block) {
+			first_block = false;
+
+			if ((view.m_sidechainHeight > 0) && !side_chain.has_block(view.m_parent)) {
+				const uint32_t n = block_range_size(view.m_sidechainHeight, side_chain.chain_tip_height());
+				if (n > 1) {
+					if (!send_block_range_request(view.m_parent, n)) {
+						return false;
+					}
+					incoming_block->m_pipelinedId = view.m_parent;
+				}
+			}
+		}
+
+		if (!side_chain.block_seen(view.m_sidechainId)) {
+			incoming_block->m_blocks.emplace_back(static_cast<uint32_t>(incoming_block->m_blob.size()), block_size);
+			incoming_block->m_blob.insert(incoming_block->m_blob.end(), p, p + block_size);
+		}
+
+		p += block_size;
+	}
+
+	if (!last) {
+		return true;
+	}
+
+	m_blockRangeRequests.pop_front();
+	m_blockRange = nullptr;
+
+	if (incoming_block->m_blocks.empty()) {
+		server->release_incoming_block(incoming_block);
+		return true;
+	}
+
+	return queue_incoming_blocks(incoming_block, false, HashingExecutor::Priority::SYNC_BLOCK);
+}
+
+bool P2PServer::P2PClient::send_block_request(const hash& id)
+{
+	return m_owner->send(this,
+		[&id](void* buf)
+		{
+			uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
+			uint8_t* p = p0;
+
+			LOGINFO(5, "sending BLOCK_REQUEST for id = " << id);
+			*(p++) = static_cast<uint8_t>(MessageId::BLOCK_REQUEST);
+
+			memcpy(p, id.h, HASH_SIZE);
+			p += HASH_SIZE;
+
+			return p - p0;
+		});
+}
+
+bool P2PServer::P2PClient::send_compact_fallback_request(const hash& id)
+{
+	if (std::find(m_compactFallbackIds.begin(), m_compactFallbackIds.end(), id) == m_compactFallbackIds.end()) {
+		if (m_compactFallbackIds.size() >= MAX_COMPACT_FALLBACKS) {
+			m_compactFallbackIds.pop_front();
+		}
+		m_compactFallbackIds.push_back(id);
+	}
+
+	return send_block_request(id);
+}
+
+bool P2PServer::P2PClient::send_block_range_request(const hash& id, uint32_t count)
+{
+	m_blockRangeRequests.push_back(count);
+
+	return m_owner->send(this,
+		[&id, count](void* buf)
+		{
+			uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
+			uint8_t* p = p0;
+
+			LOGINFO(5, "sending BLOCK_RANGE_REQUEST for id = " << id << ", " << count << " blocks");
+			*(p++) = static_cast<uint8_t>(MessageId::BLOCK_RANGE_REQUEST);
+
+			memcpy(p, id.h, HASH_SIZE);
+			p += HASH_SIZE;
+
+			memcpy(p, &count, sizeof(count));
+			p += sizeof(count);
+
+			return p - p0;
+		});
+}
+
+bool P2PServer::P2PClient::on_compact_block_broadcast(const uint8_t* buf, uint32_t size)
+{
+	P2PServer* server = static_cast<P2PServer*>(m_owner);
+
+	const uint8_t* p = buf;
+	const uint8_t* const buf_end = buf + size;
+
+	hash id;
+	uint64_t salt;
+	uint32_t prefix_size;
+
+	if (size < HASH_SIZE + sizeof(salt) + sizeof(prefix_size)) {
+		LOGWARN(3, "peer " << static_cast<char*>(m_addrString) << " sent an invalid compact block");
+		return false;
+	}
+
+	memcpy(id.h, p, HASH_SIZE);
+	p += HASH_SIZE;
+
+	memcpy(&salt, p, sizeof(salt));
+	p += sizeof(salt);
+
+	memcpy(&prefix_size, p, sizeof(prefix_size));
+	p += sizeof(prefix_size);
+
+	m_knownBlocks.insert(id);
+
+	// Block id is not verified here, but it's only used to skip blocks we already have
+	if (server->m_pool->side_chain().block_seen(id)) {
+		LOGINFO(5, "block " << id << " was received before, skipping it");
+		return true;
+	}
+
+	uint32_t num_transactions;
+	if (static_cast<size_t>(buf_end - p) < static_cast<size_t>(prefix_size) + sizeof(num_transactions)) {
+		LOGWARN(3, "peer " << static_cast<char*>(m_addrString) << " sent an invalid compact block");
+		return false;
+	}
+
+	const uint8_t* prefix = p;
+	p += prefix_size;
+
+	memcpy(&num_transactions, p, sizeof(num_transactions));
+	p += sizeof(num_transactions);
+
+	if ((num_transactions == 0) || (num_transactions > P2P_BUF_SIZE / HASH_SIZE) || (static_cast<size_t>(buf_end - p) < static_cast<size_t>(num_transactions) * Mempool::SHORT_ID_SIZE)) {
+		LOGWARN(3, "peer " << static_cast<char*>(m_addrString) << " sent an invalid compact block");
+		return false;
+	}
+
+	const uint8_t* short_ids = p;
+	p += static_cast<size_t>(num_transactions) * Mempool::SHORT_ID_SIZE;
+
+	// Rebuild the pruned blob, transactions which are not in our mempool are requested from the peer
+	std::vector<std::pair<uint64_t, hash>> mempool_ids;
+	server->m_pool->mempool().get_short_ids(salt, mempool_ids);
+
+	std::vector<uint8_t>& blob = m_compactBlockBlob;
+	blob.assign(prefix, prefix + prefix_size);
+	writeVarint(num_transactions, blob);
+
+	m_compactBlockId = id;
+	m_compactBlockTxOffset = blob.size();
+	m_compactBlockMissingTxs.clear();
+
+	blob.resize(blob.size() + static_cast<size_t>(num_transactions) * HASH_SIZE);
+
+	for (uint32_t i = 0; i < num_transactions; ++i) {
+		uint64_t k = 0;
+		memcpy(&k, short_ids + static_cast<size_t>(i) * Mempool::SHORT_ID_SIZE, Mempool::SHORT_ID_SIZE);
+
+		const std::pair<uint64_t, hash> key{ k, hash() };
+		auto range = std::equal_range(mempool_ids.begin(), mempool_ids.end(), key,
+			[](const std::pair<uint64_t, hash>& a, const std::pair<uint64_t, hash>& b)
+			{
+				return a.first < b.first;
+			});
+
+		// Short ID collisions in our mempool are resolved by requesting the full hash
+		if (range.second - range.first == 1) {
+			memcpy(blob.data() + m_compactBlockTxOffset + static_cast<size_t>(i) * HASH_SIZE, range.first->second.h, HASH_SIZE);
+		}
+		else {
+			m_compactBlockMissingTxs.push_back(i);
+		}
+	}
+
+	blob.insert(blob.end(), p, buf_end);
+
+	if (m_compactBlockMissingTxs.empty()) {
+		LOGINFO(5, "compact block " << id << ": all " << num_transactions << " transactions found in mempool");
+		return finish_compact_block();
+	}
+
+	// Too many missing transactions to fit in one request, it's cheaper to download the full block
+	if (m_compactBlockMissingTxs.size() > MAX_COMPACT_BLOCK_TX_REQUEST) {
+		LOGINFO(5, "compact block " << id << ": " << m_compactBlockMissingTxs.size() << '/' << num_transactions << " transactions missing, requesting the full block");
+		m_compactBlockMissingTxs.clear();
+		m_compactBlockBlob.clear();
+		return send_compact_fallback_request(id);
+	}
+
+	LOGINFO(5, "compact block " << id << ": " << m_compactBlockMissingTxs.size() << '/' << num_transactions << " transactions missing, requesting them");
+
+	return server->send(this,
+		[this](void* buf)
+		{
+			uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
+			uint8_t* p = p0;
+
+			LOGINFO(5, "sending COMPACT_BLOCK_TX_REQUEST for id = " << m_compactBlockId);
+			*(p++) = static_cast<uint8_t>(MessageId::COMPACT_BLOCK_TX_REQUEST);
+
+			const uint32_t n = static_cast<uint32_t>(m_compactBlockMissingTxs.size());
+			const uint32_t payload_size = static_cast<uint32_t>(HASH_SIZE + sizeof(n) + n * sizeof(uint32_t));
+			memcpy(p, &payload_size, sizeof(payload_size));
+			p += sizeof(payload_size);
+
+			memcpy(p, m_compactBlockId.h, HASH_SIZE);
+			p += HASH_SIZE;
+
+			memcpy(p, &n, sizeof(n));
+			p += sizeof(n);
+
+			memcpy(p, m_compactBlockMissingTxs.data(), n * sizeof(uint32_t));
+			p += n * sizeof(uint32_t);
+
+			return p - p0;
+		});
+}
+
+bool P2PServer::P2PClient::on_compact_block_tx_request(const uint8_t* buf, uint32_t size)
+{
+	hash id;
+	uint32_t n;
+
+	if (size < HASH_SIZE + sizeof(n)) {
+		return false;
+	}
+
+	memcpy(id.h, buf, HASH_SIZE);
+	memcpy(&n, buf + HASH_SIZE, sizeof(n));
+
+	if ((n > MAX_COMPACT_BLOCK_TX_REQUEST) || (size != HASH_SIZE + sizeof(n) + n * sizeof(uint32_t))) {
+		LOGWARN(4, "peer " << static_cast<char*>(m_addrString) << " sent an invalid COMPACT_BLOCK_TX_REQUEST");
+		return false;
+	}
+
+	const uint8_t* indices = buf + HASH_SIZE + sizeof(n);
+
+	P2PServer* server = static_cast<P2PServer*>(m_owner);
+
+	const std::vector<hash>* transactions = nullptr;
+	for (const CompactBlockTxs& b : server->m_compactBlockTxs) {
+		if (b.id == id) {
+			transactions = &b.transactions;
+			break;
+		}
+	}
+
+	// We don't have this block anymore, empty response makes the peer request the full block
+	if (!transactions) {
+		n = 0;
+	}
+
+	for (uint32_t i = 0; i < n; ++i) {
+		uint32_t index;
+		memcpy(&index, indices + i * sizeof(uint32_t), sizeof(index));
+		if (index >= transactions->size()) {
+			LOGWARN(4, "peer " << static_cast<char*>(m_addrString) << " requested an invalid transaction index " << index);
+			return false;
+		}
+	}
+
+	return server->send(this,
+		[&id, n, indices, transactions](void* buf)
+		{
+			uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
+			uint8_t* p = p0;
+
+			LOGINFO(5, "sending COMPACT_BLOCK_TX_RESPONSE (" << n << " transactions)");
+			*(p++) = static_cast<uint8_t>(MessageId::COMPACT_BLOCK_TX_RESPONSE);
+
+			const uint32_t payload_size = static_cast<uint32_t>(HASH_SIZE + sizeof(n) + n * HASH_SIZE);
+			memcpy(p, &payload_size, sizeof(payload_size));
+			p += sizeof(payload_size);
+
+			memcpy(p, id.h, HASH_SIZE);
+			p += HASH_SIZE;
+
+			memcpy(p, &n, sizeof(n));
+			p += sizeof(n);
+
+			for (uint32_t i = 0; i < n; ++i) {
+				uint32_t index;
+				memcpy(&index, indices + i * sizeof(uint32_t), sizeof(index));
+
+				memcpy(p, (*transactions)[index].h, HASH_SIZE);
+				p += HASH_SIZE;
+			}
+
+			return p - p0;
+		});
+}
+
+bool P2PServer::P2PClient::on_compact_block_tx_response(const uint8_t* buf, uint32_t size)
+{
+	hash id;
+	uint32_t n;
+
+	if (size < HASH_SIZE + sizeof(n)) {
+		return false;
+	}
+
+	memcpy(id.h, buf, HASH_SIZE);
+	memcpy(&n, buf + HASH_SIZE, sizeof(n));
+
+	if (size != HASH_SIZE + sizeof(n) + static_cast<uint64_t>(n) * HASH_SIZE) {
+		LOGWARN(4, "peer " << static_cast<char*>(m_addrString) << " sent an invalid COMPACT_BLOCK_TX_RESPONSE");
+		return false;
+	}
+
+	// Response for a compact block which was replaced by a newer one
+	if (m_compactBlockMissingTxs.empty() || (id != m_compactBlockId)) {
+		return true;
+	}
+
+	if (n == 0) {
+		LOGINFO(5, "peer " << static_cast<char*>(m_addrString) << " doesn't have compact block " << id << " anymore, requesting the full block");
+
+		m_compactBlockMissingTxs.clear();
+		m_compactBlockBlob.clear();
+
+		return send_compact_fallback_request(id);
+	}
+
+	if (n != m_compactBlockMissingTxs.size()) {
+		LOGWARN(4, "peer " << static_cast<char*>(m_addrString) << " sent " << n << " transactions, " << m_compactBlockMissingTxs.size() << " were requested");
+		return false;
+	}
+
+	const uint8_t* p = buf + HASH_SIZE + sizeof(n);
+	for (uint32_t index : m_compactBlockMissingTxs) {
+		memcpy(m_compactBlockBlob.data() + m_compactBlockTxOffset + static_cast<size_t>(index) * HASH_SIZE, p, HASH_SIZE);
+		p += HASH_SIZE;
+	}
+
+	m_compactBlockMissingTxs.clear();
+
+	return finish_compact_block();
+}
+
+bool P2PServer::P2PClient::finish_compact_block()
+{
+	// Rebuilt blob is the same as a pruned BLOCK_BROADCAST, so it goes through the same checks
+	std::vector<uint8_t> blob;
+	blob.swap(m_compactBlockBlob);
+
+	if (blob.size() > std::numeric_limits<uint32_t>::max()) {
+		return false;
+	}
+
+	return on_block_broadcast(blob.data(), static_cast<uint32_t>(blob.size()), true);
+}
+
+bool P2PServer::P2PClient::on_peer_list_request(const uint8_t*)
+{
+	P2PServer* server = static_cast<P2PServer*>(m_owner);
+
+	Peer peers[PEER_LIST_RESPONSE_MAX_PEERS];
+	uint32_t num_selected_peers = 0;
+	{
+		MutexLock lock(server->m_clientsListLock);
+
+		// Send every 4th peer on average, selected at random
+		const uint32_t n = server->m_numConnections;
+		const uint32_t peers_to_send_target = std::min<uint32_t>(PEER_LIST_RESPONSE_MAX_PEERS, std::max<uint32_t>(1, n / 4));
+
+		for (P2PClient* client = static_cast<P2PClient*>(server->m_connectedClientsList->m_next); client != server->m_connectedClientsList; client = static_cast<P2PClient*>(client->m_next)) {
+			if (client->m_listenPort < 0) {
+				continue;
+			}
+
+			uint64_t hi;
+			umul128(server->get_random64(), n, &hi);
+
+			if ((hi < peers_to_send_target) && (client->m_addr != m_addr)) {
+				peers[num_selected_peers++] = { client->m_isV6, client->m_addr, client->m_listenPort, 0 };
+
+				if (num_selected_peers >= PEER_LIST_RESPONSE_MAX_PEERS) {
+					break;
+				}
+			}
+		}
+	}
+
+	return server->send(this,
+		[&peers, num_selected_peers](void* buf)
+		{
+			uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
 			uint8_t* p = p0;
 
 			LOGINFO(5, "sending PEER_LIST_RESPONSE");
@@ -1245,45 +2168,90 @@ bool P2PServer::P2PClient::on_peer_list_response(const uint8_t* buf) const
 	return true;
 }
 
-bool P2PServer::P2PClient::handle_incoming_block_async()
+bool P2PServer::P2PClient::handle_incoming_block_async(const PoolBlockView& view, bool want_broadcast, bool compact)
 {
 	P2PServer* server = static_cast<P2PServer*>(m_owner);
 
-	if (server->m_pool->side_chain().block_seen(*server->m_block)) {
-		LOGINFO(5, "block " << server->m_block->m_sidechainId << " was received before, skipping it");
+	if (server->m_pool->side_chain().block_seen(view.m_sidechainId)) {
+		LOGINFO(5, "block " << view.m_sidechainId << " was received before, skipping it");
 		return true;
 	}
 
+	// Blocks are marked as seen only after the keccak hash check in the worker thread, so copies arriving before that are caught here
+	// A different blob with the same id is still queued: the id is not checked yet, and the queued one can turn out to be junk
+	auto in_flight = server->m_blocksInFlight.find(view.m_sidechainId);
+	if (in_flight != server->m_blocksInFlight.end()) {
+		const std::vector<uint8_t>& blob = in_flight->second->m_blob;
+		if ((blob.size() == view.m_size) && (memcmp(blob.data(), view.m_data, view.m_size) == 0)) {
+			LOGINFO(5, "block " << view.m_sidechainId << " is already queued, skipping it");
+			return true;
+		}
+	}
+
+	// Receive buffer is reused for the next message, so the block's data is copied here
+	// The rest (keccak hash check, outputs calculation) is done in the worker thread
+	IncomingBlock* incoming_block = server->get_incoming_block();
+	if (in_flight == server->m_blocksInFlight.end()) {
+		incoming_block->m_inFlightId = view.m_sidechainId;
+		server->m_blocksInFlight.emplace(view.m_sidechainId, incoming_block);
+	}
+	incoming_block->m_blob.assign(view.m_data, view.m_data + view.m_size);
+	incoming_block->m_blocks.emplace_back(0, static_cast<uint32_t>(view.m_size));
+
+	if (compact) {
+		incoming_block->m_compactId = m_compactBlockId;
+	}
+
+	// Broadcasts and blocks on top of our chain tip are checked before sync backlog
+	const bool tip_block = want_broadcast || server->m_pool->side_chain().is_chain_tip(view.m_parent);
+
+	return queue_incoming_blocks(incoming_block, want_broadcast, tip_block ? HashingExecutor::Priority::TIP_BLOCK : HashingExecutor::Priority::SYNC_BLOCK);
+}
+
+bool P2PServer::P2PClient::queue_incoming_blocks(IncomingBlock* incoming_block, bool want_broadcast, HashingExecutor::Priority priority)
+{
+	P2PServer* server = static_cast<P2PServer*>(m_owner);
+
 	struct Work
 	{
 		uv_work_t req;
-		PoolBlock block;
+		IncomingBlock* incoming_block;
+		bool want_broadcast;
 		P2PClient* client;
 		P2PServer* server;
 		uint32_t client_reset_counter;
-		std::vector<hash> missing_blocks;
 	};
 
-	Work* work = new Work{ {}, *server->m_block, this, server, m_resetCounter.load(), {} };
+	Work* work = new Work{ {}, incoming_block, want_broadcast, this, server, m_resetCounter.load() };
 	work->req.data = work;
 
-	const int err = uv_queue_work(&server->m_loop, &work->req,
+	const int err = server->m_pool->hashing_executor()->queue_work(&server->m_hashingCompletions, &work->req, priority,
 		[](uv_work_t* req)
 		{
-			num_running_jobs.fetch_add(1);
 			Work* work = reinterpret_cast<Work*>(req->data);
-			work->client->handle_incoming_block(work->server->m_pool, work->block, work->client_reset_counter, work->missing_blocks);
+			work->client->handle_incoming_block(work->server->m_pool, *work->incoming_block, work->want_broadcast, work->client_reset_counter);
 		},
-		[](uv_work_t* req, int /*status*/)
+		[](uv_work_t* req, int status)
 		{
 			Work* work = reinterpret_cast<Work*>(req->data);
-			work->client->post_handle_incoming_block(work->client_reset_counter, work->missing_blocks);
+			if (status != UV_ECANCELED) {
+				work->client->post_handle_incoming_block(work->client_reset_counter, *work->incoming_block);
+			}
+			work->server->release_incoming_block(work->incoming_block);
 			delete work;
-			num_running_jobs.fetch_sub(1);
 		});
 
+	if (err == UV_EBUSY) {
+		// Too many blocks are waiting for PoW checks, drop this one. It's not marked as seen yet, so it can be downloaded again later
+		LOGWARN(4, "queue_incoming_blocks: hashing queue is full, dropping " << incoming_block->m_blocks.size() << " blocks from peer " << static_cast<char*>(m_addrString));
+		server->release_incoming_block(incoming_block);
+		delete work;
+		return true;
+	}
+
 	if (err != 0) {
-		LOGERR(1, "handle_incoming_block_async: uv_queue_work failed, error " << uv_err_name(err));
+		LOGERR(1, "queue_incoming_blocks: queue_work failed, error " << uv_err_name(err));
+		server->release_incoming_block(incoming_block);
 		delete work;
 		return false;
 	}
@@ -1291,19 +2259,90 @@ bool P2PServer::P2PClient::handle_incoming_block_async()
 	return true;
 }
 
-void P2PServer::P2PClient::handle_incoming_block(p2pool* pool, PoolBlock& block, const uint32_t reset_counter, std::vector<hash>& missing_blocks)
+void P2PServer::P2PClient::handle_incoming_block(p2pool* pool, IncomingBlock& incoming_block, bool want_broadcast, const uint32_t reset_counter)
 {
-	if (!pool->side_chain().add_external_block(block, missing_blocks)) {
+	SideChain& side_chain = pool->side_chain();
+	PoolBlock& block = incoming_block.m_block;
+	std::vector<hash>& missing_blocks = incoming_block.m_missingBlocks;
+
+	bool result = true;
+
+	hash oldest_parent;
+	uint64_t oldest_height = 0;
+
+	std::vector<hash> tmp_missing_blocks;
+
+	for (const auto& b : incoming_block.m_blocks) {
+		const int err = block.deserialize(incoming_block.m_blob.data() + b.first, b.second, side_chain);
+		if (err != 0) {
+			// Our own mempool can have the wrong transaction for a short id, this is not the peer's fault
+			if (!incoming_block.m_compactId.empty()) {
+				LOGINFO(4, "compact block " << incoming_block.m_compactId << " was rebuilt incorrectly, requesting the full block");
+				incoming_block.m_compactRebuildFailed = true;
+				return;
+			}
+			LOGWARN(3, "peer " << static_cast<char*>(m_addrString) << " sent an invalid block, error " << err);
+			result = false;
+			break;
+		}
+
+		if (oldest_height == 0) {
+			oldest_parent = block.m_parent;
+			oldest_height = block.m_sidechainHeight;
+		}
+
+		if (side_chain.block_seen(block)) {
+			LOGINFO(5, "block " << block.m_sidechainId << " was received before, skipping it");
+			continue;
+		}
+
+		block.m_wantBroadcast = want_broadcast;
+
+		// Ignored blocks don't fill in missing blocks, so the previous block's list must not be added again
+		tmp_missing_blocks.clear();
+
+		if (!side_chain.add_external_block(std::move(block), tmp_missing_blocks)) {
+			result = false;
+			break;
+		}
+
+		missing_blocks.insert(missing_blocks.end(), tmp_missing_blocks.begin(), tmp_missing_blocks.end());
+	}
+
+	if (!result) {
 		// Client sent bad data, disconnect and ban it
 		if (reset_counter == m_resetCounter.load()) {
 			ban(DEFAULT_BAN_TIME);
 			static_cast<P2PServer*>(m_owner)->remove_peer_from_list(this);
 			close();
 		}
+		return;
+	}
+
+	// Blocks added later in the range could be missing for the blocks added before them,
+	// and the pipelined request will download the oldest block's parent
+	std::sort(missing_blocks.begin(), missing_blocks.end());
+	missing_blocks.erase(std::unique(missing_blocks.begin(), missing_blocks.end()), missing_blocks.end());
+
+	missing_blocks.erase(std::remove_if(missing_blocks.begin(), missing_blocks.end(),
+		[&side_chain, &incoming_block](const hash& id)
+		{
+			return (id == incoming_block.m_pipelinedId) || side_chain.has_block(id);
+		}), missing_blocks.end());
+
+	// If the oldest block's parent is missing, there can be more missing blocks between it and our chain tip
+	auto it = std::find(missing_blocks.begin(), missing_blocks.end(), oldest_parent);
+	if (it != missing_blocks.end()) {
+		const uint32_t n = block_range_size(oldest_height, side_chain.chain_tip_height());
+		if (n > 1) {
+			incoming_block.m_rangeStart = oldest_parent;
+			incoming_block.m_rangeSize = n;
+			missing_blocks.erase(it);
+		}
 	}
 }
 
-void P2PServer::P2PClient::post_handle_incoming_block(const uint32_t reset_counter, std::vector<hash>& missing_blocks)
+void P2PServer::P2PClient::post_handle_incoming_block(const uint32_t reset_counter, IncomingBlock& incoming_block)
 {
 	// We might have been disconnected while side_chain was adding the block
 	// In this case we can't send BLOCK_REQUEST messages on this connection anymore
@@ -1311,23 +2350,26 @@ void P2PServer::P2PClient::post_handle_incoming_block(const uint32_t reset_count
 		return;
 	}
 
-	for (const hash& id : missing_blocks) {
-		const bool result = m_owner->send(this,
-			[this, &id](void* buf)
-			{
-				uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
-				uint8_t* p = p0;
+	if (incoming_block.m_compactRebuildFailed) {
+		send_compact_fallback_request(incoming_block.m_compactId);
+		return;
+	}
 
-				LOGINFO(5, "sending BLOCK_REQUEST for id = " << id);
-				*(p++) = static_cast<uint8_t>(MessageId::BLOCK_REQUEST);
+	std::vector<hash>& missing_blocks = incoming_block.m_missingBlocks;
 
-				memcpy(p, id.h, HASH_SIZE);
-				p += HASH_SIZE;
-
-				return p - p0;
-			});
+	if (incoming_block.m_rangeSize > 0) {
+		if (m_peerFeatures & FEATURE_BLOCK_RANGE) {
+			if (!send_block_range_request(incoming_block.m_rangeStart, incoming_block.m_rangeSize)) {
+				return;
+			}
+		}
+		else {
+			missing_blocks.push_back(incoming_block.m_rangeStart);
+		}
+	}
 
-		if (!result) {
+	for (const hash& id : missing_blocks) {
+		if (!send_block_request(id)) {
 			return;
 		}
 	}
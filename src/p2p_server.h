@@ -18,12 +18,16 @@
 #pragma once
 
 #include "tcp_server.h"
+#include "hashing_executor.h"
 #include <random>
+#include <deque>
+#include <unordered_map>
 
 namespace p2pool {
 
 class p2pool;
 struct PoolBlock;
+struct PoolBlockView;
 
 static constexpr size_t P2P_BUF_SIZE = 128 * 1024;
 static constexpr size_t PEER_LIST_RESPONSE_MAX_PEERS = 16;
@@ -40,14 +44,60 @@ public:
 		BLOCK_BROADCAST = 5,
 		PEER_LIST_REQUEST = 6,
 		PEER_LIST_RESPONSE = 7,
+
+		// Messages below are only sent to peers which reported support for them in FEATURES message
+		// FEATURES is sent in response to BLOCK_REQUEST for features_request_id, older versions just send an empty BLOCK_RESPONSE
+		FEATURES = 8,
+		BLOCK_RANGE_REQUEST = 9,
+		BLOCK_RANGE_RESPONSE = 10,
+		COMPACT_BLOCK_BROADCAST = 11,
+		COMPACT_BLOCK_TX_REQUEST = 12,
+		COMPACT_BLOCK_TX_RESPONSE = 13,
+	};
+
+	enum Features : uint32_t {
+		FEATURE_BLOCK_RANGE = 1,
+		FEATURE_COMPACT_BLOCKS = 2,
 	};
 
+	// Maximum number of blocks (without uncles) in one BLOCK_RANGE_REQUEST
+	static constexpr uint32_t MAX_BLOCK_RANGE = 512;
+
 	explicit P2PServer(p2pool *pool);
 	~P2PServer();
 
 	void connect_to_peers(const std::string& peer_list);
 	void on_connect_failed(bool is_v6, const raw_ip& ip, int port) override;
 
+	struct IncomingBlock;
+
+	// Fixed-size set of the most recent block ids a peer knows about (received from it or sent to it)
+	// Ring buffer of ids in insertion order and an open addressing hash table pointing into it, the oldest id is removed when it's full
+	// Only accessed from the event loop thread
+	class KnownBlocks
+	{
+	public:
+		KnownBlocks();
+
+		void clear();
+		void insert(const hash& id);
+		bool contains(const hash& id) const;
+
+	private:
+		enum { CAPACITY = 512, TABLE_SIZE = CAPACITY * 2 };
+
+		static size_t home_slot(const hash& id);
+		size_t find_slot(const hash& id) const;
+		void erase_slot(size_t slot);
+
+		hash m_ring[CAPACITY];
+		uint32_t m_ringPos;
+		uint32_t m_size;
+
+		// Index in m_ring + 1, 0 means empty slot
+		uint16_t m_table[TABLE_SIZE];
+	};
+
 	struct P2PClient : public Client
 	{
 		P2PClient();
@@ -85,13 +135,25 @@ public:
 		bool on_listen_port(const uint8_t* buf);
 		bool on_block_request(const uint8_t* buf);
 		bool on_block_response(const uint8_t* buf, uint32_t size);
-		bool on_block_broadcast(const uint8_t* buf, uint32_t size);
+		bool on_block_broadcast(const uint8_t* buf, uint32_t size, bool compact);
 		bool on_peer_list_request(const uint8_t* buf);
 		bool on_peer_list_response(const uint8_t* buf) const;
-
-		bool handle_incoming_block_async();
-		void handle_incoming_block(p2pool* pool, PoolBlock& block, const uint32_t reset_counter, std::vector<hash>& missing_blocks);
-		void post_handle_incoming_block(const uint32_t reset_counter, std::vector<hash>& missing_blocks);
+		bool on_features(const uint8_t* buf);
+		bool on_block_range_request(const uint8_t* buf);
+		bool on_block_range_response(const uint8_t* buf, uint32_t size);
+		bool on_compact_block_broadcast(const uint8_t* buf, uint32_t size);
+		bool on_compact_block_tx_request(const uint8_t* buf, uint32_t size);
+		bool on_compact_block_tx_response(const uint8_t* buf, uint32_t size);
+		bool finish_compact_block();
+
+		bool send_block_request(const hash& id);
+		bool send_compact_fallback_request(const hash& id);
+		bool send_block_range_request(const hash& id, uint32_t count);
+
+		bool handle_incoming_block_async(const PoolBlockView& view, bool want_broadcast, bool compact);
+		bool queue_incoming_blocks(IncomingBlock* incoming_block, bool want_broadcast, HashingExecutor::Priority priority);
+		void handle_incoming_block(p2pool* pool, IncomingBlock& incoming_block, bool want_broadcast, const uint32_t reset_counter);
+		void post_handle_incoming_block(const uint32_t reset_counter, IncomingBlock& incoming_block);
 
 		uint64_t m_peerId;
 		MessageId m_expectedMessage;
@@ -101,8 +163,30 @@ public:
 		int m_listenPort;
 		time_t m_lastPeerListRequest;
 
-		uv_rwlock_t m_broadcastedHashesLock;
-		std::set<hash> m_broadcastedHashes;
+		uint32_t m_peerFeatures;
+
+		// Blocks from BLOCK_RANGE_RESPONSE messages are collected here until the last message of the range arrives
+		// Responses come in the same order as requests, m_blockRangeRequests has the block count of every request which is not answered yet
+		// A response can't have more blocks and bytes than the requested blocks and their uncles can take
+		IncomingBlock* m_blockRange;
+		std::deque<uint32_t> m_blockRangeRequests;
+		uint32_t m_blockRangeBlocks;
+		uint64_t m_blockRangeBytes;
+		time_t m_blockRangeRequestsTime;
+		uint32_t m_blockRangeRequestsReceived;
+
+		// Compact block waiting for COMPACT_BLOCK_TX_RESPONSE: pruned blob with missing transaction hashes zeroed
+		hash m_compactBlockId;
+		std::vector<uint8_t> m_compactBlockBlob;
+		size_t m_compactBlockTxOffset;
+		std::vector<uint32_t> m_compactBlockMissingTxs;
+
+		// Compact blocks which couldn't be rebuilt and were requested with BLOCK_REQUEST
+		// Their BLOCK_RESPONSE is handled as a broadcast, so these blocks are still relayed to other peers
+		enum { MAX_COMPACT_FALLBACKS = 16 };
+		std::deque<hash> m_compactFallbackIds;
+
+		KnownBlocks m_knownBlocks;
 	};
 
 	void broadcast(const PoolBlock& block);
@@ -131,8 +215,13 @@ private:
 	std::random_device m_rd;
 	std::mt19937_64 m_rng;
 
-	uv_mutex_t m_blockLock;
-	PoolBlock* m_block;
+	// Incoming blocks are deserialized in the worker threads, several at a time
+	// Their parse buffers are reused because PoolBlock reserves big buffers when it's created
+	IncomingBlock* get_incoming_block();
+	void release_incoming_block(IncomingBlock* incoming_block);
+
+	uv_mutex_t m_incomingBlocksLock;
+	std::vector<IncomingBlock*> m_incomingBlocks;
 
 	uv_timer_t m_timer;
 
@@ -153,17 +242,38 @@ private:
 
 	struct Broadcast
 	{
+		hash id;
 		std::vector<uint8_t> blob;
 		std::vector<uint8_t> pruned_blob;
+		std::vector<uint8_t> compact_blob;
 		std::vector<hash> ancestor_hashes;
+		std::vector<hash> transactions;
 	};
 
 	uv_mutex_t m_broadcastLock;
 	uv_async_t m_broadcastAsync;
 	std::vector<Broadcast*> m_broadcastQueue;
 
+	// Incoming blocks are checked on the hashing executor and the results come back to this server's event loop
+	HashingExecutor::CompletionQueue m_hashingCompletions;
+
 	static void on_broadcast(uv_async_t* handle) { reinterpret_cast<P2PServer*>(handle->data)->on_broadcast(); }
 	void on_broadcast();
+
+	// Transactions of the last compact blocks we broadcasted, for COMPACT_BLOCK_TX_REQUEST
+	// Only accessed from the event loop thread
+	struct CompactBlockTxs
+	{
+		hash id;
+		std::vector<hash> transactions;
+	};
+
+	std::vector<CompactBlockTxs> m_compactBlockTxs;
+
+	// Single blocks which are queued for the PoW check, so duplicate broadcasts arriving in a burst are dropped before copying
+	// Ids are not checked until the worker thread hashes the block, so only byte-identical copies are dropped
+	// Only accessed from the event loop thread
+	std::unordered_map<hash, const IncomingBlock*> m_blocksInFlight;
 };
 
 } // namespace p2pool
@@ -23,6 +23,7 @@
 #include "rapidjson/document.h"
 #include "json_parsers.h"
 #include "pow_hash.h"
+#include "hashing_executor.h"
 #include "block_template.h"
 #include "side_chain.h"
 #include "stratum_server.h"
@@ -64,6 +65,7 @@ p2pool::p2pool(int argc, char* argv[])
 
 	m_sideChain = new SideChain(this);
 	m_hasher = new RandomX_Hasher(this);
+	m_hashingExecutor = new HashingExecutor(std::thread::hardware_concurrency());
 	m_blockTemplate = new BlockTemplate(this);
 	m_mempool = new Mempool();
 	m_consoleCommands = new ConsoleCommands(this);
@@ -74,6 +76,7 @@ p2pool::~p2pool()
 	uv_rwlock_destroy(&m_mainchainLock);
 
 	delete m_sideChain;
+	delete m_hashingExecutor;
 	delete m_hasher;
 	delete m_blockTemplate;
 	delete m_mempool;
@@ -379,6 +382,7 @@ void p2pool::download_block_headers(uint64_t current_height)
 				if (m_serversStarted.exchange(1) == 0) {
 					m_stratumServer = new StratumServer(this);
 					m_p2pServer = new P2PServer(this);
+					load_cached_blocks_when_ready();
 				}
 			}
 			else {
@@ -388,6 +392,18 @@ void p2pool::download_block_headers(uint64_t current_height)
 		});
 }
 
+void p2pool::on_hasher_ready()
+{
+	load_cached_blocks_when_ready();
+}
+
+void p2pool::load_cached_blocks_when_ready()
+{
+	if ((m_cachedBlocksWait.fetch_sub(1) == 1) && !m_stopped) {
+		m_sideChain->load_cached_blocks_async();
+	}
+}
+
 bool p2pool::chainmain_get_by_hash(const hash& id, ChainMain& data) const
 {
 	ReadLock lock(m_mainchainLock);
@@ -693,6 +709,9 @@ int p2pool::run()
 		}
 	}
 
+	// Waits for running hashing jobs, jobs that didn't start are handed back to servers as cancelled and freed there
+	m_hashingExecutor->stop();
+
 	delete m_stratumServer;
 	delete m_p2pServer;
 
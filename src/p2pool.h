@@ -25,6 +25,7 @@ namespace p2pool {
 
 struct Params;
 class RandomX_Hasher;
+class HashingExecutor;
 class BlockTemplate;
 class Mempool;
 class SideChain;
@@ -46,9 +47,11 @@ public:
 	BlockTemplate& block_template() { return *m_blockTemplate; }
 	SideChain& side_chain() { return *m_sideChain; }
 	const MinerData& miner_data() const { return m_minerData; }
+	const Mempool& mempool() const { return *m_mempool; }
 
 	RandomX_Hasher* hasher() const { return m_hasher; }
 	bool calculate_hash(const void* data, size_t size, const hash& seed, hash& result);
+	HashingExecutor* hashing_executor() const { return m_hashingExecutor; }
 	static uint64_t get_seed_height(uint64_t height);
 	bool get_seed(uint64_t height, hash& seed) const;
 
@@ -64,6 +67,7 @@ public:
 	void update_block_template_async();
 
 	void download_block_headers(uint64_t current_height);
+	void on_hasher_ready();
 
 	bool chainmain_get_by_hash(const hash& id, ChainMain& data) const;
 
@@ -77,6 +81,7 @@ private:
 
 	SideChain* m_sideChain;
 	RandomX_Hasher* m_hasher;
+	HashingExecutor* m_hashingExecutor;
 	BlockTemplate* m_blockTemplate;
 	MinerData m_minerData;
 	Mempool* m_mempool;
@@ -98,6 +103,10 @@ private:
 	uint32_t parse_block_headers_range(const char* data, size_t size);
 
 	std::atomic<uint32_t> m_serversStarted{ 0 };
+
+	// Cached blocks are loaded when both servers are started and the hasher has caches for the current and the previous seed
+	std::atomic<uint32_t> m_cachedBlocksWait{ 2 };
+	void load_cached_blocks_when_ready();
 	StratumServer* m_stratumServer = nullptr;
 	P2PServer* m_p2pServer = nullptr;
 
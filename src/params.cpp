@@ -47,6 +47,14 @@ Params::Params(int argc, char* argv[])
 			m_stratumAddresses = argv[++i];
 		}
 
+		if ((strcmp(argv[i], "--stratum-threads") == 0) && (i + 1 < argc)) {
+			m_stratumThreads = static_cast<uint32_t>(std::min(std::max(atoi(argv[++i]), 1), 64));
+		}
+
+		if ((strcmp(argv[i], "--stratum-shares-per-minute") == 0) && (i + 1 < argc)) {
+			m_stratumSharesPerMinute = static_cast<uint32_t>(std::min(std::max(atoi(argv[++i]), 0), 600));
+		}
+
 		if ((strcmp(argv[i], "--p2p") == 0) && (i + 1 < argc)) {
 			m_p2pAddresses = argv[++i];
 		}
@@ -63,6 +71,10 @@ Params::Params(int argc, char* argv[])
 		if ((strcmp(argv[i], "--config") == 0) && (i + 1 < argc)) {
 			m_config = argv[++i];
 		}
+
+		if (strcmp(argv[i], "--no-cache") == 0) {
+			m_blockCache = false;
+		}
 	}
 }
 
@@ -33,9 +33,12 @@ struct Params
 	bool m_lightMode = false;
 	Wallet m_wallet{ nullptr };
 	std::string m_stratumAddresses{ "[::]:3333,0.0.0.0:3333" };
+	uint32_t m_stratumThreads = 1;
+	uint32_t m_stratumSharesPerMinute = 0;
 	std::string m_p2pAddresses{ "[::]:37890,0.0.0.0:37890" };
 	std::string m_p2pPeerList;
 	std::string m_config;
+	bool m_blockCache = true;
 };
 
 } // namespace p2pool
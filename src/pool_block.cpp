@@ -27,6 +27,45 @@ static constexpr char log_category_prefix[] = "PoolBlock ";
 
 namespace p2pool {
 
+PoolBlockView::PoolBlockView()
+	: m_data(nullptr)
+	, m_size(0)
+	, m_majorVersion(0)
+	, m_minorVersion(0)
+	, m_timestamp(0)
+	, m_prevId{}
+	, m_nonce(0)
+	, m_mainChainHeaderSize(0)
+	, m_mainChainMinerTxSize(0)
+	, m_txinGenHeight(0)
+	, m_outputs(nullptr)
+	, m_numOutputs(0)
+	, m_totalReward(0)
+	, m_outputsOffset(0)
+	, m_outputsBlobSize(0)
+	, m_outputsActualBlobSize(0)
+	, m_txkeyPub{}
+	, m_extraNonceSize(0)
+	, m_extraNonce(0)
+	, m_nonceOffset(0)
+	, m_extraNonceOffset(0)
+	, m_sidechainHashOffset(0)
+	, m_transactions(nullptr)
+	, m_numTransactions(0)
+	, m_sideChainData(nullptr)
+	, m_spendPublicKey{}
+	, m_viewPublicKey{}
+	, m_txkeySec{}
+	, m_parent{}
+	, m_uncles(nullptr)
+	, m_numUncles(0)
+	, m_sidechainHeight(0)
+	, m_difficulty{}
+	, m_cumulativeDifficulty{}
+	, m_sidechainId{}
+{
+}
+
 PoolBlock::PoolBlock()
 	: m_mainChainHeaderSize(0)
 	, m_mainChainMinerTxSize(0)
@@ -121,6 +160,66 @@ PoolBlock& PoolBlock::operator=(const PoolBlock& b)
 	return *this;
 }
 
+PoolBlock::PoolBlock(PoolBlock&& b)
+{
+	uv_mutex_init_checked(&m_lock);
+	operator=(std::move(b));
+}
+
+PoolBlock& PoolBlock::operator=(PoolBlock&& b)
+{
+	if (this == &b) {
+		return *this;
+	}
+
+	const int lock_result = uv_mutex_trylock(&b.m_lock);
+	if (lock_result) {
+		LOGERR(1, "operator= uv_mutex_trylock failed. Fix the code!");
+	}
+
+	m_mainChainData = std::move(b.m_mainChainData);
+	m_mainChainHeaderSize = b.m_mainChainHeaderSize;
+	m_mainChainMinerTxSize = b.m_mainChainMinerTxSize;
+	m_mainChainOutputsOffset = b.m_mainChainOutputsOffset;
+	m_mainChainOutputsBlobSize = b.m_mainChainOutputsBlobSize;
+	m_majorVersion = b.m_majorVersion;
+	m_minorVersion = b.m_minorVersion;
+	m_timestamp = b.m_timestamp;
+	m_prevId = b.m_prevId;
+	m_nonce = b.m_nonce;
+	m_txinGenHeight = b.m_txinGenHeight;
+	m_outputs = std::move(b.m_outputs);
+	m_txkeyPub = b.m_txkeyPub;
+	m_extraNonceSize = b.m_extraNonceSize;
+	m_extraNonce = b.m_extraNonce;
+	m_transactions = std::move(b.m_transactions);
+	m_sideChainData = std::move(b.m_sideChainData);
+	m_minerWallet = b.m_minerWallet;
+	m_txkeySec = b.m_txkeySec;
+	m_parent = b.m_parent;
+	m_uncles = std::move(b.m_uncles);
+	m_sidechainHeight = b.m_sidechainHeight;
+	m_difficulty = b.m_difficulty;
+	m_cumulativeDifficulty = b.m_cumulativeDifficulty;
+	m_sidechainId = b.m_sidechainId;
+
+	// Temporary buffers are not a part of the block, no need to keep them
+	m_tmpTxExtra.clear();
+	m_tmpInts.clear();
+
+	m_depth = b.m_depth;
+	m_verified = b.m_verified;
+	m_invalid = b.m_invalid;
+	m_broadcasted = b.m_broadcasted;
+	m_wantBroadcast = b.m_wantBroadcast;
+
+	if (lock_result == 0) {
+		uv_mutex_unlock(&b.m_lock);
+	}
+
+	return *this;
+}
+
 PoolBlock::~PoolBlock()
 {
 	uv_mutex_destroy(&m_lock);
@@ -265,24 +364,23 @@ bool PoolBlock::get_pow_hash(RandomX_Hasher* hasher, const hash& seed_hash, hash
 			keccak(h, HASH_SIZE * 2, blob + blob_size, HASH_SIZE);
 		}
 		else {
-			size_t i, j, cnt;
+			size_t cnt;
 
-			for (i = 0, cnt = 1; cnt <= count; ++i, cnt <<= 1) {}
+			for (cnt = 1; cnt <= count; cnt <<= 1) {}
 
 			cnt >>= 1;
 
 			m_tmpInts.resize(cnt * HASH_SIZE);
-			memcpy(m_tmpInts.data(), h, (cnt * 2 - count) * HASH_SIZE);
 
-			for (i = cnt * 2 - count, j = cnt * 2 - count; j < cnt; i += 2, ++j) {
-				keccak(h + i * HASH_SIZE, HASH_SIZE * 2, m_tmpInts.data() + j * HASH_SIZE, HASH_SIZE);
-			}
+			const size_t k = cnt * 2 - count;
+			memcpy(m_tmpInts.data(), h, k * HASH_SIZE);
+
+			// Hashes on each tree level are independent, so they're calculated in parallel
+			keccak_multi(h + k * HASH_SIZE, HASH_SIZE * 2, m_tmpInts.data() + k * HASH_SIZE, static_cast<uint32_t>(cnt - k));
 
 			while (cnt > 2) {
 				cnt >>= 1;
-				for (i = 0, j = 0; j < cnt; i += 2, ++j) {
-					keccak(m_tmpInts.data() + i * HASH_SIZE, HASH_SIZE * 2, m_tmpInts.data() + j * HASH_SIZE, HASH_SIZE);
-				}
+				keccak_multi(m_tmpInts.data(), HASH_SIZE * 2, m_tmpInts.data(), static_cast<uint32_t>(cnt));
 			}
 
 			keccak(m_tmpInts.data(), HASH_SIZE * 2, blob + blob_size, HASH_SIZE);
@@ -295,4 +393,86 @@ bool PoolBlock::get_pow_hash(RandomX_Hasher* hasher, const hash& seed_hash, hash
 	return hasher->calculate(blob, blob_size, seed_hash, pow_hash);
 }
 
+PoolBlockArena::PoolBlockArena()
+{
+	uv_mutex_init_checked(&m_lock);
+}
+
+PoolBlockArena::~PoolBlockArena()
+{
+	for (auto& it : m_slabs) {
+		for (Slab* slab : it.second) {
+			for (uint32_t i = 0; i < SLAB_SIZE; ++i) {
+				if (slab->m_usedMask & (1ULL << i)) {
+					reinterpret_cast<PoolBlock*>(&slab->m_slots[i])->~PoolBlock();
+				}
+			}
+			delete slab;
+		}
+	}
+
+	uv_mutex_destroy(&m_lock);
+}
+
+void* PoolBlockArena::allocate(uint64_t sidechain_height)
+{
+	MutexLock lock(m_lock);
+
+	std::vector<Slab*>& slabs = m_slabs[sidechain_height / BUCKET_HEIGHTS];
+
+	for (Slab* slab : slabs) {
+		const uint64_t free_mask = ~slab->m_usedMask & ((SLAB_SIZE < 64) ? ((1ULL << SLAB_SIZE) - 1) : ~0ULL);
+		if (free_mask) {
+			uint32_t i = 0;
+			while (!(free_mask & (1ULL << i))) {
+				++i;
+			}
+			slab->m_usedMask |= (1ULL << i);
+			return &slab->m_slots[i];
+		}
+	}
+
+	Slab* slab = new Slab();
+	slab->m_usedMask = 1;
+	slabs.push_back(slab);
+
+	return &slab->m_slots[0];
+}
+
+void PoolBlockArena::destroy(PoolBlock* block)
+{
+	if (!block) {
+		return;
+	}
+
+	const uint64_t bucket = block->m_sidechainHeight / BUCKET_HEIGHTS;
+	block->~PoolBlock();
+
+	MutexLock lock(m_lock);
+
+	auto it = m_slabs.find(bucket);
+	if (it != m_slabs.end()) {
+		std::vector<Slab*>& slabs = it->second;
+		for (size_t k = 0; k < slabs.size(); ++k) {
+			Slab* slab = slabs[k];
+			const size_t i = static_cast<size_t>(reinterpret_cast<uint8_t*>(block) - reinterpret_cast<uint8_t*>(slab->m_slots)) / sizeof(slab->m_slots[0]);
+			if ((reinterpret_cast<uint8_t*>(block) >= reinterpret_cast<uint8_t*>(slab->m_slots)) && (i < SLAB_SIZE)) {
+				slab->m_usedMask &= ~(1ULL << i);
+
+				// Release the whole slab once all blocks in it are gone
+				if (slab->m_usedMask == 0) {
+					delete slab;
+					slabs.erase(slabs.begin() + k);
+					if (slabs.empty()) {
+						m_slabs.erase(it);
+					}
+				}
+				return;
+			}
+		}
+	}
+
+	LOGERR(1, "destroy: block at height " << bucket * BUCKET_HEIGHTS << "+ doesn't belong to the arena. Fix the code!");
+}
+
 } // namespace p2pool
@@ -19,6 +19,7 @@
 
 #include "uv_util.h"
 #include "wallet.h"
+#include <map>
 
 #ifdef _DEBUG
 #define POOL_BLOCK_DEBUG 1
@@ -53,6 +54,69 @@ struct DifficultyData
 	difficulty_type m_cumulativeDifficulty;
 };
 
+// Pool block parsed in place, it points into the buffer it was parsed from and owns nothing
+// It's used to reject duplicate and stale blocks before copying them into a PoolBlock
+struct PoolBlockView
+{
+	PoolBlockView();
+
+	int parse(const uint8_t* data, size_t size);
+
+	const uint8_t* m_data;
+	size_t m_size;
+
+	// Monero block template
+	uint8_t m_majorVersion;
+	uint8_t m_minorVersion;
+	uint64_t m_timestamp;
+	hash m_prevId;
+	uint32_t m_nonce;
+	size_t m_mainChainHeaderSize;
+	size_t m_mainChainMinerTxSize;
+
+	// Miner transaction
+	uint64_t m_txinGenHeight;
+
+	// Outputs are either in the buffer (m_numOutputs > 0) or must be calculated from sidechain data
+	const uint8_t* m_outputs;
+	uint64_t m_numOutputs;
+	uint64_t m_totalReward;
+	int m_outputsOffset;
+	int m_outputsBlobSize;
+	int m_outputsActualBlobSize;
+
+	hash m_txkeyPub;
+	uint64_t m_extraNonceSize;
+	uint32_t m_extraNonce;
+
+	// Offsets in the full Monero block template, with outputs included
+	int m_nonceOffset;
+	int m_extraNonceOffset;
+	int m_sidechainHashOffset;
+
+	// Transaction hashes without the miner transaction
+	const uint8_t* m_transactions;
+	uint64_t m_numTransactions;
+
+	// Side-chain data
+	const uint8_t* m_sideChainData;
+
+	hash m_spendPublicKey;
+	hash m_viewPublicKey;
+	hash m_txkeySec;
+	hash m_parent;
+
+	const uint8_t* m_uncles;
+	uint64_t m_numUncles;
+
+	uint64_t m_sidechainHeight;
+	difficulty_type m_difficulty;
+	difficulty_type m_cumulativeDifficulty;
+
+	// Not checked until the view is deserialized into a PoolBlock
+	hash m_sidechainId;
+};
+
 struct PoolBlock
 {
 	PoolBlock();
@@ -61,6 +125,9 @@ struct PoolBlock
 	PoolBlock(const PoolBlock& b);
 	PoolBlock& operator=(const PoolBlock& b);
 
+	PoolBlock(PoolBlock&& b);
+	PoolBlock& operator=(PoolBlock&& b);
+
 	mutable uv_mutex_t m_lock;
 
 	// Monero block template
@@ -135,7 +202,44 @@ struct PoolBlock
 	void serialize_sidechain_data();
 
 	int deserialize(const uint8_t* data, size_t size, SideChain& sidechain);
+	int deserialize(const PoolBlockView& view, SideChain& sidechain);
 	bool get_pow_hash(RandomX_Hasher* hasher, const hash& seed_hash, hash& pow_hash);
 };
 
+// Storage for PoolBlock objects owned by SideChain
+// Blocks are grouped into slabs by sidechain height, so when old heights are pruned their slabs are released as a whole
+class PoolBlockArena : public nocopy_nomove
+{
+public:
+	PoolBlockArena();
+	~PoolBlockArena();
+
+	template<typename T>
+	PoolBlock* create(T&& block)
+	{
+		return new (allocate(block.m_sidechainHeight)) PoolBlock(std::forward<T>(block));
+	}
+
+	void destroy(PoolBlock* block);
+
+private:
+	enum {
+		BUCKET_HEIGHTS = 16,
+		SLAB_SIZE = 32,
+	};
+
+	struct Slab
+	{
+		uint64_t m_usedMask;
+		typename std::aligned_storage<sizeof(PoolBlock), alignof(PoolBlock)>::type m_slots[SLAB_SIZE];
+	};
+
+	static_assert(SLAB_SIZE <= 64, "Slab::m_usedMask is too small");
+
+	void* allocate(uint64_t sidechain_height);
+
+	uv_mutex_t m_lock;
+	std::map<uint64_t, std::vector<Slab*>> m_slabs;
+};
+
 } // namespace p2pool
@@ -19,271 +19,369 @@
 
 namespace p2pool {
 
-// Parse an arbitrary binary blob into the pool block
+// Parse an arbitrary binary blob into the pool block view
 // Since data here can come from external and possibly malicious sources, check everything
-// Only the syntax (i.e. the serialized block binary format) and the keccak hash are checked here
-// Semantics must also be checked elsewhere before accepting the block (PoW, reward split between miners, difficulty calculation and so on)
-int PoolBlock::deserialize(const uint8_t* data, size_t size, SideChain& sidechain)
+// Only the syntax (i.e. the serialized block binary format) is checked here, nothing is copied or allocated
+// The keccak hash is checked when the view is turned into a PoolBlock
+int PoolBlockView::parse(const uint8_t* data, size_t size)
 {
-	try {
-		// Sanity check
-		if (!data || (size > 128 * 1024)) {
-			return __LINE__;
-		}
+	// Sanity check
+	if (!data || (size > 128 * 1024)) {
+		return __LINE__;
+	}
 
-		const uint8_t* const data_begin = data;
-		const uint8_t* const data_end = data + size;
+	const uint8_t* const data_begin = data;
+	const uint8_t* const data_end = data + size;
 
-		auto read_byte = [&data, data_end](uint8_t& b) -> bool
-		{
-			if (data < data_end) {
-				b = *(data++);
-				return true;
-			}
-			return false;
-		};
+	m_data = data;
+	m_size = size;
+
+	auto read_byte = [&data, data_end](uint8_t& b) -> bool
+	{
+		if (data < data_end) {
+			b = *(data++);
+			return true;
+		}
+		return false;
+	};
 
 #define READ_BYTE(x) do { if (!read_byte(x)) return __LINE__; } while (0)
 #define EXPECT_BYTE(value) do { uint8_t tmp; READ_BYTE(tmp); if (tmp != (value)) return __LINE__; } while (0)
 
-		auto read_varint = [&data, data_end](auto& b) -> bool
-		{
-			uint64_t result = 0;
-			int k = 0;
+	auto read_varint = [&data, data_end](auto& b) -> bool
+	{
+		uint64_t result = 0;
+		int k = 0;
 
-			while (data < data_end) {
-				if (k >= static_cast<int>(sizeof(b)) * 8) {
-					return false;
-				}
+		while (data < data_end) {
+			if (k >= static_cast<int>(sizeof(b)) * 8) {
+				return false;
+			}
 
-				const uint64_t cur_byte = *(data++);
-				result |= (cur_byte & 0x7F) << k;
-				k += 7;
+			const uint64_t cur_byte = *(data++);
+			result |= (cur_byte & 0x7F) << k;
+			k += 7;
 
-				if ((cur_byte & 0x80) == 0) {
-					b = result;
-					return true;
-				}
+			if ((cur_byte & 0x80) == 0) {
+				b = result;
+				return true;
 			}
-			return false;
-		};
+		}
+		return false;
+	};
 
 #define READ_VARINT(x) do { if (!read_varint(x)) return __LINE__; } while(0)
 
-		auto read_buf = [&data, data_end](void* buf, size_t size) -> bool
-		{
-			if (static_cast<size_t>(data_end - data) < size) {
-				return false;
-			}
+	auto read_buf = [&data, data_end](void* buf, size_t size) -> bool
+	{
+		if (static_cast<size_t>(data_end - data) < size) {
+			return false;
+		}
 
-			memcpy(buf, data, size);
-			data += size;
-			return true;
-		};
+		memcpy(buf, data, size);
+		data += size;
+		return true;
+	};
 
 #define READ_BUF(buf, size) do { if (!read_buf((buf), (size))) return __LINE__; } while(0)
 
-		MutexLock lock(m_lock);
-
-		READ_BYTE(m_majorVersion);
-		if (m_majorVersion > HARDFORK_SUPPORTED_VERSION) return __LINE__;
+	auto skip = [&data, data_end](size_t size) -> bool
+	{
+		if (static_cast<size_t>(data_end - data) < size) {
+			return false;
+		}
 
-		READ_BYTE(m_minorVersion);
-		if (m_minorVersion < m_majorVersion) return __LINE__;
+		data += size;
+		return true;
+	};
 
-		READ_VARINT(m_timestamp);
-		READ_BUF(m_prevId.h, HASH_SIZE);
+#define SKIP(size) do { if (!skip(size)) return __LINE__; } while(0)
 
-		const int nonce_offset = static_cast<int>(data - data_begin);
-		READ_BUF(&m_nonce, NONCE_SIZE);
+	READ_BYTE(m_majorVersion);
+	if (m_majorVersion > HARDFORK_SUPPORTED_VERSION) return __LINE__;
 
-		m_mainChainHeaderSize = data - data_begin;
+	READ_BYTE(m_minorVersion);
+	if (m_minorVersion < m_majorVersion) return __LINE__;
 
-		EXPECT_BYTE(TX_VERSION);
+	READ_VARINT(m_timestamp);
+	READ_BUF(m_prevId.h, HASH_SIZE);
 
-		uint64_t unlock_height;
-		READ_VARINT(unlock_height);
+	m_nonceOffset = static_cast<int>(data - data_begin);
+	READ_BUF(&m_nonce, NONCE_SIZE);
 
-		EXPECT_BYTE(1);
-		EXPECT_BYTE(TXIN_GEN);
+	m_mainChainHeaderSize = data - data_begin;
 
-		READ_VARINT(m_txinGenHeight);
-		if (unlock_height != m_txinGenHeight + MINER_REWARD_UNLOCK_TIME) return __LINE__;
+	EXPECT_BYTE(TX_VERSION);
 
-		std::vector<uint8_t> outputs_blob;
-		m_mainChainOutputsOffset = static_cast<int>(data - data_begin);
+	uint64_t unlock_height;
+	READ_VARINT(unlock_height);
 
-		uint64_t num_outputs;
-		READ_VARINT(num_outputs);
+	EXPECT_BYTE(1);
+	EXPECT_BYTE(TXIN_GEN);
 
-		uint64_t total_reward = 0;
+	READ_VARINT(m_txinGenHeight);
+	if (unlock_height != m_txinGenHeight + MINER_REWARD_UNLOCK_TIME) return __LINE__;
 
-		if (num_outputs > 0) {
-			// Outputs are in the buffer, just read them
-			// Each output is at least 34 bytes, exit early if there's not enough data left
-			// 1 byte for reward, 1 byte for TXOUT_TO_KEY, 32 bytes for eph_pub_key
-			constexpr uint64_t MIN_OUTPUT_SIZE = 34;
+	m_outputsOffset = static_cast<int>(data - data_begin);
 
-			if (num_outputs > std::numeric_limits<uint64_t>::max() / MIN_OUTPUT_SIZE) return __LINE__;
-			if (static_cast<uint64_t>(data_end - data) < num_outputs * MIN_OUTPUT_SIZE) return __LINE__;
+	READ_VARINT(m_numOutputs);
 
-			m_outputs.clear();
-			m_outputs.reserve(num_outputs);
+	m_totalReward = 0;
 
-			for (uint64_t i = 0; i < num_outputs; ++i) {
-				TxOutput t;
+	if (m_numOutputs > 0) {
+		// Outputs are in the buffer, just check them
+		// Each output is at least 34 bytes, exit early if there's not enough data left
+		// 1 byte for reward, 1 byte for TXOUT_TO_KEY, 32 bytes for eph_pub_key
+		constexpr uint64_t MIN_OUTPUT_SIZE = 34;
 
-				READ_VARINT(t.m_reward);
-				total_reward += t.m_reward;
+		if (m_numOutputs > std::numeric_limits<uint64_t>::max() / MIN_OUTPUT_SIZE) return __LINE__;
+		if (static_cast<uint64_t>(data_end - data) < m_numOutputs * MIN_OUTPUT_SIZE) return __LINE__;
 
-				EXPECT_BYTE(TXOUT_TO_KEY);
-				READ_BUF(t.m_ephPublicKey.h, HASH_SIZE);
+		m_outputs = data;
 
-				m_outputs.emplace_back(std::move(t));
-			}
+		for (uint64_t i = 0; i < m_numOutputs; ++i) {
+			uint64_t reward;
+			READ_VARINT(reward);
+			m_totalReward += reward;
 
-			m_mainChainOutputsBlobSize = static_cast<int>(data - data_begin) - m_mainChainOutputsOffset;
-			outputs_blob.assign(data_begin + m_mainChainOutputsOffset, data);
+			EXPECT_BYTE(TXOUT_TO_KEY);
+			SKIP(HASH_SIZE);
 		}
-		else {
-			// Outputs are not in the buffer and must be calculated from sidechain data
-			// We only have total reward and outputs blob size here
-			READ_VARINT(total_reward);
-
-			uint64_t tmp;
-			READ_VARINT(tmp);
-
-			// Sanity check
-			if ((tmp == 0) || (tmp > 128 * 1024)) {
-				return __LINE__;
-			}
 
-			m_mainChainOutputsBlobSize = static_cast<int>(tmp);
-		}
+		m_outputsBlobSize = static_cast<int>(data - data_begin) - m_outputsOffset;
+	}
+	else {
+		// Outputs are not in the buffer and must be calculated from sidechain data
+		// We only have total reward and outputs blob size here
+		m_outputs = nullptr;
 
-		// Technically some p2pool node could keep stuffing block with transactions until reward is less than 0.6 XMR
-		// But default transaction picking algorithm never does that. It's better to just ban such nodes
-		if (total_reward < 600000000000ULL) {
-			return __LINE__;
-		}
+		READ_VARINT(m_totalReward);
 
-		const int outputs_actual_blob_size = static_cast<int>(data - data_begin) - m_mainChainOutputsOffset;
+		uint64_t tmp;
+		READ_VARINT(tmp);
 
-		if (m_mainChainOutputsBlobSize < outputs_actual_blob_size) {
+		// Sanity check
+		if ((tmp == 0) || (tmp > 128 * 1024)) {
 			return __LINE__;
 		}
 
-		const int outputs_blob_size_diff = m_mainChainOutputsBlobSize - outputs_actual_blob_size;
+		m_outputsBlobSize = static_cast<int>(tmp);
+	}
 
-		uint64_t tx_extra_size;
-		READ_VARINT(tx_extra_size);
+	// Technically some p2pool node could keep stuffing block with transactions until reward is less than 0.6 XMR
+	// But default transaction picking algorithm never does that. It's better to just ban such nodes
+	if (m_totalReward < 600000000000ULL) {
+		return __LINE__;
+	}
 
-		const uint8_t* tx_extra_begin = data;
+	m_outputsActualBlobSize = static_cast<int>(data - data_begin) - m_outputsOffset;
 
-		EXPECT_BYTE(TX_EXTRA_TAG_PUBKEY);
-		READ_BUF(m_txkeyPub.h, HASH_SIZE);
+	if (m_outputsBlobSize < m_outputsActualBlobSize) {
+		return __LINE__;
+	}
 
-		EXPECT_BYTE(TX_EXTRA_NONCE);
-		READ_VARINT(m_extraNonceSize);
+	const int outputs_blob_size_diff = m_outputsBlobSize - m_outputsActualBlobSize;
 
-		// Sanity check
-		if ((m_extraNonceSize < EXTRA_NONCE_SIZE) || (m_extraNonceSize > EXTRA_NONCE_SIZE + 10)) return __LINE__;
+	uint64_t tx_extra_size;
+	READ_VARINT(tx_extra_size);
 
-		const int extra_nonce_offset = static_cast<int>((data - data_begin) + outputs_blob_size_diff);
-		READ_BUF(&m_extraNonce, EXTRA_NONCE_SIZE);
-		for (uint64_t i = EXTRA_NONCE_SIZE; i < m_extraNonceSize; ++i) {
-			EXPECT_BYTE(0);
-		}
+	const uint8_t* tx_extra_begin = data;
 
-		EXPECT_BYTE(TX_EXTRA_MERGE_MINING_TAG);
-		EXPECT_BYTE(HASH_SIZE);
+	EXPECT_BYTE(TX_EXTRA_TAG_PUBKEY);
+	READ_BUF(m_txkeyPub.h, HASH_SIZE);
 
-		const int sidechain_hash_offset = static_cast<int>((data - data_begin) + outputs_blob_size_diff);
-		READ_BUF(m_sidechainId.h, HASH_SIZE);
+	EXPECT_BYTE(TX_EXTRA_NONCE);
+	READ_VARINT(m_extraNonceSize);
 
-		if (static_cast<uint64_t>(data - tx_extra_begin) != tx_extra_size) return __LINE__;
+	// Sanity check
+	if ((m_extraNonceSize < EXTRA_NONCE_SIZE) || (m_extraNonceSize > EXTRA_NONCE_SIZE + 10)) return __LINE__;
 
+	m_extraNonceOffset = static_cast<int>((data - data_begin) + outputs_blob_size_diff);
+	READ_BUF(&m_extraNonce, EXTRA_NONCE_SIZE);
+	for (uint64_t i = EXTRA_NONCE_SIZE; i < m_extraNonceSize; ++i) {
 		EXPECT_BYTE(0);
+	}
 
-		m_mainChainMinerTxSize = (data - data_begin) + outputs_blob_size_diff - m_mainChainHeaderSize;
+	EXPECT_BYTE(TX_EXTRA_MERGE_MINING_TAG);
+	EXPECT_BYTE(HASH_SIZE);
 
-		uint64_t num_transactions;
-		READ_VARINT(num_transactions);
+	m_sidechainHashOffset = static_cast<int>((data - data_begin) + outputs_blob_size_diff);
+	READ_BUF(m_sidechainId.h, HASH_SIZE);
 
-		if (num_transactions > std::numeric_limits<uint64_t>::max() / HASH_SIZE) return __LINE__;
-		if (static_cast<uint64_t>(data_end - data) < num_transactions * HASH_SIZE) return __LINE__;
+	if (static_cast<uint64_t>(data - tx_extra_begin) != tx_extra_size) return __LINE__;
 
-		m_transactions.resize(1);
-		m_transactions.reserve(num_transactions + 1);
+	EXPECT_BYTE(0);
 
-		for (uint64_t i = 0; i < num_transactions; ++i) {
-			hash id;
-			READ_BUF(id.h, HASH_SIZE);
-			m_transactions.emplace_back(std::move(id));
-		}
+	m_mainChainMinerTxSize = (data - data_begin) + outputs_blob_size_diff - m_mainChainHeaderSize;
 
-		m_mainChainData.reserve((data - data_begin) + outputs_blob_size_diff);
-		m_mainChainData.assign(data_begin, data_begin + m_mainChainOutputsOffset);
-		m_mainChainData.insert(m_mainChainData.end(), m_mainChainOutputsBlobSize, 0);
-		m_mainChainData.insert(m_mainChainData.end(), data_begin + m_mainChainOutputsOffset + outputs_actual_blob_size, data);
+	READ_VARINT(m_numTransactions);
 
-		const uint8_t* sidechain_data_begin = data;
+	if (m_numTransactions > std::numeric_limits<uint64_t>::max() / HASH_SIZE) return __LINE__;
 
-		hash spend_pub_key;
-		hash view_pub_key;
-		READ_BUF(spend_pub_key.h, HASH_SIZE);
-		READ_BUF(view_pub_key.h, HASH_SIZE);
-		m_minerWallet.assign(spend_pub_key, view_pub_key);
+	m_transactions = data;
+	SKIP(m_numTransactions * HASH_SIZE);
 
-		READ_BUF(m_txkeySec.h, HASH_SIZE);
-		READ_BUF(m_parent.h, HASH_SIZE);
+	m_sideChainData = data;
 
-		uint64_t num_uncles;
-		READ_VARINT(num_uncles);
+	READ_BUF(m_spendPublicKey.h, HASH_SIZE);
+	READ_BUF(m_viewPublicKey.h, HASH_SIZE);
+	READ_BUF(m_txkeySec.h, HASH_SIZE);
+	READ_BUF(m_parent.h, HASH_SIZE);
 
-		if (num_uncles > std::numeric_limits<uint64_t>::max() / HASH_SIZE) return __LINE__;
-		if (static_cast<uint64_t>(data_end - data) < num_uncles * HASH_SIZE) return __LINE__;
+	READ_VARINT(m_numUncles);
 
-		m_uncles.clear();
-		m_uncles.reserve(num_uncles);
+	if (m_numUncles > std::numeric_limits<uint64_t>::max() / HASH_SIZE) return __LINE__;
 
-		for (uint64_t i = 0; i < num_uncles; ++i) {
-			hash id;
-			READ_BUF(id.h, HASH_SIZE);
-			m_uncles.emplace_back(std::move(id));
-		}
+	m_uncles = data;
+	SKIP(m_numUncles * HASH_SIZE);
 
-		READ_VARINT(m_sidechainHeight);
+	READ_VARINT(m_sidechainHeight);
 
-		READ_VARINT(m_difficulty.lo);
-		READ_VARINT(m_difficulty.hi);
+	READ_VARINT(m_difficulty.lo);
+	READ_VARINT(m_difficulty.hi);
 
-		READ_VARINT(m_cumulativeDifficulty.lo);
-		READ_VARINT(m_cumulativeDifficulty.hi);
+	READ_VARINT(m_cumulativeDifficulty.lo);
+	READ_VARINT(m_cumulativeDifficulty.hi);
 
 #undef READ_BYTE
 #undef EXPECT_BYTE
 #undef READ_VARINT
 #undef READ_BUF
+#undef SKIP
 
-		if (data != data_end) {
-			return __LINE__;
+	if (data != data_end) {
+		return __LINE__;
+	}
+
+	return 0;
+}
+
+int PoolBlock::deserialize(const uint8_t* data, size_t size, SideChain& sidechain)
+{
+	PoolBlockView view;
+
+	const int result = view.parse(data, size);
+	if (result != 0) {
+		return result;
+	}
+
+	return deserialize(view, sidechain);
+}
+
+// Copies the parsed data into this block and checks the keccak hash
+// Semantics must also be checked elsewhere before accepting the block (PoW, reward split between miners, difficulty calculation and so on)
+int PoolBlock::deserialize(const PoolBlockView& view, SideChain& sidechain)
+{
+	try {
+		const uint8_t* const data_begin = view.m_data;
+		const uint8_t* const data_end = view.m_data + view.m_size;
+		const uint8_t* const mainchain_data_end = view.m_sideChainData;
+		const int outputs_blob_size_diff = view.m_outputsBlobSize - view.m_outputsActualBlobSize;
+
+		MutexLock lock(m_lock);
+
+		m_majorVersion = view.m_majorVersion;
+		m_minorVersion = view.m_minorVersion;
+		m_timestamp = view.m_timestamp;
+		m_prevId = view.m_prevId;
+		m_nonce = view.m_nonce;
+		m_mainChainHeaderSize = view.m_mainChainHeaderSize;
+		m_txinGenHeight = view.m_txinGenHeight;
+		m_mainChainOutputsOffset = view.m_outputsOffset;
+		m_mainChainOutputsBlobSize = view.m_outputsBlobSize;
+
+		m_outputs.clear();
+
+		if (view.m_numOutputs > 0) {
+			m_outputs.reserve(view.m_numOutputs);
+
+			// Outputs were checked by PoolBlockView::parse(), so they can be read without bounds checks
+			const uint8_t* p = view.m_outputs;
+
+			for (uint64_t i = 0; i < view.m_numOutputs; ++i) {
+				TxOutput t;
+
+				uint64_t cur_byte;
+				int k = 0;
+				do {
+					cur_byte = *(p++);
+					t.m_reward |= (cur_byte & 0x7F) << k;
+					k += 7;
+				} while (cur_byte & 0x80);
+
+				// Skip TXOUT_TO_KEY
+				++p;
+
+				memcpy(t.m_ephPublicKey.h, p, HASH_SIZE);
+				p += HASH_SIZE;
+
+				m_outputs.emplace_back(std::move(t));
+			}
 		}
 
-		if ((num_outputs == 0) && !sidechain.get_outputs_blob(this, total_reward, outputs_blob)) {
-			return __LINE__;
+		m_txkeyPub = view.m_txkeyPub;
+		m_extraNonceSize = view.m_extraNonceSize;
+		m_extraNonce = view.m_extraNonce;
+		m_sidechainId = view.m_sidechainId;
+		m_mainChainMinerTxSize = view.m_mainChainMinerTxSize;
+
+		m_transactions.resize(1);
+		m_transactions.reserve(view.m_numTransactions + 1);
+
+		for (uint64_t i = 0; i < view.m_numTransactions; ++i) {
+			hash id;
+			memcpy(id.h, view.m_transactions + i * HASH_SIZE, HASH_SIZE);
+			m_transactions.emplace_back(std::move(id));
 		}
 
-		if (static_cast<int>(outputs_blob.size()) != m_mainChainOutputsBlobSize) {
-			return __LINE__;
+		m_minerWallet.assign(view.m_spendPublicKey, view.m_viewPublicKey);
+		m_txkeySec = view.m_txkeySec;
+		m_parent = view.m_parent;
+
+		m_uncles.clear();
+		m_uncles.reserve(view.m_numUncles);
+
+		for (uint64_t i = 0; i < view.m_numUncles; ++i) {
+			hash id;
+			memcpy(id.h, view.m_uncles + i * HASH_SIZE, HASH_SIZE);
+			m_uncles.emplace_back(std::move(id));
 		}
 
-		memcpy(m_mainChainData.data() + m_mainChainOutputsOffset, outputs_blob.data(), m_mainChainOutputsBlobSize);
+		m_sidechainHeight = view.m_sidechainHeight;
+		m_difficulty = view.m_difficulty;
+		m_cumulativeDifficulty = view.m_cumulativeDifficulty;
+
+		const uint8_t* outputs_end = data_begin + m_mainChainOutputsOffset + view.m_outputsActualBlobSize;
+
+		m_mainChainData.reserve((mainchain_data_end - data_begin) + outputs_blob_size_diff);
+		m_mainChainData.assign(data_begin, outputs_end);
+
+		if (view.m_numOutputs == 0) {
+			std::vector<uint8_t> outputs_blob;
+			if (!sidechain.get_outputs_blob(this, view.m_totalReward, outputs_blob)) {
+				return __LINE__;
+			}
+
+			if (static_cast<int>(outputs_blob.size()) != m_mainChainOutputsBlobSize) {
+				return __LINE__;
+			}
+
+			m_mainChainData.resize(m_mainChainOutputsOffset);
+			m_mainChainData.insert(m_mainChainData.end(), outputs_blob.begin(), outputs_blob.end());
+		}
+
+		m_mainChainData.insert(m_mainChainData.end(), outputs_end, mainchain_data_end);
 
 		hash check;
 		const std::vector<uint8_t>& consensus_id = sidechain.consensus_id();
+		const int nonce_offset = view.m_nonceOffset;
+		const int extra_nonce_offset = view.m_extraNonceOffset;
+		const int sidechain_hash_offset = view.m_sidechainHashOffset;
+		const int mainchain_data_size = static_cast<int>(m_mainChainData.size());
+		const int sidechain_data_size = static_cast<int>(data_end - mainchain_data_end);
+
 		keccak_custom(
-			[this, nonce_offset, extra_nonce_offset, sidechain_hash_offset, data_begin, data_end, &consensus_id, &outputs_blob, outputs_blob_size_diff](int offset) -> uint8_t
+			[this, nonce_offset, extra_nonce_offset, sidechain_hash_offset, mainchain_data_end, mainchain_data_size, sidechain_data_size, &consensus_id](int offset) -> uint8_t
 			{
 				uint32_t k = static_cast<uint32_t>(offset - nonce_offset);
 				if (k < NONCE_SIZE) {
@@ -300,30 +398,25 @@ int PoolBlock::deserialize(const uint8_t* data, size_t size, SideChain& sidechai
 					return 0;
 				}
 
-				const int data_size = static_cast<int>((data_end - data_begin) + outputs_blob_size_diff);
-				if (offset < data_size) {
-					if (offset < m_mainChainOutputsOffset) {
-						return data_begin[offset];
-					}
-					else if (offset < m_mainChainOutputsOffset + m_mainChainOutputsBlobSize) {
-						const int tmp = offset - m_mainChainOutputsOffset;
-						return outputs_blob[tmp];
-					}
-					else {
-						return data_begin[offset - outputs_blob_size_diff];
-					}
+				if (offset < mainchain_data_size) {
+					return m_mainChainData[offset];
+				}
+				offset -= mainchain_data_size;
+
+				if (offset < sidechain_data_size) {
+					return mainchain_data_end[offset];
 				}
-				offset -= data_size;
+				offset -= sidechain_data_size;
 
 				return consensus_id[offset];
 			},
-			static_cast<int>(size + outputs_blob_size_diff + consensus_id.size()), check.h, HASH_SIZE);
+			mainchain_data_size + sidechain_data_size + static_cast<int>(consensus_id.size()), check.h, HASH_SIZE);
 
 		if (check != m_sidechainId) {
 			return __LINE__;
 		}
 
-		m_sideChainData.assign(sidechain_data_begin, data_end);
+		m_sideChainData.assign(mainchain_data_end, data_end);
 	}
 	catch (std::exception& e) {
 		const char* msg = e.what();
@@ -32,6 +32,9 @@ RandomX_Hasher::RandomX_Hasher(p2pool* pool)
 	: m_pool(pool)
 	, m_cache{}
 	, m_dataset(nullptr)
+	, m_vm{}
+	, m_numVMs(std::max(std::thread::hardware_concurrency(), 1U))
+	, m_nextVM(0)
 	, m_seed{}
 	, m_index(0)
 	, m_setSeedCounter(0)
@@ -70,9 +73,16 @@ RandomX_Hasher::RandomX_Hasher(p2pool* pool)
 	uv_rwlock_init_checked(&m_datasetLock);
 	uv_rwlock_init_checked(&m_cacheLock);
 
+	for (std::atomic<bool>& b : m_lightVMNoLargePages) {
+		b = false;
+	}
+
 	for (size_t i = 0; i < array_size(m_vm); ++i) {
-		uv_mutex_init_checked(&m_vm[i].mutex);
-		m_vm[i].vm = nullptr;
+		m_vm[i] = new ThreadSafeVM[m_numVMs];
+		for (uint32_t j = 0; j < m_numVMs; ++j) {
+			uv_mutex_init_checked(&m_vm[i][j].mutex);
+			m_vm[i][j].vm = nullptr;
+		}
 	}
 
 
@@ -92,13 +102,16 @@ RandomX_Hasher::~RandomX_Hasher()
 	uv_rwlock_destroy(&m_cacheLock);
 
 	for (size_t i = 0; i < array_size(m_vm); ++i) {
-		{
-			MutexLock lock(m_vm[i].mutex);
-			if (m_vm[i].vm) {
-				randomx_destroy_vm(m_vm[i].vm);
+		for (uint32_t j = 0; j < m_numVMs; ++j) {
+			{
+				MutexLock lock(m_vm[i][j].mutex);
+				if (m_vm[i][j].vm) {
+					randomx_destroy_vm(m_vm[i][j].vm);
+				}
 			}
+			uv_mutex_destroy(&m_vm[i][j].mutex);
 		}
-		uv_mutex_destroy(&m_vm[i].mutex);
+		delete[] m_vm[i];
 	}
 
 	if (m_dataset) {
@@ -172,9 +185,16 @@ void RandomX_Hasher::set_old_seed_async(const hash& seed)
 				work->hasher->set_old_seed(work->seed);
 			}
 		},
-		[](uv_work_t* req, int)
+		[](uv_work_t* req, int status)
 		{
-			delete reinterpret_cast<Work*>(req->data);
+			Work* work = reinterpret_cast<Work*>(req->data);
+
+			// set_old_seed() waits for set_seed(), so both caches are ready now
+			if ((status == 0) && !work->pool->stopped()) {
+				work->pool->on_hasher_ready();
+			}
+
+			delete work;
 			num_running_jobs.fetch_sub(1);
 		}
 	);
@@ -209,24 +229,7 @@ void RandomX_Hasher::set_seed(const hash& seed)
 		LOGINFO(1, "new seed " << log::LightBlue() << seed);
 		randomx_init_cache(m_cache[m_index], m_seed[m_index].h, HASH_SIZE);
 
-		MutexLock lock2(m_vm[m_index].mutex);
-
-		if (m_vm[m_index].vm) {
-			m_vm[m_index].vm->setCache(m_cache[m_index]);
-		}
-		else {
-			const randomx_flags flags = randomx_get_flags();
-
-			m_vm[m_index].vm = randomx_create_vm(flags | RANDOMX_FLAG_LARGE_PAGES, m_cache[m_index], nullptr);
-			if (!m_vm[m_index].vm) {
-				LOGWARN(1, "couldn't allocate RandomX light VM using large pages");
-				m_vm[m_index].vm = randomx_create_vm(flags, m_cache[m_index], nullptr);
-				if (!m_vm[m_index].vm) {
-					LOGERR(1, "couldn't allocate RandomX light VM, aborting");
-					panic();
-				}
-			}
-		}
+		update_light_vms(m_index);
 	}
 
 	LOGINFO(1, log::LightCyan() << "cache updated");
@@ -267,21 +270,38 @@ void RandomX_Hasher::set_seed(const hash& seed)
 			randomx_init_dataset(m_dataset, m_cache[m_index], 0, numItems);
 		}
 
-		MutexLock lock3(m_vm[FULL_DATASET_VM].mutex);
+		const randomx_flags flags = randomx_get_flags();
+		uint32_t num_vms = 0;
+
+		// If one VM can't use large pages, the others won't be able to either
+		bool large_pages = true;
 
-		if (!m_vm[FULL_DATASET_VM].vm) {
-			const randomx_flags flags = randomx_get_flags();
-			m_vm[FULL_DATASET_VM].vm = randomx_create_vm(flags | RANDOMX_FLAG_LARGE_PAGES | RANDOMX_FLAG_FULL_MEM, nullptr, m_dataset);
-			if (!m_vm[FULL_DATASET_VM].vm) {
-				LOGWARN(1, "couldn't allocate RandomX VM using large pages");
-				m_vm[FULL_DATASET_VM].vm = randomx_create_vm(flags, nullptr, m_dataset);
-				if (!m_vm[FULL_DATASET_VM].vm) {
-					LOGERR(1, "couldn't allocate RandomX VM");
+		for (uint32_t i = 0; i < m_numVMs; ++i) {
+			ThreadSafeVM& t = m_vm[FULL_DATASET_VM][i];
+			MutexLock lock3(t.mutex);
+
+			if (!t.vm) {
+				if (large_pages) {
+					t.vm = randomx_create_vm(flags | RANDOMX_FLAG_LARGE_PAGES | RANDOMX_FLAG_FULL_MEM, nullptr, m_dataset);
+					if (!t.vm) {
+						LOGWARN(1, "couldn't allocate RandomX VMs using large pages");
+						large_pages = false;
+					}
+				}
+				if (!t.vm) {
+					t.vm = randomx_create_vm(flags, nullptr, m_dataset);
+					if (!t.vm) {
+						LOGERR(1, "couldn't allocate RandomX VM");
+					}
 				}
 			}
+
+			if (t.vm) {
+				++num_vms;
+			}
 		}
 
-		LOGINFO(1, log::LightCyan() << "dataset updated");
+		LOGINFO(1, log::LightCyan() << "dataset updated, " << num_vms << " VMs ready");
 	}
 }
 
@@ -302,26 +322,73 @@ void RandomX_Hasher::set_old_seed(const hash& seed)
 
 		randomx_init_cache(m_cache[old_index], m_seed[old_index].h, HASH_SIZE);
 
-		MutexLock lock2(m_vm[old_index].mutex);
+		update_light_vms(old_index);
+	}
+	LOGINFO(1, log::LightCyan() << "old cache updated");
+}
+
+// Called with m_cacheLock locked for writing
+void RandomX_Hasher::update_light_vms(uint32_t index)
+{
+	ThreadSafeVM* vms = m_vm[index];
+
+	// The first VM must always exist, the rest are created when they're needed
+	for (uint32_t i = 0; i < m_numVMs; ++i) {
+		MutexLock lock(vms[i].mutex);
 
-		if (m_vm[old_index].vm) {
-			m_vm[old_index].vm->setCache(m_cache[old_index]);
+		if (vms[i].vm) {
+			vms[i].vm->setCache(m_cache[index]);
 		}
-		else {
-			const randomx_flags flags = randomx_get_flags();
-
-			m_vm[old_index].vm = randomx_create_vm(flags | RANDOMX_FLAG_LARGE_PAGES, m_cache[old_index], nullptr);
-			if (!m_vm[old_index].vm) {
-				LOGWARN(1, "couldn't allocate RandomX light VM using large pages");
-				m_vm[old_index].vm = randomx_create_vm(flags, m_cache[old_index], nullptr);
-				if (!m_vm[old_index].vm) {
-					LOGERR(1, "couldn't allocate RandomX light VM, aborting");
-					panic();
-				}
+		else if (i == 0) {
+			vms[i].vm = create_light_vm(index);
+			if (!vms[i].vm) {
+				LOGERR(1, "couldn't allocate RandomX light VM, aborting");
+				panic();
 			}
 		}
 	}
-	LOGINFO(1, log::LightCyan() << "old cache updated");
+}
+
+randomx_vm* RandomX_Hasher::create_light_vm(uint32_t index)
+{
+	const randomx_flags flags = randomx_get_flags();
+
+	randomx_vm* vm = nullptr;
+
+	if (!m_lightVMNoLargePages[index].load()) {
+		vm = randomx_create_vm(flags | RANDOMX_FLAG_LARGE_PAGES, m_cache[index], nullptr);
+		if (!vm && !m_lightVMNoLargePages[index].exchange(true)) {
+			LOGWARN(1, "couldn't allocate RandomX light VMs using large pages");
+		}
+	}
+
+	if (!vm) {
+		vm = randomx_create_vm(flags, m_cache[index], nullptr);
+	}
+
+	return vm;
+}
+
+// Returns a locked VM from the pool, it tries to find a free one first
+RandomX_Hasher::ThreadSafeVM* RandomX_Hasher::lock_vm(uint32_t index)
+{
+	ThreadSafeVM* vms = m_vm[index];
+	const uint32_t start = m_nextVM.fetch_add(1) % m_numVMs;
+
+	for (uint32_t i = 0; i < m_numVMs; ++i) {
+		ThreadSafeVM* t = vms + (start + i) % m_numVMs;
+		if ((uv_mutex_trylock(&t->mutex) == 0)) {
+			if (t->vm || (index == FULL_DATASET_VM)) {
+				return t;
+			}
+			uv_mutex_unlock(&t->mutex);
+		}
+	}
+
+	// All VMs are busy, wait for one
+	ThreadSafeVM* t = vms + start;
+	uv_mutex_lock(&t->mutex);
+	return t;
 }
 
 bool RandomX_Hasher::calculate(const void* data, size_t size, const hash& seed, hash& result)
@@ -334,10 +401,11 @@ bool RandomX_Hasher::calculate(const void* data, size_t size, const hash& seed,
 			return false;
 		}
 
-		MutexLock lock(m_vm[FULL_DATASET_VM].mutex);
+		ThreadSafeVM* t = lock_vm(FULL_DATASET_VM);
+		ON_SCOPE_LEAVE([t]() { uv_mutex_unlock(&t->mutex); });
 
-		if (m_vm[FULL_DATASET_VM].vm && (seed == m_seed[m_index])) {
-			randomx_calculate_hash(m_vm[FULL_DATASET_VM].vm, data, size, &result);
+		if (t->vm && (seed == m_seed[m_index])) {
+			randomx_calculate_hash(t->vm, data, size, &result);
 			return true;
 		}
 	}
@@ -349,21 +417,24 @@ bool RandomX_Hasher::calculate(const void* data, size_t size, const hash& seed,
 		return false;
 	}
 
-	{
-		MutexLock lock2(m_vm[m_index].mutex);
-		if (m_vm[m_index].vm && (seed == m_seed[m_index])) {
-			randomx_calculate_hash(m_vm[m_index].vm, data, size, &result);
-			return true;
+	for (uint32_t index : { m_index, m_index ^ 1 }) {
+		// The first VM is created when the cache is initialized for this seed
+		if ((seed != m_seed[index]) || !m_vm[index][0].vm) {
+			continue;
 		}
-	}
 
-	const uint32_t prev_index = m_index ^ 1;
+		ThreadSafeVM* t = lock_vm(index);
+		ON_SCOPE_LEAVE([t]() { uv_mutex_unlock(&t->mutex); });
 
-	MutexLock lock2(m_vm[prev_index].mutex);
+		// Light VMs share the cache, so a new one can be created with m_cacheLock locked for reading
+		if (!t->vm) {
+			t->vm = create_light_vm(index);
+		}
 
-	if (m_vm[prev_index].vm && (seed == m_seed[prev_index])) {
-		randomx_calculate_hash(m_vm[prev_index].vm, data, size, &result);
-		return true;
+		if (t->vm) {
+			randomx_calculate_hash(t->vm, data, size, &result);
+			return true;
+		}
 	}
 
 	return false;
@@ -48,6 +48,10 @@ private:
 		randomx_vm* vm;
 	};
 
+	ThreadSafeVM* lock_vm(uint32_t index);
+	void update_light_vms(uint32_t index);
+	randomx_vm* create_light_vm(uint32_t index);
+
 	p2pool* m_pool;
 
 	std::atomic<int> m_stopped{ 0 };
@@ -58,11 +62,17 @@ private:
 	uv_rwlock_t m_datasetLock;
 	randomx_dataset* m_dataset;
 
-	// 0: light VM for the current seed
-	// 1: light VM for the previous seed
-	// 2: full dataset VM for the current seed
+	// Each entry is a pool of m_numVMs VMs, so hashes can be calculated on all cores at the same time
+	// 0: light VMs for the current seed
+	// 1: light VMs for the previous seed
+	// 2: full dataset VMs for the current seed (all of them share m_dataset)
 	enum { FULL_DATASET_VM = 2 };
-	ThreadSafeVM m_vm[3];
+	ThreadSafeVM* m_vm[3];
+	uint32_t m_numVMs;
+
+	// Set when a light VM couldn't use large pages, the rest of this pool doesn't try them again (and doesn't repeat the warning)
+	std::atomic<bool> m_lightVMNoLargePages[2];
+	std::atomic<uint32_t> m_nextVM;
 
 	hash m_seed[2];
 	uint32_t m_index;
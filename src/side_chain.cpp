@@ -20,6 +20,7 @@
 #include "side_chain.h"
 #include "pool_block.h"
 #include "wallet.h"
+#include "crypto.h"
 #include "block_template.h"
 #include "randomx.h"
 #include "dataset.hpp"
@@ -29,17 +30,24 @@
 #include "p2p_server.h"
 #include "params.h"
 #include "json_parsers.h"
+#include "block_cache.h"
+#include "hashing_executor.h"
 #include <rapidjson/document.h>
 #include <rapidjson/istreamwrapper.h>
 #include <fstream>
 #include <iterator>
 #include <numeric>
+#include <thread>
+#include <random>
 
 // Only uncomment it to debug issues with uncle/orphan blocks
 //#define DEBUG_BROADCAST_DELAY_MS 100
 
-#ifdef DEBUG_BROADCAST_DELAY_MS
-#include <thread>
+// Cross-checks incrementally calculated difficulty against the full recalculation
+#ifdef _DEBUG
+#define SIDECHAIN_DIFFICULTY_DEBUG 1
+#else
+#define SIDECHAIN_DIFFICULTY_DEBUG 0
 #endif
 
 static constexpr char log_category_prefix[] = "SideChain ";
@@ -49,17 +57,25 @@ constexpr size_t UNCLE_BLOCK_DEPTH = 3;
 
 static_assert(1 <= UNCLE_BLOCK_DEPTH && UNCLE_BLOCK_DEPTH <= 10, "Invalid UNCLE_BLOCK_DEPTH");
 
+// Don't start more threads to check outputs than there are blocks to keep them busy
+constexpr size_t MIN_OUTPUTS_CHECKS_PER_THREAD = 4;
+
 namespace p2pool {
 
 SideChain::SideChain(p2pool* pool)
 	: m_pool(pool)
 	, m_chainTip(nullptr)
+	, m_seenBlocks(SEEN_BLOCKS_BUCKETS * SEEN_BLOCKS_WAYS)
+	, m_seenBlocksCounter(0)
+	, m_seenBlocksSalt(0)
 	, m_poolName("default")
 	, m_targetBlockTime(1)
 	, m_minDifficulty(MIN_DIFFICULTY, 0)
 	, m_chainWindowSize(2160)
 	, m_unclePenalty(20)
 	, m_curDifficulty(m_minDifficulty)
+	, m_blockCache(nullptr)
+	, m_blockCacheCompactPending(false)
 {
 	if (!load_config(m_pool->params().m_config)) {
 		panic();
@@ -69,7 +85,15 @@ SideChain::SideChain(p2pool* pool)
 		panic();
 	}
 
-	uv_mutex_init_checked(&m_sidechainLock);
+	uv_rwlock_init_checked(&m_sidechainLock);
+	uv_mutex_init_checked(&m_powCacheLock);
+	uv_mutex_init_checked(&m_seenBlocksLock);
+
+	{
+		std::random_device rd;
+		m_seenBlocksSalt = (static_cast<uint64_t>(rd()) << 32) | rd();
+	}
+	uv_mutex_init_checked(&m_pplnsLock);
 
 	m_difficultyData.reserve(m_chainWindowSize);
 
@@ -131,19 +155,58 @@ SideChain::SideChain(p2pool* pool)
 	// Hide most consensus ID bytes, we only want it on screen to show that we're on the right sidechain
 	memset(buf + 8, '*', HASH_SIZE * 2 - 16);
 	LOGINFO(1, "consensus ID = " << log::LightCyan() << buf);
+
+	if (m_pool->params().m_blockCache) {
+		m_blockCache = new BlockCache(m_consensusId);
+		if (!m_blockCache->ok()) {
+			delete m_blockCache;
+			m_blockCache = nullptr;
+		}
+	}
 }
 
 SideChain::~SideChain()
 {
-	uv_mutex_destroy(&m_sidechainLock);
+	uv_rwlock_destroy(&m_sidechainLock);
+	uv_mutex_destroy(&m_powCacheLock);
+	uv_mutex_destroy(&m_seenBlocksLock);
+	uv_mutex_destroy(&m_pplnsLock);
 	for (auto& it : m_blocksById) {
-		delete it.second;
+		m_blockArena.destroy(it.second);
+	}
+	delete m_blockCache;
+}
+
+// Shares are sorted by wallet, so they can be updated in place
+static void add_share(std::vector<MinerShare>& shares, Wallet* w, uint64_t weight)
+{
+	auto it = std::lower_bound(shares.begin(), shares.end(), w, [](const MinerShare& a, Wallet* b) { return *a.m_wallet < *b; });
+	if ((it != shares.end()) && (*it->m_wallet == *w)) {
+		it->m_weight += weight;
+	}
+	else {
+		shares.emplace(it, weight, w);
+	}
+}
+
+static bool sub_share(std::vector<MinerShare>& shares, Wallet* w, uint64_t weight)
+{
+	auto it = std::lower_bound(shares.begin(), shares.end(), w, [](const MinerShare& a, Wallet* b) { return *a.m_wallet < *b; });
+	if ((it == shares.end()) || !(*it->m_wallet == *w) || (it->m_weight < weight)) {
+		return false;
+	}
+
+	it->m_weight -= weight;
+	if (it->m_weight == 0) {
+		shares.erase(it);
 	}
+
+	return true;
 }
 
 void SideChain::fill_sidechain_data(PoolBlock& block, Wallet* w, const hash& txkeySec, std::vector<MinerShare>& shares)
 {
-	MutexLock lock(m_sidechainLock);
+	ReadLock lock(m_sidechainLock);
 
 	block.m_minerWallet = *w;
 	block.m_txkeySec = txkeySec;
@@ -183,7 +246,11 @@ void SideChain::fill_sidechain_data(PoolBlock& block, Wallet* w, const hash& txk
 	}
 
 	for (uint64_t i = 0, n = std::min<uint64_t>(UNCLE_BLOCK_DEPTH, m_chainTip->m_sidechainHeight + 1); i < n; ++i) {
-		for (PoolBlock* uncle : m_blocksByHeight[m_chainTip->m_sidechainHeight - i]) {
+		auto it = m_blocksByHeight.find(m_chainTip->m_sidechainHeight - i);
+		if (it == m_blocksByHeight.end()) {
+			continue;
+		}
+		for (PoolBlock* uncle : it->second) {
 			// Only add verified and valid blocks
 			if (!uncle || !uncle->m_verified || uncle->m_invalid) {
 				continue;
@@ -240,7 +307,10 @@ void SideChain::fill_sidechain_data(PoolBlock& block, Wallet* w, const hash& txk
 		block.m_uncles.erase(std::unique(block.m_uncles.begin(), block.m_uncles.end()), block.m_uncles.end());
 	}
 
-	block.m_difficulty = m_curDifficulty;
+	const std::shared_ptr<const ChainTipSnapshot> snapshot = std::atomic_load(&m_tipSnapshot);
+	const bool snapshot_ok = snapshot && (snapshot->m_tip == m_chainTip);
+
+	block.m_difficulty = snapshot_ok ? snapshot->m_difficulty : m_curDifficulty;
 	block.m_cumulativeDifficulty = m_chainTip->m_cumulativeDifficulty + block.m_difficulty;
 
 	for (const hash& uncle_id : block.m_uncles) {
@@ -252,48 +322,188 @@ void SideChain::fill_sidechain_data(PoolBlock& block, Wallet* w, const hash& txk
 		block.m_cumulativeDifficulty += it->second->m_difficulty;
 	}
 
+	// Shares of the template = shares of the current tip + shares from the template itself - shares which go out of the window
+	if (snapshot_ok) {
+		shares = snapshot->m_shares;
+
+		bool ok = get_block_shares(&block, [&shares](uint64_t, Wallet* w, uint64_t weight) { add_share(shares, w, weight); });
+		for (const MinerShare& share : snapshot->m_expiringShares) {
+			ok = ok && sub_share(shares, share.m_wallet, share.m_weight);
+		}
+
+		if (ok) {
+			return;
+		}
+	}
+
+	MutexLock lock2(m_pplnsLock);
 	get_shares(&block, shares);
 }
 
-bool SideChain::get_shares(PoolBlock* tip, std::vector<MinerShare>& shares) const
+bool SideChain::get_shares(PoolBlock* tip, std::vector<MinerShare>& shares)
 {
 	shares.clear();
-	shares.reserve(m_chainWindowSize * 2);
 
-	// Collect shares from each block in the PPLNS window, starting from the "tip"
+	// PPLNS window of the "tip" is the PPLNS window of its parent plus shares from the "tip" itself
+	// minus shares which go out of the window when it moves one block forward
+	if (tip->m_sidechainHeight > 0) {
+		auto it = m_blocksById.find(tip->m_parent);
+		if (it == m_blocksById.end()) {
+			LOGWARN(4, "get_shares: can't find parent block at height = " << tip->m_sidechainHeight - 1 << ", id = " << tip->m_parent);
+			LOGWARN(4, "get_shares: can't calculate shares for block at height = " << tip->m_sidechainHeight << ", id = " << tip->m_sidechainId << ", mainchain height = " << tip->m_txinGenHeight);
+			return false;
+		}
+
+		if (!pplns_move_to(it->second)) {
+			LOGWARN(4, "get_shares: can't calculate shares for block at height = " << tip->m_sidechainHeight << ", id = " << tip->m_sidechainId << ", mainchain height = " << tip->m_txinGenHeight);
+			return false;
+		}
 
-	uint64_t block_depth = 0;
-	PoolBlock* cur = tip;
-	do {
-		MinerShare cur_share{ cur->m_difficulty.lo, &cur->m_minerWallet };
+		shares.reserve(m_pplnsShares.size() + UNCLE_BLOCK_DEPTH * 2 + 1);
+		for (const auto& s : m_pplnsShares) {
+			shares.push_back(s.second);
+		}
+	}
 
-		for (const hash& uncle_id : cur->m_uncles) {
-			auto it = m_blocksById.find(uncle_id);
-			if (it == m_blocksById.end()) {
-				LOGWARN(4, "get_shares: can't find uncle block at height = " << cur->m_sidechainHeight << ", id = " << uncle_id);
-				LOGWARN(4, "get_shares: can't calculate shares for block at height = " << tip->m_sidechainHeight << ", id = " << tip->m_sidechainId << ", mainchain height = " << tip->m_txinGenHeight);
-				return false;
-			}
+	const bool result = get_block_shares(tip, [&shares](uint64_t, Wallet* w, uint64_t weight) { add_share(shares, w, weight); });
+
+	if (!result) {
+		LOGWARN(4, "get_shares: can't calculate shares for block at height = " << tip->m_sidechainHeight << ", id = " << tip->m_sidechainId << ", mainchain height = " << tip->m_txinGenHeight);
+		return false;
+	}
 
-			PoolBlock* uncle = it->second;
+	if (tip->m_sidechainHeight >= m_chainWindowSize) {
+		const uint64_t h = tip->m_sidechainHeight - m_chainWindowSize;
+		bool ok = true;
 
-			// Skip uncles which are already out of PPLNS window
-			if (tip->m_sidechainHeight - uncle->m_sidechainHeight >= m_chainWindowSize) {
-				continue;
+		for (PoolBlock* block : m_pplnsWindow) {
+			if (block->m_sidechainHeight > h + UNCLE_BLOCK_DEPTH) {
+				break;
 			}
+			get_block_shares(block,
+				[h, &shares, &ok](uint64_t anchor_height, Wallet* w, uint64_t weight)
+				{
+					if ((anchor_height == h) && !sub_share(shares, w, weight)) {
+						ok = false;
+					}
+				});
+		}
 
-			// Take some % of uncle's weight into this share
-			uint64_t product[2];
-			product[0] = umul128(uncle->m_difficulty.lo, m_unclePenalty, &product[1]);
+		if (!ok) {
+			LOGERR(1, "get_shares: PPLNS window is inconsistent at height = " << tip->m_sidechainHeight << ", id = " << tip->m_sidechainId << ". Fix the code!");
+			pplns_reset();
+			return false;
+		}
+	}
 
-			uint64_t rem;
-			const uint64_t uncle_penalty = udiv128(product[1], product[0], 100, &rem);
+	LOGINFO(5, "get_shares: " << shares.size() << " unique wallets in PPLNS window");
+	return true;
+}
 
-			cur_share.m_weight += uncle_penalty;
-			shares.emplace_back(uncle->m_difficulty.lo - uncle_penalty, &uncle->m_minerWallet);
+// Calls "callback(anchor_height, wallet, weight)" for every share this block adds to the PPLNS window
+// A share stays in the window as long as "tip height - anchor height < m_chainWindowSize"
+template<typename T>
+bool SideChain::get_block_shares(PoolBlock* block, T&& callback) const
+{
+	for (const hash& uncle_id : block->m_uncles) {
+		auto it = m_blocksById.find(uncle_id);
+		if (it == m_blocksById.end()) {
+			LOGWARN(4, "get_shares: can't find uncle block at height = " << block->m_sidechainHeight << ", id = " << uncle_id);
+			return false;
 		}
 
-		shares.push_back(cur_share);
+		PoolBlock* uncle = it->second;
+
+		// Take some % of uncle's weight into this share
+		uint64_t product[2];
+		product[0] = umul128(uncle->m_difficulty.lo, m_unclePenalty, &product[1]);
+
+		uint64_t rem;
+		const uint64_t uncle_penalty = udiv128(product[1], product[0], 100, &rem);
+
+		callback(uncle->m_sidechainHeight, &block->m_minerWallet, uncle_penalty);
+		callback(uncle->m_sidechainHeight, &uncle->m_minerWallet, uncle->m_difficulty.lo - uncle_penalty);
+	}
+
+	callback(block->m_sidechainHeight, &block->m_minerWallet, block->m_difficulty.lo);
+	return true;
+}
+
+// Calls "callback(anchor_height, timestamp, cumulative_difficulty)" for the block and all its uncles
+template<typename T>
+bool SideChain::get_block_difficulty_data(PoolBlock* block, T&& callback) const
+{
+	for (const hash& uncle_id : block->m_uncles) {
+		auto it = m_blocksById.find(uncle_id);
+		if (it == m_blocksById.end()) {
+			LOGWARN(4, "get_difficulty: can't find uncle block at height = " << block->m_sidechainHeight << ", id = " << uncle_id);
+			return false;
+		}
+
+		const PoolBlock* uncle = it->second;
+		callback(uncle->m_sidechainHeight, uncle->m_timestamp, uncle->m_cumulativeDifficulty);
+	}
+
+	callback(block->m_sidechainHeight, block->m_timestamp, block->m_cumulativeDifficulty);
+	return true;
+}
+
+void SideChain::pplns_add(Wallet* w, uint64_t weight, bool newest)
+{
+	MinerShare& share = m_pplnsShares[w->spend_public_key()];
+	share.m_weight += weight;
+
+	// Always point to the wallet of the most recent block, it will be the last one to leave the window
+	if (newest || !share.m_wallet) {
+		share.m_wallet = w;
+	}
+}
+
+bool SideChain::pplns_sub(Wallet* w, uint64_t weight)
+{
+	auto it = m_pplnsShares.find(w->spend_public_key());
+	if ((it == m_pplnsShares.end()) || (it->second.m_weight < weight)) {
+		return false;
+	}
+
+	it->second.m_weight -= weight;
+	if (it->second.m_weight == 0) {
+		m_pplnsShares.erase(it);
+	}
+
+	return true;
+}
+
+bool SideChain::pplns_rebuild(PoolBlock* tip)
+{
+	pplns_reset();
+
+	const uint64_t tip_height = tip->m_sidechainHeight;
+	PoolBlock* cur = tip;
+
+	for (uint64_t block_depth = 0;;) {
+		const bool result = get_block_shares(cur,
+			[this, tip_height](uint64_t anchor_height, Wallet* w, uint64_t weight)
+			{
+				// Skip uncles which are already out of PPLNS window
+				if (tip_height - anchor_height < m_chainWindowSize) {
+					pplns_add(w, weight, false);
+				}
+			}) &&
+			get_block_difficulty_data(cur,
+			[this, tip_height](uint64_t anchor_height, uint64_t timestamp, const difficulty_type& cumulative_diff)
+			{
+				if (tip_height - anchor_height < m_chainWindowSize) {
+					m_difficultyWindow.insert(timestamp, cumulative_diff);
+				}
+			});
+
+		if (!result) {
+			pplns_reset();
+			return false;
+		}
+
+		m_pplnsWindow.push_front(cur);
 
 		++block_depth;
 		if (block_depth >= m_chainWindowSize) {
@@ -308,66 +518,326 @@ bool SideChain::get_shares(PoolBlock* tip, std::vector<MinerShare>& shares) cons
 		auto it = m_blocksById.find(cur->m_parent);
 		if (it == m_blocksById.end()) {
 			LOGWARN(4, "get_shares: can't find parent block at height = " << cur->m_sidechainHeight - 1 << ", id = " << cur->m_parent);
-			LOGWARN(4, "get_shares: can't calculate shares for block at height = " << tip->m_sidechainHeight << ", id = " << tip->m_sidechainId << ", mainchain height = " << tip->m_txinGenHeight);
+			pplns_reset();
 			return false;
 		}
 
 		cur = it->second;
-	} while (block_depth < m_chainWindowSize);
+	}
 
-	// Combine shares with the same wallet addresses
-	std::sort(shares.begin(), shares.end(), [](const auto& a, const auto& b) { return *a.m_wallet < *b.m_wallet; });
+	return true;
+}
 
-	size_t k = 0;
-	for (size_t i = 1, n = shares.size(); i < n; ++i)
+bool SideChain::pplns_advance(PoolBlock* block)
+{
+	if (!get_block_shares(block, [this](uint64_t, Wallet* w, uint64_t weight) { pplns_add(w, weight, true); }) ||
+		!get_block_difficulty_data(block, [this](uint64_t, uint64_t timestamp, const difficulty_type& d) { m_difficultyWindow.insert(timestamp, d); }))
 	{
-		if (*shares[i].m_wallet == *shares[k].m_wallet) {
-			shares[k].m_weight += shares[i].m_weight;
+		return false;
+	}
+
+	m_pplnsWindow.push_back(block);
+
+	if (block->m_sidechainHeight < m_chainWindowSize) {
+		return true;
+	}
+
+	// Everything at this height goes out of the window now
+	const uint64_t h = block->m_sidechainHeight - m_chainWindowSize;
+	bool ok = true;
+
+	for (PoolBlock* b : m_pplnsWindow) {
+		if (b->m_sidechainHeight > h + UNCLE_BLOCK_DEPTH) {
+			break;
 		}
-		else {
-			++k;
-			shares[k].m_weight = shares[i].m_weight;
-			shares[k].m_wallet = shares[i].m_wallet;
+		ok &= get_block_shares(b,
+			[this, h, &ok](uint64_t anchor_height, Wallet* w, uint64_t weight)
+			{
+				if (anchor_height == h) {
+					ok &= pplns_sub(w, weight);
+				}
+			});
+		ok &= get_block_difficulty_data(b,
+			[this, h, &ok](uint64_t anchor_height, uint64_t timestamp, const difficulty_type& d)
+			{
+				if (anchor_height == h) {
+					ok &= m_difficultyWindow.erase(timestamp, d);
+				}
+			});
+	}
+
+	if (m_pplnsWindow.front()->m_sidechainHeight == h) {
+		m_pplnsWindow.pop_front();
+	}
+
+	return ok;
+}
+
+bool SideChain::pplns_rewind()
+{
+	PoolBlock* block = m_pplnsWindow.back();
+	bool ok = true;
+
+	ok &= get_block_shares(block,
+		[this, &ok](uint64_t, Wallet* w, uint64_t weight)
+		{
+			ok &= pplns_sub(w, weight);
+		});
+	ok &= get_block_difficulty_data(block,
+		[this, &ok](uint64_t, uint64_t timestamp, const difficulty_type& d)
+		{
+			ok &= m_difficultyWindow.erase(timestamp, d);
+		});
+
+	m_pplnsWindow.pop_back();
+
+	if (!ok || (block->m_sidechainHeight < m_chainWindowSize)) {
+		return ok;
+	}
+
+	// Everything at this height comes back into the window
+	const uint64_t h = block->m_sidechainHeight - m_chainWindowSize;
+
+	PoolBlock* oldest = m_pplnsWindow.empty() ? nullptr : get_parent(m_pplnsWindow.front());
+	if (!oldest || (oldest->m_sidechainHeight != h)) {
+		return false;
+	}
+
+	m_pplnsWindow.push_front(oldest);
+
+	for (PoolBlock* b : m_pplnsWindow) {
+		if (b->m_sidechainHeight > h + UNCLE_BLOCK_DEPTH) {
+			break;
+		}
+		ok &= get_block_shares(b,
+			[this, h](uint64_t anchor_height, Wallet* w, uint64_t weight)
+			{
+				if (anchor_height == h) {
+					pplns_add(w, weight, false);
+				}
+			});
+		ok &= get_block_difficulty_data(b,
+			[this, h](uint64_t anchor_height, uint64_t timestamp, const difficulty_type& d)
+			{
+				if (anchor_height == h) {
+					m_difficultyWindow.insert(timestamp, d);
+				}
+			});
+	}
+
+	return ok;
+}
+
+bool SideChain::pplns_move_to(PoolBlock* tip)
+{
+	if (m_pplnsWindow.empty()) {
+		return pplns_rebuild(tip);
+	}
+
+	// Rebuilding from scratch is cheaper when the new tip is too far away from the current one
+	const uint64_t max_steps = std::max<uint64_t>(m_chainWindowSize / 8, UNCLE_BLOCK_DEPTH * 2);
+
+	// Rewind to the common ancestor, collecting blocks which need to be added after it
+	std::vector<PoolBlock*> new_blocks;
+	PoolBlock* cur = tip;
+	uint64_t num_steps = 0;
+
+	while (m_pplnsWindow.back() != cur) {
+		if (++num_steps > max_steps) {
+			return pplns_rebuild(tip);
+		}
+
+		if (cur->m_sidechainHeight > m_pplnsWindow.back()->m_sidechainHeight) {
+			new_blocks.push_back(cur);
+			cur = get_parent(cur);
+			if (!cur) {
+				return pplns_rebuild(tip);
+			}
+		}
+		else if (!pplns_rewind() || m_pplnsWindow.empty()) {
+			return pplns_rebuild(tip);
 		}
 	}
 
-	shares.resize(k + 1);
+	for (auto it = new_blocks.rbegin(); it != new_blocks.rend(); ++it) {
+		if (!pplns_advance(*it)) {
+			return pplns_rebuild(tip);
+		}
+	}
 
-	LOGINFO(5, "get_shares: " << k + 1 << " unique wallets in PPLNS window");
 	return true;
 }
 
-bool SideChain::block_seen(const PoolBlock& block)
+void SideChain::pplns_reset()
 {
-	MutexLock lock(m_sidechainLock);
-	return !m_seenBlocks.insert(block.m_sidechainId).second;
+	m_pplnsWindow.clear();
+	m_pplnsShares.clear();
+	m_difficultyWindow.clear();
 }
 
-bool SideChain::add_external_block(PoolBlock& block, std::vector<hash>& missing_blocks)
+size_t SideChain::get_seen_block_bucket(const hash& id) const
 {
-	if (block.m_difficulty < m_minDifficulty) {
-		LOGWARN(3, "add_external_block: block has invalid difficulty " << block.m_difficulty << ", expected >= " << m_minDifficulty);
+	const uint64_t* data = reinterpret_cast<const uint64_t*>(id.h);
+
+	// Bucket index is salted to make it harder to flood a single bucket with crafted ids
+	static_assert(SEEN_BLOCKS_BUCKETS == (1 << (64 - 51)), "bucket index has the wrong number of bits");
+	return static_cast<size_t>(((data[0] ^ m_seenBlocksSalt) * 0x9E3779B97F4A7C15ULL) >> 51) * SEEN_BLOCKS_WAYS;
+}
+
+hash SideChain::get_pow_cache_key(const PoolBlock& block)
+{
+	uint8_t buf[HASH_SIZE + sizeof(uint32_t) * 2];
+	memcpy(buf, block.m_sidechainId.h, HASH_SIZE);
+	memcpy(buf + HASH_SIZE, &block.m_nonce, sizeof(uint32_t));
+	memcpy(buf + HASH_SIZE + sizeof(uint32_t), &block.m_extraNonce, sizeof(uint32_t));
+
+	hash key;
+	keccak(buf, static_cast<int>(sizeof(buf)), key.h, HASH_SIZE);
+	return key;
+}
+
+bool SideChain::get_cached_pow_hash(const PoolBlock& block, hash& seed, hash& pow_hash)
+{
+	const hash key = get_pow_cache_key(block);
+
+	MutexLock lock(m_powCacheLock);
+
+	auto it = m_powCache.find(key);
+	if (it == m_powCache.end()) {
 		return false;
 	}
 
-	difficulty_type min_accepted_diff;
-	{
-		MutexLock lock(m_sidechainLock);
-		if (m_blocksById.find(block.m_sidechainId) != m_blocksById.end()) {
-			LOGINFO(4, "add_external_block: block " << block.m_sidechainId << " is already added");
+	seed = it->second.seed;
+	pow_hash = it->second.pow_hash;
+	return true;
+}
+
+void SideChain::add_cached_pow_hash(const PoolBlock& block, const hash& seed, const hash& pow_hash)
+{
+	const hash key = get_pow_cache_key(block);
+
+	// Enough for all blocks which are not pruned yet
+	const size_t max_size = static_cast<size_t>(m_chainWindowSize) * 4;
+
+	MutexLock lock(m_powCacheLock);
+
+	auto result = m_powCache.emplace(key, PowCacheEntry{ seed, pow_hash });
+	if (!result.second) {
+		result.first->second = PowCacheEntry{ seed, pow_hash };
+		return;
+	}
+
+	m_powCacheOrder.push_back(key);
+
+	while (m_powCacheOrder.size() > max_size) {
+		m_powCache.erase(m_powCacheOrder.front());
+		m_powCacheOrder.pop_front();
+	}
+}
+
+bool SideChain::get_pow_hash(PoolBlock& block, const hash& seed, hash& pow_hash, bool* from_cache)
+{
+	hash cached_seed;
+	if (get_cached_pow_hash(block, cached_seed, pow_hash) && (cached_seed == seed)) {
+		if (from_cache) {
+			*from_cache = true;
+		}
+		return true;
+	}
+
+	if (!block.get_pow_hash(m_pool->hasher(), seed, pow_hash)) {
+		return false;
+	}
+
+	// Only results that pass the PoW check are cached, so invalid blocks can't push out the useful ones
+	if (block.m_difficulty.check_pow(pow_hash)) {
+		add_cached_pow_hash(block, seed, pow_hash);
+	}
+
+	return true;
+}
+
+bool SideChain::block_seen(const PoolBlock& block)
+{
+	SeenBlock* slots = m_seenBlocks.data() + get_seen_block_bucket(block.m_sidechainId);
+	SeenBlock* oldest = slots;
+
+	MutexLock lock(m_seenBlocksLock);
+
+	for (size_t i = 0; i < SEEN_BLOCKS_WAYS; ++i) {
+		if (slots[i].order && (slots[i].id == block.m_sidechainId)) {
 			return true;
 		}
+		if (slots[i].order < oldest->order) {
+			oldest = slots + i;
+		}
+	}
 
-		// Find the minimum difficulty in the current PPLNS window
-		min_accepted_diff = m_curDifficulty;
-		for (PoolBlock* tmp = m_chainTip; tmp && (tmp->m_sidechainHeight + m_chainWindowSize > m_chainTip->m_sidechainHeight); tmp = get_parent(tmp)) {
-			if (tmp->m_difficulty < min_accepted_diff) {
-				min_accepted_diff = tmp->m_difficulty;
-			}
+	// Empty slots have the lowest order, so they're used before anything is evicted
+	oldest->id = block.m_sidechainId;
+	oldest->order = ++m_seenBlocksCounter;
+	return false;
+}
+
+bool SideChain::block_seen(const hash& id)
+{
+	const SeenBlock* slots = m_seenBlocks.data() + get_seen_block_bucket(id);
+
+	MutexLock lock(m_seenBlocksLock);
+
+	for (size_t i = 0; i < SEEN_BLOCKS_WAYS; ++i) {
+		if (slots[i].order && (slots[i].id == id)) {
+			return true;
 		}
 	}
 
-	LOGINFO(4, "add_external_block: height = " << block.m_sidechainHeight << ", id = " << block.m_sidechainId << ", mainchain height = " << block.m_txinGenHeight);
+	return false;
+}
+
+bool SideChain::pre_validate_external_block(const PoolBlock& block, bool& ignore) const
+{
+	ignore = false;
+
+	// Stage 1: checks which don't need any other blocks
+
+	if (block.m_difficulty < m_minDifficulty) {
+		LOGWARN(3, "add_external_block: block has invalid difficulty " << block.m_difficulty << ", expected >= " << m_minDifficulty);
+		return false;
+	}
+
+	ReadLock lock(m_sidechainLock);
+
+	// Stage 2: duplicates and blocks which are too old to be useful
+
+	if (m_blocksById.find(block.m_sidechainId) != m_blocksById.end()) {
+		LOGINFO(4, "add_external_block: block " << block.m_sidechainId << " is already added");
+		ignore = true;
+		return true;
+	}
+
+	if (!m_chainTip) {
+		return true;
+	}
+
+	const uint64_t tip_height = m_chainTip->m_sidechainHeight;
+
+	// It would be pruned right after it's added
+	const uint64_t prune_distance = m_chainWindowSize * 2 + 120 / m_targetBlockTime;
+	if (block.m_sidechainHeight + prune_distance <= tip_height) {
+		LOGINFO(4, "add_external_block: block " << block.m_sidechainId << " at height " << block.m_sidechainHeight << " is too old, ignoring it");
+		ignore = true;
+		return true;
+	}
+
+	// Stage 3: difficulty bounds
+
+	// Find the minimum difficulty in the current PPLNS window
+	difficulty_type min_accepted_diff = m_curDifficulty;
+	for (const PoolBlock* tmp = m_chainTip; tmp && (tmp->m_sidechainHeight + m_chainWindowSize > tip_height); tmp = get_parent(tmp)) {
+		if (tmp->m_difficulty < min_accepted_diff) {
+			min_accepted_diff = tmp->m_difficulty;
+		}
+	}
 
 	// Reduce it by 50% to account for alternative chains. This is mainly an anti-spam measure, not an actual verification step
 	min_accepted_diff.lo = (min_accepted_diff.lo >> 1) | (min_accepted_diff.hi << 63);
@@ -375,9 +845,28 @@ bool SideChain::add_external_block(PoolBlock& block, std::vector<hash>& missing_
 
 	if (block.m_difficulty < min_accepted_diff) {
 		LOGWARN(4, "add_external_block: block has too low difficulty " << block.m_difficulty << ", expected >= " << min_accepted_diff << ". Ignoring it.");
+		ignore = true;
 		return true;
 	}
 
+	// Consensus checks which need the parent and uncles (height, cumulative difficulty, invalid parent) and genesis block rules are left to verify()
+	// A block failing them must still be added and marked as invalid, so its descendants become invalid too instead of waiting for it forever
+
+	return true;
+}
+
+bool SideChain::add_external_block(PoolBlock&& block, std::vector<hash>& missing_blocks)
+{
+	bool ignore;
+	if (!pre_validate_external_block(block, ignore)) {
+		return false;
+	}
+	if (ignore) {
+		return true;
+	}
+
+	LOGINFO(4, "add_external_block: height = " << block.m_sidechainHeight << ", id = " << block.m_sidechainId << ", mainchain height = " << block.m_txinGenHeight);
+
 	// This check is not always possible to perform because of mainchain reorgs
 	ChainMain data;
 	if (m_pool->chainmain_get_by_hash(block.m_prevId, data)) {
@@ -397,7 +886,7 @@ bool SideChain::add_external_block(PoolBlock& block, std::vector<hash>& missing_
 	}
 
 	hash pow_hash;
-	if (!block.get_pow_hash(m_pool->hasher(), seed, pow_hash)) {
+	if (!get_pow_hash(block, seed, pow_hash)) {
 		LOGWARN(3, "add_external_block: couldn't get PoW hash for height = " << block.m_sidechainHeight << ", mainchain height " << block.m_txinGenHeight);
 		return false;
 	}
@@ -409,7 +898,7 @@ bool SideChain::add_external_block(PoolBlock& block, std::vector<hash>& missing_
 
 	missing_blocks.clear();
 	{
-		MutexLock lock(m_sidechainLock);
+		ReadLock lock(m_sidechainLock);
 		if (!block.m_parent.empty() && (m_blocksById.find(block.m_parent) == m_blocksById.end())) {
 			missing_blocks.push_back(block.m_parent);
 		}
@@ -421,7 +910,7 @@ bool SideChain::add_external_block(PoolBlock& block, std::vector<hash>& missing_
 		}
 	}
 
-	add_block(block);
+	add_block(std::move(block));
 	return true;
 }
 
@@ -433,44 +922,93 @@ void SideChain::add_block(const PoolBlock& block)
 		", verified = " << (block.m_verified ? 1 : 0)
 	);
 
-	PoolBlock* new_block = new PoolBlock(block);
+	insert_block(m_blockArena.create(block));
+}
 
-	MutexLock lock(m_sidechainLock);
+void SideChain::add_block(PoolBlock&& block)
+{
+	LOGINFO(3, "add_block: height = " << block.m_sidechainHeight <<
+		", id = " << block.m_sidechainId <<
+		", mainchain height = " << block.m_txinGenHeight <<
+		", verified = " << (block.m_verified ? 1 : 0)
+	);
 
-	auto result = m_blocksById.insert({ new_block->m_sidechainId, new_block });
-	if (!result.second) {
-		LOGWARN(3, "add_block: trying to add the same block twice, id = "
-			<< new_block->m_sidechainId << ", sidechain height = "
-			<< new_block->m_sidechainHeight << ", height = "
-			<< new_block->m_txinGenHeight);
+	insert_block(m_blockArena.create(std::move(block)));
+}
 
-		delete new_block;
-		return;
+void SideChain::insert_block(PoolBlock* new_block)
+{
+	// The block is not visible to other threads yet, so it's written to the cache file before m_sidechainLock is taken
+	// BlockCache::store() skips blocks which are already there
+	if (m_blockCache) {
+		hash seed, pow_hash;
+		if (get_cached_pow_hash(*new_block, seed, pow_hash)) {
+			m_blockCache->store(*new_block, &seed, &pow_hash);
+		}
+		else {
+			m_blockCache->store(*new_block);
+		}
 	}
 
-	m_blocksByHeight[new_block->m_sidechainHeight].push_back(new_block);
+	{
+		WriteLock lock(m_sidechainLock);
+
+		auto result = m_blocksById.insert({ new_block->m_sidechainId, new_block });
+		if (!result.second) {
+			LOGWARN(3, "add_block: trying to add the same block twice, id = "
+				<< new_block->m_sidechainId << ", sidechain height = "
+				<< new_block->m_sidechainHeight << ", height = "
+				<< new_block->m_txinGenHeight);
+
+			m_blockArena.destroy(new_block);
+			return;
+		}
+
+		m_blocksByHeight[new_block->m_sidechainHeight].push_back(new_block);
 
-	update_depths(new_block);
+		update_depths(new_block);
 
-	if (new_block->m_verified) {
-		if (!new_block->m_invalid) {
-			update_chain_tip(new_block);
+		if (new_block->m_verified) {
+			if (!new_block->m_invalid) {
+				update_chain_tip(new_block);
+			}
+		}
+		else {
+			verify_loop(new_block);
 		}
 	}
-	else {
-		verify_loop(new_block);
+
+	compact_block_cache();
+}
+
+void SideChain::compact_block_cache()
+{
+	if (m_blockCache && m_blockCacheCompactPending.exchange(false)) {
+		m_blockCache->compact();
 	}
 }
 
+uint64_t SideChain::chain_tip_height() const
+{
+	ReadLock lock(m_sidechainLock);
+	return m_chainTip ? m_chainTip->m_sidechainHeight : 0;
+}
+
+bool SideChain::is_chain_tip(const hash& id) const
+{
+	ReadLock lock(m_sidechainLock);
+	return m_chainTip && (m_chainTip->m_sidechainId == id);
+}
+
 bool SideChain::has_block(const hash& id)
 {
-	MutexLock lock(m_sidechainLock);
+	ReadLock lock(m_sidechainLock);
 	return m_blocksById.find(id) != m_blocksById.end();
 }
 
 bool SideChain::get_block_blob(const hash& id, std::vector<uint8_t>& blob)
 {
-	MutexLock lock(m_sidechainLock);
+	ReadLock lock(m_sidechainLock);
 
 	PoolBlock* block = nullptr;
 
@@ -496,6 +1034,55 @@ bool SideChain::get_block_blob(const hash& id, std::vector<uint8_t>& blob)
 	return true;
 }
 
+void SideChain::get_block_range_blobs(const hash& id, uint32_t count, std::vector<std::vector<uint8_t>>& blobs)
+{
+	blobs.clear();
+
+	ReadLock lock(m_sidechainLock);
+
+	std::vector<PoolBlock*> blocks;
+	blocks.reserve(count + count / 4);
+
+	auto it = m_blocksById.find(id);
+	PoolBlock* block = (it != m_blocksById.end()) ? it->second : nullptr;
+
+	for (uint32_t i = 0; block && (i < count); ++i) {
+		blocks.push_back(block);
+
+		for (const hash& uncle_id : block->m_uncles) {
+			it = m_blocksById.find(uncle_id);
+			if (it != m_blocksById.end()) {
+				blocks.push_back(it->second);
+			}
+		}
+
+		block = get_parent(block);
+	}
+
+	// Oldest first, so the receiver always has the parent when it adds a block
+	std::sort(blocks.begin(), blocks.end(),
+		[](const PoolBlock* a, const PoolBlock* b)
+		{
+			if (a->m_sidechainHeight != b->m_sidechainHeight) {
+				return a->m_sidechainHeight < b->m_sidechainHeight;
+			}
+			return std::less<const PoolBlock*>()(a, b);
+		});
+
+	blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+
+	blobs.resize(blocks.size());
+
+	for (size_t i = 0, n = blocks.size(); i < n; ++i) {
+		const PoolBlock* b = blocks[i];
+		std::vector<uint8_t>& blob = blobs[i];
+
+		blob.reserve(b->m_mainChainData.size() + b->m_sideChainData.size());
+		blob = b->m_mainChainData;
+		blob.insert(blob.end(), b->m_sideChainData.begin(), b->m_sideChainData.end());
+	}
+}
+
 bool SideChain::get_outputs_blob(PoolBlock* block, uint64_t total_reward, std::vector<uint8_t>& blob)
 {
 	std::vector<MinerShare> shares;
@@ -504,9 +1091,16 @@ bool SideChain::get_outputs_blob(PoolBlock* block, uint64_t total_reward, std::v
 	shares.reserve(m_chainWindowSize * 2);
 	rewards.reserve(m_chainWindowSize * 2);
 
-	MutexLock lock(m_sidechainLock);
+	ReadLock lock(m_sidechainLock);
 
-	if (!get_shares(block, shares) || !split_reward(total_reward, shares, rewards) || (rewards.size() != shares.size())) {
+	{
+		MutexLock lock2(m_pplnsLock);
+		if (!get_shares(block, shares)) {
+			return false;
+		}
+	}
+
+	if (!split_reward(total_reward, shares, rewards) || (rewards.size() != shares.size())) {
 		return false;
 	}
 
@@ -520,16 +1114,16 @@ bool SideChain::get_outputs_blob(PoolBlock* block, uint64_t total_reward, std::v
 	block->m_outputs.clear();
 	block->m_outputs.reserve(n);
 
-	hash eph_public_key;
+	std::vector<hash> eph_public_keys;
+	get_eph_public_keys(block->m_txkeySec, shares, eph_public_keys);
+
 	for (size_t i = 0; i < n; ++i) {
 		writeVarint(rewards[i], blob);
 
 		blob.emplace_back(TXOUT_TO_KEY);
+		blob.insert(blob.end(), eph_public_keys[i].h, eph_public_keys[i].h + HASH_SIZE);
 
-		shares[i].m_wallet->get_eph_public_key(block->m_txkeySec, i, eph_public_key);
-		blob.insert(blob.end(), eph_public_key.h, eph_public_key.h + HASH_SIZE);
-
-		block->m_outputs.emplace_back(rewards[i], eph_public_key);
+		block->m_outputs.emplace_back(rewards[i], eph_public_keys[i]);
 	}
 
 	return true;
@@ -537,6 +1131,8 @@ bool SideChain::get_outputs_blob(PoolBlock* block, uint64_t total_reward, std::v
 
 void SideChain::print_status()
 {
+	ReadLock lock(m_sidechainLock);
+
 	uint64_t rem;
 	uint64_t pool_hashrate = udiv128(m_curDifficulty.hi, m_curDifficulty.lo, m_targetBlockTime, &rem);
 
@@ -592,7 +1188,11 @@ void SideChain::print_status()
 	if (m_chainTip) {
 		std::sort(blocks_in_window.begin(), blocks_in_window.end());
 		for (uint64_t i = 0; (i < m_chainWindowSize) && (i <= tip_height); ++i) {
-			for (PoolBlock* block : m_blocksByHeight[tip_height - i]) {
+			auto it = m_blocksByHeight.find(tip_height - i);
+			if (it == m_blocksByHeight.end()) {
+				continue;
+			}
+			for (PoolBlock* block : it->second) {
 				if (!std::binary_search(blocks_in_window.begin(), blocks_in_window.end(), block->m_sidechainId)) {
 					LOGINFO(4, "orphan block at height " << log::Gray() << block->m_sidechainHeight << log::NoColor() << ": " << log::Gray() << block->m_sidechainId);
 					++total_orphans;
@@ -617,6 +1217,22 @@ void SideChain::print_status()
 	LOGINFO(0, "background jobs running: " << num_running_jobs.load());
 }
 
+void SideChain::get_eph_public_keys(const hash& txkey_sec, const std::vector<MinerShare>& shares, std::vector<hash>& eph_public_keys)
+{
+	const size_t n = shares.size();
+
+	std::vector<hash> view_keys, spend_keys;
+	view_keys.reserve(n);
+	spend_keys.reserve(n);
+
+	for (const MinerShare& share : shares) {
+		view_keys.emplace_back(share.m_wallet->view_public_key());
+		spend_keys.emplace_back(share.m_wallet->spend_public_key());
+	}
+
+	derive_eph_public_keys(txkey_sec, view_keys, spend_keys, eph_public_keys);
+}
+
 bool SideChain::split_reward(uint64_t reward, const std::vector<MinerShare>& shares, std::vector<uint64_t>& rewards)
 {
 	const size_t num_shares = shares.size();
@@ -650,7 +1266,47 @@ bool SideChain::split_reward(uint64_t reward, const std::vector<MinerShare>& sha
 	return true;
 }
 
-bool SideChain::get_difficulty(PoolBlock* tip, std::vector<DifficultyData>& difficultyData, difficulty_type& curDifficulty) const
+bool SideChain::get_difficulty(PoolBlock* tip, std::vector<DifficultyData>& difficultyData, difficulty_type& curDifficulty)
+{
+	if (!pplns_move_to(tip)) {
+		return recalculate_difficulty(tip, difficultyData, curDifficulty);
+	}
+
+	const uint64_t n = m_difficultyWindow.size();
+	const uint64_t oldest_timestamp = m_difficultyWindow.timestamp_at(0);
+
+	// Full recalculation works with 32-bit timestamp offsets, so it must be used when they don't fit
+	if (m_difficultyWindow.timestamp_at(n - 1) - oldest_timestamp > std::numeric_limits<uint32_t>::max()) {
+		return recalculate_difficulty(tip, difficultyData, curDifficulty);
+	}
+
+	// Discard 10% oldest and 10% newest (by timestamp) blocks
+	const uint64_t cut_size = (n + 9) / 10;
+	const uint64_t timestamp1 = m_difficultyWindow.timestamp_at(cut_size - 1);
+	const uint64_t timestamp2 = m_difficultyWindow.timestamp_at(n - cut_size);
+
+	difficulty_type diff1, diff2;
+	if (!m_difficultyWindow.get_range(timestamp1, timestamp2, diff1, diff2)) {
+		return recalculate_difficulty(tip, difficultyData, curDifficulty);
+	}
+
+	if (!calculate_difficulty(tip, timestamp1, timestamp2, diff1, diff2, curDifficulty)) {
+		return false;
+	}
+
+#if SIDECHAIN_DIFFICULTY_DEBUG
+	difficulty_type check_diff;
+	if (!recalculate_difficulty(tip, difficultyData, check_diff) || (check_diff != curDifficulty)) {
+		LOGERR(1, "get_difficulty: incremental calculation doesn't match full recalculation for block at height = " << tip->m_sidechainHeight <<
+			", id = " << tip->m_sidechainId << ": got " << curDifficulty << ", expected " << check_diff << ". Fix the code!");
+		curDifficulty = check_diff;
+	}
+#endif
+
+	return true;
+}
+
+bool SideChain::recalculate_difficulty(PoolBlock* tip, std::vector<DifficultyData>& difficultyData, difficulty_type& curDifficulty) const
 {
 	difficultyData.clear();
 
@@ -717,8 +1373,6 @@ bool SideChain::get_difficulty(PoolBlock* tip, std::vector<DifficultyData>& diff
 	std::nth_element(tmpTimestamps.begin(), tmpTimestamps.begin() + index2, tmpTimestamps.end());
 	const uint64_t timestamp2 = oldest_timestamp + tmpTimestamps[index2];
 
-	const uint64_t delta_t = (timestamp2 > timestamp1) ? (timestamp2 - timestamp1) : 1;
-
 	difficulty_type diff1{ std::numeric_limits<uint64_t>::max(), std::numeric_limits<uint64_t>::max() };
 	difficulty_type diff2{ 0, 0 };
 
@@ -733,6 +1387,13 @@ bool SideChain::get_difficulty(PoolBlock* tip, std::vector<DifficultyData>& diff
 		}
 	}
 
+	return calculate_difficulty(tip, timestamp1, timestamp2, diff1, diff2, curDifficulty);
+}
+
+bool SideChain::calculate_difficulty(const PoolBlock* tip, uint64_t timestamp1, uint64_t timestamp2, const difficulty_type& diff1, const difficulty_type& diff2, difficulty_type& curDifficulty) const
+{
+	const uint64_t delta_t = (timestamp2 > timestamp1) ? (timestamp2 - timestamp1) : 1;
+
 	// This is correct as long as the difference between two 128-bit difficulties is less than 2^64, even if it wraps
 	const uint64_t delta_diff = diff2.lo - diff1.lo;
 
@@ -759,8 +1420,12 @@ void SideChain::verify_loop(PoolBlock* block)
 {
 	// PoW is already checked at this point
 
+	// Blocks are checked in dependency order here, but output public keys (the most expensive part of verification) are checked later
+	// Key checks don't depend on other blocks, so they can run on all cores in parallel
+	// Blocks built on top of a block with pending key check are verified as if it was valid, and invalidated later if it wasn't
 	std::vector<PoolBlock*> blocks_to_verify(1, block);
-	PoolBlock* highest_block = nullptr;
+	std::vector<PoolBlock*> verified_blocks;
+	std::vector<OutputsCheck> outputs_checks;
 
 	while (!blocks_to_verify.empty()) {
 		block = blocks_to_verify.back();
@@ -770,7 +1435,8 @@ void SideChain::verify_loop(PoolBlock* block)
 			continue;
 		}
 
-		verify(block);
+		std::vector<MinerShare> shares;
+		verify(block, shares);
 
 		if (!block->m_verified) {
 			LOGINFO(5, "not enough data to verify block at height = " << block->m_sidechainHeight <<
@@ -783,54 +1449,208 @@ void SideChain::verify_loop(PoolBlock* block)
 			LOGWARN(3, "block at height = " << block->m_sidechainHeight <<
 				", id = " << block->m_sidechainId <<
 				", mainchain height = " << block->m_txinGenHeight << " is invalid");
+			continue;
 		}
-		else {
-			LOGINFO(3, "verified block at height = " << block->m_sidechainHeight <<
-				", depth = " << block->m_depth <<
-				", id = " << block->m_sidechainId <<
-				", mainchain height = " << block->m_txinGenHeight);
 
-			// This block is now verified
+		verified_blocks.push_back(block);
+
+		if (!shares.empty()) {
+			outputs_checks.push_back({ block, std::move(shares), true });
+		}
 
-			if (is_longer_chain(highest_block, block)) {
-				highest_block = block;
+		// Try to verify blocks on top of this one
+		for (size_t i = 1; i <= UNCLE_BLOCK_DEPTH; ++i) {
+			auto it = m_blocksByHeight.find(block->m_sidechainHeight + i);
+			if (it == m_blocksByHeight.end()) {
+				continue;
 			}
-			else if (highest_block && (highest_block->m_sidechainHeight > block->m_sidechainHeight)) {
-				LOGINFO(4, "block " << highest_block->m_sidechainId <<
-					", height = " << highest_block->m_sidechainHeight <<
-					" is not a longer chain than " << block->m_sidechainId <<
-					", height " << block->m_sidechainHeight);
+
+			const std::vector<PoolBlock*>& next_blocks = it->second;
+			if (!next_blocks.empty()) {
+				blocks_to_verify.insert(blocks_to_verify.end(), next_blocks.begin(), next_blocks.end());
 			}
+		}
+	}
+
+	run_outputs_checks(outputs_checks);
 
-			// If it came through a broadcast, send it to our peers
-			if (block->m_wantBroadcast && !block->m_broadcasted) {
-				block->m_broadcasted = true;
-				m_pool->p2p_server()->broadcast(*block);
+	bool any_invalid = false;
+	for (const OutputsCheck& c : outputs_checks) {
+		if (!c.valid) {
+			c.block->m_invalid = true;
+			any_invalid = true;
+		}
+	}
+
+	// Blocks which have an invalid parent or uncle are also invalid
+	if (any_invalid) {
+		std::sort(verified_blocks.begin(), verified_blocks.end(), [](const PoolBlock* a, const PoolBlock* b) { return a->m_sidechainHeight < b->m_sidechainHeight; });
+
+		for (PoolBlock* b : verified_blocks) {
+			if (b->m_invalid) {
+				continue;
 			}
 
-			// Try to verify blocks on top of this one
-			for (size_t i = 1; i <= UNCLE_BLOCK_DEPTH; ++i) {
-				auto it = m_blocksByHeight.find(block->m_sidechainHeight + i);
-				if (it == m_blocksByHeight.end()) {
-					continue;
-				}
+			PoolBlock* parent = get_parent(b);
+			if (parent && parent->m_invalid) {
+				b->m_invalid = true;
+				continue;
+			}
 
-				const std::vector<PoolBlock*>& next_blocks = it->second;
-				if (!next_blocks.empty()) {
-					blocks_to_verify.insert(blocks_to_verify.end(), next_blocks.begin(), next_blocks.end());
+			for (const hash& uncle_id : b->m_uncles) {
+				auto it = m_blocksById.find(uncle_id);
+				if ((it != m_blocksById.end()) && it->second->m_invalid) {
+					b->m_invalid = true;
+					break;
 				}
 			}
 		}
 	}
 
+	PoolBlock* highest_block = nullptr;
+
+	for (PoolBlock* b : verified_blocks) {
+		if (b->m_invalid) {
+			LOGWARN(3, "block at height = " << b->m_sidechainHeight <<
+				", id = " << b->m_sidechainId <<
+				", mainchain height = " << b->m_txinGenHeight << " is invalid");
+			continue;
+		}
+
+		LOGINFO(3, "verified block at height = " << b->m_sidechainHeight <<
+			", depth = " << b->m_depth <<
+			", id = " << b->m_sidechainId <<
+			", mainchain height = " << b->m_txinGenHeight);
+
+		if (is_longer_chain(highest_block, b)) {
+			highest_block = b;
+		}
+		else if (highest_block && (highest_block->m_sidechainHeight > b->m_sidechainHeight)) {
+			LOGINFO(4, "block " << highest_block->m_sidechainId <<
+				", height = " << highest_block->m_sidechainHeight <<
+				" is not a longer chain than " << b->m_sidechainId <<
+				", height " << b->m_sidechainHeight);
+		}
+
+		// If it came through a broadcast, send it to our peers
+		if (b->m_wantBroadcast && !b->m_broadcasted) {
+			b->m_broadcasted = true;
+			m_pool->p2p_server()->broadcast(*b);
+		}
+	}
+
 	if (highest_block) {
 		update_chain_tip(highest_block);
 	}
+}
+
+struct SideChain::OutputsCheckBatch : public nocopy_nomove
+{
+	explicit OutputsCheckBatch(std::vector<OutputsCheck>* checks) : m_checks(checks), m_next(0), m_running(0)
+	{
+		uv_mutex_init_checked(&m_lock);
+		uv_cond_init(&m_doneCond);
+	}
+
+	~OutputsCheckBatch()
+	{
+		uv_cond_destroy(&m_doneCond);
+		uv_mutex_destroy(&m_lock);
+	}
+
+	// Set to nullptr when the calling thread is done with the batch
+	std::vector<OutputsCheck>* m_checks;
+	std::atomic<size_t> m_next;
+
+	uv_mutex_t m_lock;
+	uv_cond_t m_doneCond;
+	uint32_t m_running;
+};
+
+void SideChain::run_outputs_checks(std::vector<OutputsCheck>& checks)
+{
+	HashingExecutor* executor = m_pool->hashing_executor();
+
+	const uint32_t num_threads = executor ? std::min<uint32_t>(executor->num_threads(), static_cast<uint32_t>(checks.size() / MIN_OUTPUTS_CHECKS_PER_THREAD)) : 0;
+
+	if (num_threads < 2) {
+		for (OutputsCheck& c : checks) {
+			c.valid = verify_outputs(c.block, c.shares);
+		}
+		return;
+	}
+
+	LOGINFO(4, "using up to " << num_threads << " threads to check outputs of " << checks.size() << " blocks");
+
+	// Helpers can still be queued when this function returns, so they share ownership of the batch
+	std::shared_ptr<OutputsCheckBatch> batch = std::make_shared<OutputsCheckBatch>(&checks);
+
+	struct Work
+	{
+		uv_work_t req;
+		std::shared_ptr<OutputsCheckBatch> batch;
+		const SideChain* side_chain;
+	};
+
+	// The calling thread holds m_sidechainLock, so helpers go before the sync backlog
+	for (uint32_t i = 1; i < num_threads; ++i) {
+		Work* work = new Work{ {}, batch, this };
+		work->req.data = work;
+
+		const int err = executor->queue_work(nullptr, &work->req, HashingExecutor::Priority::TIP_BLOCK,
+			[](uv_work_t* req)
+			{
+				Work* work = reinterpret_cast<Work*>(req->data);
+				OutputsCheckBatch& batch = *work->batch;
+
+				std::vector<OutputsCheck>* checks;
+				{
+					MutexLock lock(batch.m_lock);
+					checks = batch.m_checks;
+					if (!checks) {
+						return;
+					}
+					++batch.m_running;
+				}
+
+				work->side_chain->do_outputs_checks(*checks, batch.m_next);
+
+				MutexLock lock(batch.m_lock);
+				if (--batch.m_running == 0) {
+					uv_cond_signal(&batch.m_doneCond);
+				}
+			},
+			[](uv_work_t* req, int /*status*/)
+			{
+				delete reinterpret_cast<Work*>(req->data);
+			});
+
+		// The queue is full, the calling thread will do the rest
+		if (err) {
+			delete work;
+			break;
+		}
+	}
+
+	do_outputs_checks(checks, batch->m_next);
+
+	// Helpers which didn't start yet will skip this batch, wait for the ones that did
+	MutexLock lock(batch->m_lock);
+	batch->m_checks = nullptr;
+	while (batch->m_running > 0) {
+		uv_cond_wait(&batch->m_doneCond, &batch->m_lock);
+	}
+}
 
-	return;
+void SideChain::do_outputs_checks(std::vector<OutputsCheck>& checks, std::atomic<size_t>& next) const
+{
+	for (size_t k = next.fetch_add(1); k < checks.size(); k = next.fetch_add(1)) {
+		OutputsCheck& c = checks[k];
+		c.valid = verify_outputs(c.block, c.shares);
+	}
 }
 
-void SideChain::verify(PoolBlock* block)
+void SideChain::verify(PoolBlock* block, std::vector<MinerShare>& shares)
 {
 	// Genesis block
 	if (block->m_sidechainHeight == 0) {
@@ -1051,8 +1871,8 @@ void SideChain::verify(PoolBlock* block)
 		return;
 	}
 
-	std::vector<MinerShare> shares;
 	if (!get_shares(block, shares)) {
+		shares.clear();
 		block->m_invalid = true;
 		return;
 	}
@@ -1093,22 +1913,28 @@ void SideChain::verify(PoolBlock* block)
 			block->m_invalid = true;
 			return;
 		}
+	}
 
-		hash eph_public_key;
-		shares[i].m_wallet->get_eph_public_key(block->m_txkeySec, i, eph_public_key);
+	// All checks passed, output public keys are checked by verify_outputs() later
+	block->m_invalid = false;
+}
+
+bool SideChain::verify_outputs(const PoolBlock* block, const std::vector<MinerShare>& shares) const
+{
+	std::vector<hash> eph_public_keys;
+	get_eph_public_keys(block->m_txkeySec, shares, eph_public_keys);
 
-		if (eph_public_key != block->m_outputs[i].m_ephPublicKey) {
+	for (size_t i = 0, n = shares.size(); i < n; ++i) {
+		if (eph_public_keys[i] != block->m_outputs[i].m_ephPublicKey) {
 			LOGWARN(3, "block at height = " << block->m_sidechainHeight <<
 				", id = " << block->m_sidechainId <<
 				", mainchain height = " << block->m_txinGenHeight <<
 				" pays out to a wrong wallet at index " << i);
-			block->m_invalid = true;
-			return;
+			return false;
 		}
 	}
 
-	// All checks passed
-	block->m_invalid = false;
+	return true;
 }
 
 void SideChain::update_chain_tip(PoolBlock* block)
@@ -1128,6 +1954,7 @@ void SideChain::update_chain_tip(PoolBlock* block)
 		if (get_difficulty(block, m_difficultyData, diff)) {
 			m_chainTip = block;
 			m_curDifficulty = diff;
+			update_tip_snapshot();
 
 			LOGINFO(2, "new chain tip: next height = " << log::Gray() << block->m_sidechainHeight + 1 << log::NoColor() <<
 				", next difficulty = " << log::Gray() << m_curDifficulty << log::NoColor() <<
@@ -1185,7 +2012,43 @@ void SideChain::update_chain_tip(PoolBlock* block)
 	}
 }
 
-PoolBlock* SideChain::get_parent(const PoolBlock* block)
+void SideChain::update_tip_snapshot()
+{
+	std::shared_ptr<ChainTipSnapshot> snapshot = std::make_shared<ChainTipSnapshot>();
+	ChainTipSnapshot& s = *snapshot;
+
+	s.m_tip = m_chainTip;
+	s.m_difficulty = m_curDifficulty;
+
+	if (!get_shares(m_chainTip, s.m_shares)) {
+		std::atomic_store(&m_tipSnapshot, std::shared_ptr<const ChainTipSnapshot>());
+		return;
+	}
+
+	// get_shares() leaves PPLNS window at the tip's parent, collect shares which leave the window when the next block is added
+	const uint64_t tip_height = m_chainTip->m_sidechainHeight;
+	if ((tip_height > 0) && (tip_height + 1 >= m_chainWindowSize)) {
+		const uint64_t h = tip_height + 1 - m_chainWindowSize;
+		auto collect = [h, &s](uint64_t anchor_height, Wallet* w, uint64_t weight)
+		{
+			if (anchor_height == h) {
+				add_share(s.m_expiringShares, w, weight);
+			}
+		};
+
+		for (PoolBlock* block : m_pplnsWindow) {
+			if (block->m_sidechainHeight > h + UNCLE_BLOCK_DEPTH) {
+				break;
+			}
+			get_block_shares(block, collect);
+		}
+		get_block_shares(m_chainTip, collect);
+	}
+
+	std::atomic_store(&m_tipSnapshot, std::shared_ptr<const ChainTipSnapshot>(std::move(snapshot)));
+}
+
+PoolBlock* SideChain::get_parent(const PoolBlock* block) const
 {
 	if (block) {
 		auto it = m_blocksById.find(block->m_parent);
@@ -1365,7 +2228,10 @@ void SideChain::prune_old_blocks()
 			auto it2 = m_blocksById.find(block->m_sidechainId);
 			if (it2 != m_blocksById.end()) {
 				m_blocksById.erase(it2);
-				delete block;
+				if (m_blockCache) {
+					m_blockCache->remove(block->m_sidechainId);
+				}
+				m_blockArena.destroy(block);
 				++num_blocks_pruned;
 			}
 			else {
@@ -1380,6 +2246,12 @@ void SideChain::prune_old_blocks()
 
 	if (num_blocks_pruned) {
 		LOGINFO(3, "pruned " << num_blocks_pruned << " old blocks at heights <= " << h);
+
+		if (!m_pplnsWindow.empty() && (m_pplnsWindow.front()->m_sidechainHeight <= h)) {
+			pplns_reset();
+		}
+
+		m_blockCacheCompactPending = true;
 	}
 }
 
@@ -1387,7 +2259,7 @@ void SideChain::get_missing_blocks(std::vector<hash>& missing_blocks)
 {
 	missing_blocks.clear();
 
-	MutexLock lock(m_sidechainLock);
+	ReadLock lock(m_sidechainLock);
 
 	for (auto& b : m_blocksById) {
 		if (b.second->m_verified) {
@@ -1406,6 +2278,148 @@ void SideChain::get_missing_blocks(std::vector<hash>& missing_blocks)
 	}
 }
 
+void SideChain::load_cached_blocks_async()
+{
+	if (!m_blockCache) {
+		return;
+	}
+
+	uv_work_t* req = new uv_work_t{};
+	req->data = this;
+
+	const int err = uv_queue_work(uv_default_loop(), req,
+		[](uv_work_t* req)
+		{
+			num_running_jobs.fetch_add(1);
+			reinterpret_cast<SideChain*>(req->data)->load_cached_blocks();
+		},
+		[](uv_work_t* req, int /*status*/)
+		{
+			delete req;
+			num_running_jobs.fetch_sub(1);
+		});
+
+	if (err) {
+		LOGERR(1, "load_cached_blocks_async: uv_queue_work failed, error " << uv_err_name(err));
+	}
+}
+
+void SideChain::load_cached_blocks()
+{
+	std::vector<PoolBlock*> blocks;
+	PoolBlock tmp;
+
+	m_blockCache->load_all(
+		[this, &blocks, &tmp](const uint8_t* data, size_t size, const hash* seed, const hash* pow_hash)
+		{
+			const int result = tmp.deserialize(data, size, *this);
+			if (result != 0) {
+				LOGWARN(3, "load_cached_blocks: couldn't deserialize cached block, error " << result);
+				return;
+			}
+			if (seed && pow_hash) {
+				add_cached_pow_hash(tmp, *seed, *pow_hash);
+			}
+			// Copying from a reused buffer keeps stored blocks at their actual size
+			blocks.push_back(m_blockArena.create(tmp));
+		});
+
+	if (blocks.empty()) {
+		return;
+	}
+
+	std::sort(blocks.begin(), blocks.end(), [](const PoolBlock* a, const PoolBlock* b) { return a->m_sidechainHeight < b->m_sidechainHeight; });
+
+	// Blocks in PPLNS window of the cached chain tip get their PoW checked again
+	// Deeper blocks were checked before they were cached and can't influence payouts anymore
+	const uint64_t tip_height = blocks.back()->m_sidechainHeight;
+	uint64_t num_pow_checks = 0;
+	uint64_t num_cached_pow = 0;
+	uint64_t num_deferred = 0;
+
+	blocks.erase(std::remove_if(blocks.begin(), blocks.end(),
+		[this, tip_height, &num_pow_checks, &num_cached_pow, &num_deferred](PoolBlock* block)
+		{
+			if (block->m_sidechainHeight + m_chainWindowSize <= tip_height) {
+				return false;
+			}
+
+			++num_pow_checks;
+
+			// Both RandomX caches are ready when this runs (see p2pool::on_hasher_ready), so it only fails for blocks with an unknown or outdated seed
+			hash seed, pow_hash;
+			bool from_cache = false;
+			const bool computed = m_pool->get_seed(block->m_txinGenHeight, seed) && get_pow_hash(*block, seed, pow_hash, &from_cache);
+
+			if (!computed) {
+				++num_deferred;
+				m_blockArena.destroy(block);
+				return true;
+			}
+
+			if (!block->m_difficulty.check_pow(pow_hash)) {
+				LOGWARN(3, "load_cached_blocks: PoW check failed for block " << block->m_sidechainId << " at height " << block->m_sidechainHeight);
+				m_blockArena.destroy(block);
+				return true;
+			}
+
+			if (from_cache) {
+				++num_cached_pow;
+			}
+
+			return false;
+		}), blocks.end());
+
+	if (num_deferred) {
+		LOGWARN(3, "load_cached_blocks: couldn't calculate PoW for " << num_deferred << " cached blocks, they will be downloaded from peers");
+	}
+
+	uint64_t num_blocks_added = 0;
+	uint64_t chain_tip_height = 0;
+	{
+		WriteLock lock(m_sidechainLock);
+
+		// Add blocks from top to bottom, so depths are calculated in one pass
+		for (auto it = blocks.rbegin(); it != blocks.rend(); ++it) {
+			PoolBlock* block = *it;
+
+			// Peers already know these blocks, don't broadcast them
+			block->m_broadcasted = true;
+
+			if (!m_blocksById.insert({ block->m_sidechainId, block }).second) {
+				m_blockArena.destroy(block);
+				*it = nullptr;
+				continue;
+			}
+
+			m_blocksByHeight[block->m_sidechainHeight].push_back(block);
+			update_depths(block);
+			++num_blocks_added;
+		}
+
+		// Blocks below PPLNS window of the cached chain tip were verified before they were cached, same as their PoW
+		// They only need to be there as parents and uncles for blocks in the window, so they skip verify() and verify_outputs()
+		for (PoolBlock* block : blocks) {
+			if (block && (block->m_sidechainHeight + m_chainWindowSize <= tip_height)) {
+				block->m_verified = true;
+				block->m_invalid = false;
+			}
+		}
+
+		for (PoolBlock* block : blocks) {
+			if (block && !block->m_verified) {
+				verify_loop(block);
+			}
+		}
+
+		chain_tip_height = m_chainTip ? m_chainTip->m_sidechainHeight : 0;
+	}
+
+	compact_block_cache();
+
+	LOGINFO(1, "loaded " << num_blocks_added << " cached blocks (" << num_pow_checks << " PoW checks, " << num_cached_pow << " of them from saved PoW hashes), chain tip height = " << chain_tip_height);
+}
+
 bool SideChain::load_config(const std::string& filename)
 {
 	if (filename.empty()) {
@@ -18,13 +18,17 @@
 #pragma once
 
 #include "uv_util.h"
+#include "difficulty_window.h"
+#include "pool_block.h"
 #include <map>
+#include <deque>
 #include <unordered_map>
-#include <unordered_set>
+#include <memory>
 
 namespace p2pool {
 
 class p2pool;
+class BlockCache;
 struct DifficultyData;
 struct PoolBlock;
 class Wallet;
@@ -38,6 +42,21 @@ struct MinerShare
 	Wallet* m_wallet;
 };
 
+// Chain tip and shares in its PPLNS window, a new one is built every time the chain tip changes
+// Block templates are built from it under a read lock, without moving the PPLNS window cache
+// Published snapshots are never modified, readers keep their own reference while they use it
+struct ChainTipSnapshot
+{
+	FORCEINLINE ChainTipSnapshot() : m_tip(nullptr), m_difficulty() {}
+
+	PoolBlock* m_tip;
+	difficulty_type m_difficulty;
+
+	// Both are sorted by wallet
+	std::vector<MinerShare> m_shares;
+	std::vector<MinerShare> m_expiringShares;
+};
+
 class SideChain
 {
 public:
@@ -47,12 +66,21 @@ public:
 	void fill_sidechain_data(PoolBlock& block, Wallet* w, const hash& txkeySec, std::vector<MinerShare>& shares);
 
 	bool block_seen(const PoolBlock& block);
-	bool add_external_block(PoolBlock& block, std::vector<hash>& missing_blocks);
+	// Doesn't mark the block as seen, so it can be used before the block's id is checked
+	bool block_seen(const hash& id);
+	// The block is moved into the sidechain if it passes all checks
+	bool add_external_block(PoolBlock&& block, std::vector<hash>& missing_blocks);
 	void add_block(const PoolBlock& block);
+	void add_block(PoolBlock&& block);
 	void get_missing_blocks(std::vector<hash>& missing_blocks);
 
+	void load_cached_blocks_async();
+
 	bool has_block(const hash& id);
+	bool is_chain_tip(const hash& id) const;
 	bool get_block_blob(const hash& id, std::vector<uint8_t>& blob);
+	// Blobs of the block, up to "count - 1" of its ancestors and their uncles, oldest first
+	void get_block_range_blobs(const hash& id, uint32_t count, std::vector<std::vector<uint8_t>>& blobs);
 	bool get_outputs_blob(PoolBlock* block, uint64_t total_reward, std::vector<uint8_t>& blob);
 
 	void print_status();
@@ -62,36 +90,125 @@ public:
 	// Consensus ID can therefore be used as a password to create private P2Pools
 	const std::vector<uint8_t>& consensus_id() const { return m_consensusId; }
 	uint64_t chain_window_size() const { return m_chainWindowSize; }
+	uint64_t chain_tip_height() const;
 
 	static bool split_reward(uint64_t reward, const std::vector<MinerShare>& shares, std::vector<uint64_t>& rewards);
+	static void get_eph_public_keys(const hash& txkey_sec, const std::vector<MinerShare>& shares, std::vector<hash>& eph_public_keys);
 
 private:
 	p2pool* m_pool;
 
+	// p2pool_bench builds synthetic sidechains and calls private methods directly
+	friend class Benchmark;
+
 private:
-	bool get_shares(PoolBlock* tip, std::vector<MinerShare>& shares) const;
-	bool get_difficulty(PoolBlock* tip, std::vector<DifficultyData>& difficultyData, difficulty_type& curDifficulty) const;
+	bool get_shares(PoolBlock* tip, std::vector<MinerShare>& shares);
+	bool get_difficulty(PoolBlock* tip, std::vector<DifficultyData>& difficultyData, difficulty_type& curDifficulty);
+	bool recalculate_difficulty(PoolBlock* tip, std::vector<DifficultyData>& difficultyData, difficulty_type& curDifficulty) const;
+	bool calculate_difficulty(const PoolBlock* tip, uint64_t timestamp1, uint64_t timestamp2, const difficulty_type& diff1, const difficulty_type& diff2, difficulty_type& curDifficulty) const;
 	void verify_loop(PoolBlock* block);
-	void verify(PoolBlock* block);
+	void verify(PoolBlock* block, std::vector<MinerShare>& shares);
+	bool verify_outputs(const PoolBlock* block, const std::vector<MinerShare>& shares) const;
+
+	struct OutputsCheck
+	{
+		PoolBlock* block;
+		std::vector<MinerShare> shares;
+		bool valid;
+	};
+
+	// Output public key checks from verify_loop() are shared by the calling thread and helper jobs on HashingExecutor
+	// Helpers which start after the calling thread has finished the batch do nothing
+	struct OutputsCheckBatch;
+	void run_outputs_checks(std::vector<OutputsCheck>& checks);
+	void do_outputs_checks(std::vector<OutputsCheck>& checks, std::atomic<size_t>& next) const;
+
+	// Cheap checks of an external block before its PoW is checked
+	// Returns false if the block is invalid, sets "ignore" if the block doesn't need to be added
+	bool pre_validate_external_block(const PoolBlock& block, bool& ignore) const;
 	void update_chain_tip(PoolBlock* block);
-	PoolBlock* get_parent(const PoolBlock* block);
+	PoolBlock* get_parent(const PoolBlock* block) const;
 
 	// Checks if "candidate" has longer (higher difficulty) chain than "block"
 	bool is_longer_chain(const PoolBlock* block, const PoolBlock* candidate);
 	void update_depths(PoolBlock* block);
 	void prune_old_blocks();
+	void compact_block_cache();
+
+	void load_cached_blocks();
 
 	bool load_config(const std::string& filename);
 	bool check_config();
 
-	mutable uv_mutex_t m_sidechainLock;
+	void insert_block(PoolBlock* new_block);
+	void update_tip_snapshot();
+
+	// Read-only queries take a read lock and run in parallel, only adding blocks takes a write lock
+	mutable uv_rwlock_t m_sidechainLock;
+	PoolBlockArena m_blockArena;
 	PoolBlock* m_chainTip;
 	std::map<uint64_t, std::vector<PoolBlock*>> m_blocksByHeight;
 	std::unordered_map<hash, PoolBlock*> m_blocksById;
-	std::unordered_set<hash> m_seenBlocks;
+
+	// Recently seen block ids: 8-way set-associative table of full ids,
+	// the oldest entry in a bucket is overwritten when it's full, so memory usage stays constant
+	enum { SEEN_BLOCKS_BUCKETS = 1 << 13, SEEN_BLOCKS_WAYS = 8 };
+
+	struct SeenBlock
+	{
+		hash id;
+		// Insertion order, 0 means empty slot
+		uint64_t order;
+	};
+
+	uv_mutex_t m_seenBlocksLock;
+	std::vector<SeenBlock> m_seenBlocks;
+	uint64_t m_seenBlocksCounter;
+	uint64_t m_seenBlocksSalt;
+
+	size_t get_seen_block_bucket(const hash& id) const;
+
+	// PoW hashes of blocks which passed the PoW check, so blocks received again or loaded from the block cache don't need RandomX
+	// Sidechain id doesn't cover nonce and extra nonce, so the key is keccak(id, nonce, extra nonce) and the seed is checked on lookup
+	struct PowCacheEntry
+	{
+		hash seed;
+		hash pow_hash;
+	};
+
+	uv_mutex_t m_powCacheLock;
+	std::unordered_map<hash, PowCacheEntry> m_powCache;
+	std::deque<hash> m_powCacheOrder;
+
+	static hash get_pow_cache_key(const PoolBlock& block);
+	bool get_cached_pow_hash(const PoolBlock& block, hash& seed, hash& pow_hash);
+	void add_cached_pow_hash(const PoolBlock& block, const hash& seed, const hash& pow_hash);
+	bool get_pow_hash(PoolBlock& block, const hash& seed, hash& pow_hash, bool* from_cache = nullptr);
+
+	// Accessed only with std::atomic_load/std::atomic_store
+	std::shared_ptr<const ChainTipSnapshot> m_tipSnapshot;
 
 	std::vector<DifficultyData> m_difficultyData;
 
+	// PPLNS window ending at m_pplnsWindow.back(), oldest block first
+	// It's moved along the chain one block at a time instead of walking the whole window on every get_shares() call
+	// Difficulty is calculated over the same window, so it's updated together with the shares
+	// Readers can move it too, m_pplnsLock serializes them (writers have exclusive access anyway)
+	uv_mutex_t m_pplnsLock;
+	std::deque<PoolBlock*> m_pplnsWindow;
+	std::map<hash, MinerShare> m_pplnsShares;
+	DifficultyWindow m_difficultyWindow;
+
+	template<typename T> bool get_block_shares(PoolBlock* block, T&& callback) const;
+	template<typename T> bool get_block_difficulty_data(PoolBlock* block, T&& callback) const;
+	void pplns_add(Wallet* w, uint64_t weight, bool newest);
+	bool pplns_sub(Wallet* w, uint64_t weight);
+	bool pplns_rebuild(PoolBlock* tip);
+	bool pplns_advance(PoolBlock* block);
+	bool pplns_rewind();
+	bool pplns_move_to(PoolBlock* tip);
+	void pplns_reset();
+
 	std::string m_poolName;
 	std::string m_poolPassword;
 	uint64_t m_targetBlockTime;
@@ -102,6 +219,11 @@ private:
 	std::vector<uint8_t> m_consensusId;
 
 	difficulty_type m_curDifficulty;
+
+	BlockCache* m_blockCache;
+
+	// Set by prune_old_blocks(), the cache file is compacted after m_sidechainLock is released
+	std::atomic<bool> m_blockCacheCompactPending;
 };
 
 } // namespace p2pool
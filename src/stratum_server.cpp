@@ -20,26 +20,73 @@
 #include "block_template.h"
 #include "p2pool.h"
 #include "params.h"
+#include <fstream>
 
 static constexpr char log_category_prefix[] = "StratumServer ";
 
 static constexpr int DEFAULT_BACKLOG = 128;
 static constexpr uint64_t DEFAULT_BAN_TIME = 600;
 
+// Vardiff limits: starting and minimal difficulty, how often it's updated and how much it can change in one update
+static constexpr uint64_t VARDIFF_START_DIFF = 10000;
+static constexpr uint64_t VARDIFF_MIN_DIFF = 1000;
+static constexpr time_t VARDIFF_RETARGET_TIME = 30;
+static constexpr uint64_t VARDIFF_MAX_CHANGE = 4;
+
+// Workers without connections and shares in the last hour are removed when there are too many of them
+static constexpr size_t MAX_WORKER_STATS = 4096;
+static constexpr time_t WORKER_STATS_IDLE_TIME = 3600;
+
+// "status" command prints at most this many workers
+static constexpr size_t MAX_WORKERS_IN_STATUS = 32;
+
 #include "tcp_server.inl"
 
 namespace p2pool {
 
+static uint32_t num_stratum_loops(const p2pool* pool)
+{
+#ifdef SO_REUSEPORT
+	return pool->params().m_stratumThreads;
+#else
+	if (pool->params().m_stratumThreads > 1) {
+		LOGWARN(1, "SO_REUSEPORT is not supported on this platform, using 1 stratum thread");
+	}
+	return 1;
+#endif
+}
+
 StratumServer::StratumServer(p2pool* pool)
-	: TCPServer(StratumClient::allocate, pool->params().m_stratumAddresses)
+	: StratumServer(pool, nullptr)
+{
+	const uint32_t num_loops = num_stratum_loops(pool);
+
+	m_shards.reserve(num_loops - 1);
+	for (uint32_t i = 1; i < num_loops; ++i) {
+		m_shards.push_back(new StratumServer(pool, this));
+	}
+
+	if (num_loops > 1) {
+		LOGINFO(1, "started " << num_loops << " event loops");
+	}
+}
+
+StratumServer::StratumServer(p2pool* pool, StratumServer* main)
+	: TCPServer(StratumClient::allocate, pool->params().m_stratumAddresses, num_stratum_loops(pool) > 1)
 	, m_pool(pool)
+	, m_main(main ? main : this)
+	, m_hashingCompletions(&m_loop)
 	, m_extraNonce(0)
 	, m_rd{}
 	, m_rng(m_rd())
+	, m_acceptedShares(0)
+	, m_acceptedHashes(0)
+	, m_startTime(time(nullptr))
 {
 	uv_mutex_init_checked(&m_blobsQueueLock);
 	uv_mutex_init_checked(&m_rngLock);
 	uv_mutex_init_checked(&m_submittedSharesPoolLock);
+	uv_mutex_init_checked(&m_workerStatsLock);
 
 	m_submittedSharesPool.resize(10);
 	for (size_t i = 0; i < m_submittedSharesPool.size(); ++i) {
@@ -57,13 +104,21 @@ StratumServer::StratumServer(p2pool* pool)
 
 StratumServer::~StratumServer()
 {
+	for (StratumServer* shard : m_shards) {
+		delete shard;
+	}
+
 	uv_close(reinterpret_cast<uv_handle_t*>(&m_blobsAsync), nullptr);
+	m_hashingCompletions.close();
 
 	shutdown_tcp();
 
+	m_hashingCompletions.cancel_pending();
+
 	uv_mutex_destroy(&m_blobsQueueLock);
 	uv_mutex_destroy(&m_rngLock);
 	uv_mutex_destroy(&m_submittedSharesPoolLock);
+	uv_mutex_destroy(&m_workerStatsLock);
 
 	for (SubmittedShare* share : m_submittedSharesPool) {
 		delete share;
@@ -74,7 +129,16 @@ void StratumServer::on_block(const BlockTemplate& block)
 {
 	LOGINFO(3, "new block template at height " << block.height());
 
-	const uint32_t num_connections = m_numConnections;
+	// Other event loops change their connection counters at any time, so each one is read once and used for slicing below
+	std::vector<uint32_t> shard_connections(m_shards.size() + 1);
+	uint32_t num_connections = 0;
+
+	for (size_t i = 0; i <= m_shards.size(); ++i) {
+		const StratumServer* server = (i < m_shards.size()) ? m_shards[i] : this;
+		shard_connections[i] = server->m_numConnections.load();
+		num_connections += shard_connections[i];
+	}
+
 	if (num_connections == 0) {
 		LOGINFO(3, "no clients connected");
 		return;
@@ -95,6 +159,40 @@ void StratumServer::on_block(const BlockTemplate& block)
 	blobs_data->m_blobSize = block.get_hashing_blobs(0, blobs_data->m_numClientsExpected, blobs_data->m_blobs, blobs_data->m_height, difficulty, sidechain_difficulty, blobs_data->m_seedHash, nonce_offset, blobs_data->m_templateId);
 	blobs_data->m_target = std::max(difficulty.target(), sidechain_difficulty.target());
 
+	if (m_shards.empty()) {
+		queue_blobs(blobs_data);
+		return;
+	}
+
+	// Every event loop gets its own range of extra_nonce values (and blobs) and sends them to its clients in parallel with other loops
+	// Clients that connected after we counted them get their jobs in on_login()
+	uint32_t extra_nonce_start = 0;
+
+	for (size_t i = 0; i <= m_shards.size(); ++i) {
+		StratumServer* server = (i < m_shards.size()) ? m_shards[i] : this;
+		const uint32_t n = shard_connections[i];
+
+		BlobsData* data = new BlobsData{};
+		data->m_blobSize = blobs_data->m_blobSize;
+		data->m_target = blobs_data->m_target;
+		data->m_extraNonceStart = extra_nonce_start;
+		data->m_numClientsExpected = n;
+		data->m_templateId = blobs_data->m_templateId;
+		data->m_height = blobs_data->m_height;
+		data->m_seedHash = blobs_data->m_seedHash;
+
+		const uint8_t* p = blobs_data->m_blobs.data() + static_cast<size_t>(extra_nonce_start) * blobs_data->m_blobSize;
+		data->m_blobs.assign(p, p + static_cast<size_t>(n) * blobs_data->m_blobSize);
+
+		server->queue_blobs(data);
+		extra_nonce_start += n;
+	}
+
+	delete blobs_data;
+}
+
+void StratumServer::queue_blobs(BlobsData* blobs_data)
+{
 	{
 		MutexLock lock(m_blobsQueueLock);
 		m_blobsQueue.push_back(blobs_data);
@@ -125,9 +223,264 @@ void StratumServer::on_block(const BlockTemplate& block)
 	}
 }
 
+void StratumServer::print_status()
+{
+	uint32_t num_connections = m_numConnections;
+	uint32_t num_incoming_connections = m_numIncomingConnections;
+
+	for (const StratumServer* shard : m_shards) {
+		num_connections += shard->m_numConnections;
+		num_incoming_connections += shard->m_numIncomingConnections;
+	}
+
+	const uint64_t elapsed = static_cast<uint64_t>(std::max<time_t>(time(nullptr) - m_startTime, 1));
+
+	LOGINFO(0, "status" <<
+		"\nConnections = " << num_connections << " (" << num_incoming_connections << " incoming)" <<
+		"\nEvent loops = " << m_shards.size() + 1 <<
+		"\nShares      = " << m_acceptedShares.load() <<
+		"\nHashrate    = " << m_acceptedHashes.load() / elapsed << " H/s (average)"
+	);
+
+	const time_t cur_time = time(nullptr);
+
+	MutexLock lock(m_workerStatsLock);
+
+	size_t n = 0;
+	for (const auto& it : m_workerStats) {
+		if (n >= MAX_WORKERS_IN_STATUS) {
+			LOGINFO(0, "... " << m_workerStats.size() - n << " more workers, use \"dump_workers\" to see all of them");
+			break;
+		}
+		++n;
+
+		const WorkerStats& w = it.second;
+		LOGINFO(0, "worker " << it.first <<
+			": connections = " << w.m_connections <<
+			", shares = " << w.m_acceptedShares << "/" << w.m_staleShares << "/" << w.m_rejectedShares << " (accepted/stale/rejected)" <<
+			", hashrate = " << w.get_hashrate(cur_time, 5) << "/" << w.get_hashrate(cur_time, 15) << "/" << w.get_hashrate(cur_time, 60) << " H/s (5m/15m/1h)"
+		);
+	}
+}
+
+void StratumServer::dump_workers(const char* file_name)
+{
+	std::ofstream f(file_name, std::ios::binary);
+
+	if (!f.is_open()) {
+		LOGERR(1, "failed to open " << file_name);
+		return;
+	}
+
+	const time_t cur_time = time(nullptr);
+
+	f << "{\"time\":" << cur_time << ",\"workers\":[";
+	size_t num_workers;
+	{
+		MutexLock lock(m_workerStatsLock);
+
+		num_workers = m_workerStats.size();
+
+		bool first = true;
+		for (const auto& it : m_workerStats) {
+			const WorkerStats& w = it.second;
+			f << (first ? "" : ",") << "\n{\"name\":\"" << it.first <<
+				"\",\"connections\":" << w.m_connections <<
+				",\"accepted\":" << w.m_acceptedShares <<
+				",\"stale\":" << w.m_staleShares <<
+				",\"rejected\":" << w.m_rejectedShares <<
+				",\"hashes\":" << w.m_totalHashes <<
+				",\"last_share_time\":" << w.m_lastShareTime <<
+				",\"hashrate_5m\":" << w.get_hashrate(cur_time, 5) <<
+				",\"hashrate_15m\":" << w.get_hashrate(cur_time, 15) <<
+				",\"hashrate_1h\":" << w.get_hashrate(cur_time, 60) << "}";
+			first = false;
+		}
+	}
+
+	f << "],\"connections\":[";
+
+	std::vector<StratumServer*> servers{ this };
+	servers.insert(servers.end(), m_shards.begin(), m_shards.end());
+
+	bool first = true;
+	for (StratumServer* server : servers) {
+		MutexLock lock(server->m_clientsListLock);
+
+		for (const StratumClient* client = static_cast<StratumClient*>(server->m_connectedClientsList->m_next); client != server->m_connectedClientsList; client = static_cast<StratumClient*>(client->m_next)) {
+			char worker_name[sizeof(client->m_workerName)];
+			{
+				MutexLock lock2(m_workerStatsLock);
+				memcpy(worker_name, client->m_workerName, sizeof(worker_name));
+			}
+
+			f << (first ? "" : ",") << "\n{\"address\":\"" << static_cast<const char*>(client->m_addrString) <<
+				"\",\"worker\":\"" << static_cast<const char*>(worker_name) <<
+				"\",\"difficulty\":" << client->m_customDiff.load() <<
+				",\"accepted\":" << client->m_acceptedShares.load() <<
+				",\"rejected\":" << client->m_rejectedShares.load() << "}";
+			first = false;
+		}
+	}
+
+	f << "]}\n";
+	f.close();
+
+	LOGINFO(0, "saved statistics for " << num_workers << " workers to " << file_name);
+}
+
+StratumServer::WorkerStats::WorkerStats()
+	: m_connections(0)
+	, m_acceptedShares(0)
+	, m_staleShares(0)
+	, m_rejectedShares(0)
+	, m_totalHashes(0)
+	, m_lastShareTime(0)
+	, m_bucketHashes{}
+	, m_bucketMinute{}
+{
+}
+
+void StratumServer::WorkerStats::add_hashes(time_t t, uint64_t hashes)
+{
+	const uint64_t minute = static_cast<uint64_t>(t) / 60;
+	const size_t k = minute % NUM_BUCKETS;
+
+	if (m_bucketMinute[k] != minute) {
+		m_bucketMinute[k] = minute;
+		m_bucketHashes[k] = 0;
+	}
+
+	m_bucketHashes[k] += hashes;
+	m_totalHashes += hashes;
+	m_lastShareTime = t;
+}
+
+uint64_t StratumServer::WorkerStats::get_hashrate(time_t t, uint32_t minutes) const
+{
+	minutes = std::min<uint32_t>(std::max<uint32_t>(minutes, 1), NUM_BUCKETS);
+
+	// The current minute is not complete yet, so count only the seconds that have passed in it
+	const uint64_t cur_minute = static_cast<uint64_t>(t) / 60;
+	const uint64_t window_start = cur_minute - (minutes - 1);
+
+	uint64_t hashes = 0;
+	for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+		if ((m_bucketMinute[i] >= window_start) && (m_bucketMinute[i] <= cur_minute)) {
+			hashes += m_bucketHashes[i];
+		}
+	}
+
+	const uint64_t seconds = (minutes - 1) * 60 + (static_cast<uint64_t>(t) % 60) + 1;
+	return hashes / seconds;
+}
+
+void StratumServer::on_worker_login(StratumClient* client, const char* worker_name)
+{
+	char name[sizeof(client->m_workerName)];
+
+	size_t n = 0;
+	for (; worker_name[n] && (n < sizeof(name) - 1); ++n) {
+		const char c = worker_name[n];
+		name[n] = ((c == '"') || (c == '\\') || (static_cast<uint8_t>(c) < 32) || (static_cast<uint8_t>(c) >= 127)) ? '_' : c;
+	}
+	name[n] = '\0';
+
+	MutexLock lock(m_workerStatsLock);
+
+	// Repeated login on the same connection
+	if (client->m_workerName[0]) {
+		auto it = m_workerStats.find(client->m_workerName);
+		if ((it != m_workerStats.end()) && (it->second.m_connections > 0)) {
+			--it->second.m_connections;
+		}
+	}
+
+	memcpy(client->m_workerName, name, n + 1);
+
+	auto it = m_workerStats.find(name);
+	if (it == m_workerStats.end()) {
+		if (m_workerStats.size() >= MAX_WORKER_STATS) {
+			const time_t cur_time = time(nullptr);
+			for (auto it2 = m_workerStats.begin(); it2 != m_workerStats.end();) {
+				if ((it2->second.m_connections == 0) && (it2->second.m_lastShareTime + WORKER_STATS_IDLE_TIME < cur_time)) {
+					it2 = m_workerStats.erase(it2);
+				}
+				else {
+					++it2;
+				}
+			}
+		}
+
+		if (m_workerStats.size() >= MAX_WORKER_STATS) {
+			LOGWARN(5, "too many workers, not collecting statistics for " << static_cast<const char*>(name));
+			return;
+		}
+
+		it = m_workerStats.emplace(name, WorkerStats()).first;
+	}
+
+	++it->second.m_connections;
+}
+
+void StratumServer::on_worker_logout(const char* worker_name)
+{
+	MutexLock lock(m_workerStatsLock);
+
+	auto it = m_workerStats.find(worker_name);
+	if ((it != m_workerStats.end()) && (it->second.m_connections > 0)) {
+		--it->second.m_connections;
+	}
+}
+
+void StratumServer::on_worker_share(const char* worker_name, SubmittedShare::Result result, uint64_t hashes)
+{
+	if (!worker_name[0]) {
+		return;
+	}
+
+	MutexLock lock(m_workerStatsLock);
+
+	auto it = m_workerStats.find(worker_name);
+	if (it == m_workerStats.end()) {
+		return;
+	}
+
+	WorkerStats& w = it->second;
+
+	switch (result) {
+	case SubmittedShare::Result::OK:
+		++w.m_acceptedShares;
+		w.add_hashes(time(nullptr), hashes);
+		break;
+
+	case SubmittedShare::Result::STALE:
+		++w.m_staleShares;
+		break;
+
+	default:
+		++w.m_rejectedShares;
+		break;
+	}
+}
+
+void StratumServer::on_worker_invalid_share(const char* worker_name)
+{
+	if (!worker_name[0]) {
+		return;
+	}
+
+	MutexLock lock(m_workerStatsLock);
+
+	auto it = m_workerStats.find(worker_name);
+	if (it != m_workerStats.end()) {
+		++it->second.m_rejectedShares;
+	}
+}
+
 bool StratumServer::on_login(StratumClient* client, uint32_t id)
 {
-	const uint32_t extra_nonce = m_extraNonce.fetch_add(1);
+	const uint32_t extra_nonce = m_main->m_extraNonce.fetch_add(1);
 
 	uint8_t hashing_blob[128];
 	uint64_t height;
@@ -138,7 +491,7 @@ bool StratumServer::on_login(StratumClient* client, uint32_t id)
 	uint32_t template_id;
 
 	const size_t blob_size = m_pool->block_template().get_hashing_blob(extra_nonce, hashing_blob, height, difficulty, sidechain_difficulty, seed_hash, nonce_offset, template_id);
-	const uint64_t target = std::max(difficulty.target(), sidechain_difficulty.target());
+	const uint64_t target = get_job_target(client, std::max(difficulty.target(), sidechain_difficulty.target()));
 
 	uint32_t job_id;
 	{
@@ -200,6 +553,7 @@ bool StratumServer::on_submit(StratumClient* client, uint32_t id, const char* jo
 
 	uint32_t template_id = 0;
 	uint32_t extra_nonce = 0;
+	uint64_t target = 0;
 
 	bool found = false;
 	{
@@ -209,6 +563,7 @@ bool StratumServer::on_submit(StratumClient* client, uint32_t id, const char* jo
 		if (saved_job.job_id == job_id) {
 			template_id = saved_job.template_id;
 			extra_nonce = saved_job.extra_nonce;
+			target = saved_job.target;
 			found = true;
 		}
 	}
@@ -237,20 +592,37 @@ bool StratumServer::on_submit(StratumClient* client, uint32_t id, const char* jo
 		share->m_templateId = template_id;
 		share->m_nonce = nonce;
 		share->m_extraNonce = extra_nonce;
+		share->m_target = target;
+
+		const int err = m_pool->hashing_executor()->queue_work(&m_hashingCompletions, &share->m_req, HashingExecutor::Priority::LOCAL_SHARE, on_share_found, on_after_share_found);
+		if (!err) {
+			return true;
+		}
 
-		const int err = uv_queue_work(&m_loop, &share->m_req, on_share_found, on_after_share_found);
-		if (err) {
-			LOGERR(1, "uv_queue_work failed, error " << uv_err_name(err));
+		// Too many shares are waiting for PoW checks, the miner gets an error but stays connected
+		LOGWARN(3, "queue_work failed, error " << uv_err_name(err));
+		{
 			MutexLock lock(m_submittedSharesPoolLock);
 			m_submittedSharesPool.push_back(share);
-			return false;
 		}
 
-		return true;
+		++client->m_rejectedShares;
+		m_main->on_worker_invalid_share(client->m_workerName);
+
+		return send(client,
+			[id](void* buf)
+			{
+				log::Stream s(reinterpret_cast<char*>(buf));
+				s << "{\"id\":" << id << ",\"jsonrpc\":\"2.0\",\"error\":{\"message\":\"Server busy\"}}\n";
+				return s.m_pos;
+			});
 	}
 
 	LOGWARN(1, "client: got a share with invalid job id");
 
+	++client->m_rejectedShares;
+	m_main->on_worker_invalid_share(client->m_workerName);
+
 	const bool result = send(client,
 		[id](void* buf)
 		{
@@ -262,6 +634,43 @@ bool StratumServer::on_submit(StratumClient* client, uint32_t id, const char* jo
 	return result;
 }
 
+uint64_t StratumServer::get_job_target(StratumClient* client, uint64_t template_target)
+{
+	const uint32_t shares_per_minute = m_pool->params().m_stratumSharesPerMinute;
+	if (!shares_per_minute) {
+		return template_target;
+	}
+
+	const time_t cur_time = time(nullptr);
+
+	if (!client->m_customDiff) {
+		client->m_customDiff = VARDIFF_START_DIFF;
+		client->m_vardiffStart = cur_time;
+		client->m_vardiffHashes = 0;
+	}
+	else if (cur_time >= client->m_vardiffStart + VARDIFF_RETARGET_TIME) {
+		// Difficulty that gives "shares_per_minute" shares at the hashrate measured since the last update
+		const uint64_t elapsed = static_cast<uint64_t>(cur_time - client->m_vardiffStart);
+		const uint64_t hashrate = client->m_vardiffHashes / elapsed;
+
+		uint64_t diff = (hashrate * 60) / shares_per_minute;
+		diff = std::min(diff, client->m_customDiff * VARDIFF_MAX_CHANGE);
+		diff = std::max(diff, client->m_customDiff / VARDIFF_MAX_CHANGE);
+		diff = std::max(diff, VARDIFF_MIN_DIFF);
+
+		if (diff != client->m_customDiff) {
+			LOGINFO(5, "client " << static_cast<char*>(client->m_addrString) << " difficulty changed from " << client->m_customDiff.load() << " to " << diff);
+			client->m_customDiff = diff;
+		}
+
+		client->m_vardiffStart = cur_time;
+		client->m_vardiffHashes = 0;
+	}
+
+	// Client difficulty never goes above sidechain difficulty, so no sidechain shares are lost
+	return std::max(template_target, difficulty_type(client->m_customDiff, 0).target());
+}
+
 uint64_t StratumServer::get_random64()
 {
 	MutexLock lock(m_rngLock);
@@ -312,6 +721,7 @@ void StratumServer::on_blobs_ready()
 			}
 
 			uint8_t* hashing_blob = data->m_blobs.data() + extra_nonce * data->m_blobSize;
+			const uint64_t target = get_job_target(client, data->m_target);
 
 			uint32_t job_id;
 			{
@@ -321,19 +731,19 @@ void StratumServer::on_blobs_ready()
 
 				StratumClient::SavedJob& saved_job = client->m_jobs[job_id % array_size(client->m_jobs)];
 				saved_job.job_id = job_id;
-				saved_job.extra_nonce = extra_nonce;
+				saved_job.extra_nonce = data->m_extraNonceStart + extra_nonce;
 				saved_job.template_id = data->m_templateId;
-				saved_job.target = data->m_target;
+				saved_job.target = target;
 			}
 
 			const bool result = send(client,
-				[data, client, hashing_blob, &job_id](void* buf)
+				[data, client, hashing_blob, &job_id, target](void* buf)
 				{
 					log::Stream s(reinterpret_cast<char*>(buf));
 					s << "{\"jsonrpc\":\"2.0\",\"method\":\"job\",\"params\":{\"blob\":\"";
 					s << log::hex_buf(hashing_blob, data->m_blobSize) << "\",\"job_id\":\"";
 					s << log::Hex(job_id) << "\",\"target\":\"";
-					s << log::hex_buf(reinterpret_cast<const uint8_t*>(&data->m_target), sizeof(data->m_target)) << "\",\"algo\":\"rx/0\",\"height\":";
+					s << log::hex_buf(reinterpret_cast<const uint8_t*>(&target), sizeof(target)) << "\",\"algo\":\"rx/0\",\"height\":";
 					s << data->m_height << ",\"seed_hash\":\"";
 					s << data->m_seedHash << "\"}}\n";
 					return s.m_pos;
@@ -348,7 +758,7 @@ void StratumServer::on_blobs_ready()
 		}
 
 		if (numClientsProcessed != m_numConnections) {
-			LOGWARN(1, "client list is broken, expected " << m_numConnections << ", got " << numClientsProcessed << " clients");
+			LOGWARN(1, "client list is broken, expected " << m_numConnections.load() << ", got " << numClientsProcessed << " clients");
 		}
 	}
 
@@ -357,8 +767,6 @@ void StratumServer::on_blobs_ready()
 
 void StratumServer::on_share_found(uv_work_t* req)
 {
-	num_running_jobs.fetch_add(1);
-
 	SubmittedShare* share = reinterpret_cast<SubmittedShare*>(req->data);
 	StratumClient* client = share->m_client;
 	StratumServer* server = share->m_server;
@@ -396,11 +804,18 @@ void StratumServer::on_share_found(uv_work_t* req)
 	}
 
 	// Send the response to miner
+	// Job target can be below sidechain difficulty (vardiff), such shares are accepted but only counted locally
 	const uint64_t value = *reinterpret_cast<uint64_t*>(pow_hash.h + HASH_SIZE - sizeof(uint64_t));
-	const uint64_t target = std::max(difficulty.target(), sidechain_difficulty.target());
+	const uint64_t sidechain_target = std::max(difficulty.target(), sidechain_difficulty.target());
+	const uint64_t target = std::max(share->m_target, sidechain_target);
 
 	if (LIKELY(value < target)) {
-		LOGINFO(0, log::Green() << "SHARE FOUND at mainchain height " << height);
+		if (value < sidechain_target) {
+			LOGINFO(0, log::Green() << "SHARE FOUND at mainchain height " << height);
+		}
+		else {
+			LOGINFO(5, "share accepted from " << static_cast<char*>(client->m_addrString) << " (below sidechain difficulty)");
+		}
 		share->m_result = SubmittedShare::Result::OK;
 	}
 	else {
@@ -420,22 +835,42 @@ void StratumServer::on_share_found(uv_work_t* req)
 	}
 }
 
-void StratumServer::on_after_share_found(uv_work_t* req, int /*status*/)
+void StratumServer::on_after_share_found(uv_work_t* req, int status)
 {
 	SubmittedShare* share = reinterpret_cast<SubmittedShare*>(req->data);
 
 	ON_SCOPE_LEAVE(
 		[share]()
 		{
-			num_running_jobs.fetch_sub(1);
-
 			MutexLock lock(share->m_server->m_submittedSharesPoolLock);
 			share->m_server->m_submittedSharesPool.push_back(share);
 		});
 
+	if (status == UV_ECANCELED) {
+		return;
+	}
+
 	StratumClient* client = share->m_client;
 	StratumServer* server = share->m_server;
 
+	const uint64_t share_diff = std::numeric_limits<uint64_t>::max() / share->m_target;
+
+	if (share->m_result == SubmittedShare::Result::OK) {
+		server->m_main->m_acceptedShares.fetch_add(1);
+		server->m_main->m_acceptedHashes.fetch_add(share_diff);
+	}
+
+	if (client->m_resetCounter.load() == share->m_clientResetCounter) {
+		if (share->m_result == SubmittedShare::Result::OK) {
+			client->m_vardiffHashes += share_diff;
+			++client->m_acceptedShares;
+		}
+		else {
+			++client->m_rejectedShares;
+		}
+		server->m_main->on_worker_share(client->m_workerName, share->m_result, share_diff);
+	}
+
 	if ((client->m_resetCounter.load() == share->m_clientResetCounter) && (client->m_rpcId == share->m_rpcId)) {
 		const bool result = server->send(client,
 			[share](void* buf)
@@ -472,6 +907,12 @@ StratumServer::StratumClient::StratumClient()
 	: m_rpcId(0)
 	, m_jobs{}
 	, m_perConnectionJobId(0)
+	, m_customDiff(0)
+	, m_vardiffStart(0)
+	, m_vardiffHashes(0)
+	, m_workerName{}
+	, m_acceptedShares(0)
+	, m_rejectedShares(0)
 {
 	uv_mutex_init_checked(&m_jobsLock);
 }
@@ -483,10 +924,20 @@ StratumServer::StratumClient::~StratumClient()
 
 void StratumServer::StratumClient::reset()
 {
+	if (m_owner && m_workerName[0]) {
+		static_cast<StratumServer*>(m_owner)->m_main->on_worker_logout(m_workerName);
+	}
+
 	Client::reset();
 	m_rpcId = 0;
 	memset(m_jobs, 0, sizeof(m_jobs));
 	m_perConnectionJobId = 0;
+	m_customDiff = 0;
+	m_vardiffStart = 0;
+	m_vardiffHashes = 0;
+	m_workerName[0] = '\0';
+	m_acceptedShares = 0;
+	m_rejectedShares = 0;
 }
 
 bool StratumServer::StratumClient::on_read(char* data, uint32_t size)
@@ -574,9 +1025,25 @@ bool StratumServer::StratumClient::process_request(char* data, uint32_t /*size*/
 	return true;
 }
 
-bool StratumServer::StratumClient::process_login(rapidjson::Document& /*doc*/, uint32_t id)
+bool StratumServer::StratumClient::process_login(rapidjson::Document& doc, uint32_t id)
 {
-	return static_cast<StratumServer*>(m_owner)->on_login(this, id);
+	// p2pool doesn't use the login (it mines to its own wallet), it's only a worker name for statistics
+	const char* worker_name = "default";
+
+	if (doc.HasMember("params") && doc["params"].IsObject()) {
+		auto& params = doc["params"];
+		for (const char* field : { "rigid", "login" }) {
+			if (params.HasMember(field) && params[field].IsString() && (params[field].GetStringLength() > 0)) {
+				worker_name = params[field].GetString();
+				break;
+			}
+		}
+	}
+
+	StratumServer* server = static_cast<StratumServer*>(m_owner);
+	server->m_main->on_worker_login(this, worker_name);
+
+	return server->on_login(this, id);
 }
 
 bool StratumServer::StratumClient::process_submit(rapidjson::Document& doc, uint32_t id)
@@ -18,8 +18,10 @@
 #pragma once
 
 #include "tcp_server.h"
+#include "hashing_executor.h"
 #include <rapidjson/document.h>
 #include <random>
+#include <map>
 
 namespace p2pool {
 
@@ -36,6 +38,9 @@ public:
 
 	void on_block(const BlockTemplate& block);
 
+	void print_status() override;
+	void dump_workers(const char* file_name);
+
 	struct StratumClient : public Client
 	{
 		StratumClient();
@@ -63,9 +68,22 @@ public:
 		} m_jobs[4];
 
 		uint32_t m_perConnectionJobId;
+
+		// Vardiff state, only changed in the event loop thread
+		// Difficulty is updated when a new job is sent, using shares accepted since the last update
+		// m_customDiff and share counters are atomic because dump_workers reads them from another thread
+		std::atomic<uint64_t> m_customDiff;
+		time_t m_vardiffStart;
+		uint64_t m_vardiffHashes;
+
+		// Worker name from login request ("rigid" or "login" field), statistics are collected per worker name
+		char m_workerName[64];
+		std::atomic<uint64_t> m_acceptedShares;
+		std::atomic<uint64_t> m_rejectedShares;
 	};
 
 	bool on_login(StratumClient* client, uint32_t id);
+	uint64_t get_job_target(StratumClient* client, uint64_t template_target);
 	bool on_submit(StratumClient* client, uint32_t id, const char* job_id_str, const char* nonce_str);
 	uint64_t get_random64();
 
@@ -75,11 +93,19 @@ private:
 
 	p2pool* m_pool;
 
+	// Additional event loops ("--stratum-threads"), every loop is a separate server listening on the same addresses with SO_REUSEPORT
+	// Each loop owns its clients, new jobs are sent to all loops in parallel
+	StratumServer(p2pool* pool, StratumServer* main);
+
+	StratumServer* m_main;
+	std::vector<StratumServer*> m_shards;
+
 	struct BlobsData
 	{
 		std::vector<uint8_t> m_blobs;
 		size_t m_blobSize;
 		uint64_t m_target;
+		uint32_t m_extraNonceStart;
 		uint32_t m_numClientsExpected;
 		uint32_t m_templateId;
 		uint64_t m_height;
@@ -90,6 +116,11 @@ private:
 	uv_async_t m_blobsAsync;
 	std::vector<BlobsData*> m_blobsQueue;
 
+	// Share checks run on the hashing executor and their results come back to this server's event loop
+	HashingExecutor::CompletionQueue m_hashingCompletions;
+
+	void queue_blobs(BlobsData* blobs_data);
+
 	static void on_blobs_ready(uv_async_t* handle) { reinterpret_cast<StratumServer*>(handle->data)->on_blobs_ready(); }
 	void on_blobs_ready();
 
@@ -110,6 +141,7 @@ private:
 		uint32_t m_templateId;
 		uint32_t m_nonce;
 		uint32_t m_extraNonce;
+		uint64_t m_target;
 
 		enum class Result {
 			STALE,
@@ -121,6 +153,41 @@ private:
 
 	uv_mutex_t m_submittedSharesPoolLock;
 	std::vector<SubmittedShare*> m_submittedSharesPool;
+
+	// Accepted shares from all event loops (counted in the main server), including shares below sidechain difficulty
+	std::atomic<uint64_t> m_acceptedShares;
+	std::atomic<uint64_t> m_acceptedHashes;
+	time_t m_startTime;
+
+	// Statistics for every worker name, kept in the main server for all event loops
+	struct WorkerStats
+	{
+		WorkerStats();
+
+		void add_hashes(time_t t, uint64_t hashes);
+		uint64_t get_hashrate(time_t t, uint32_t minutes) const;
+
+		enum { NUM_BUCKETS = 60 };
+
+		uint32_t m_connections;
+		uint64_t m_acceptedShares;
+		uint64_t m_staleShares;
+		uint64_t m_rejectedShares;
+		uint64_t m_totalHashes;
+		time_t m_lastShareTime;
+
+		// Hashes of accepted shares in 1-minute buckets for the last hour, for windowed hashrate estimates
+		uint64_t m_bucketHashes[NUM_BUCKETS];
+		uint64_t m_bucketMinute[NUM_BUCKETS];
+	};
+
+	uv_mutex_t m_workerStatsLock;
+	std::map<std::string, WorkerStats> m_workerStats;
+
+	void on_worker_login(StratumClient* client, const char* worker_name);
+	void on_worker_logout(const char* worker_name);
+	void on_worker_share(const char* worker_name, SubmittedShare::Result result, uint64_t hashes);
+	void on_worker_invalid_share(const char* worker_name);
 };
 
 } // namespace p2pool
@@ -20,6 +20,7 @@
 #include "uv_util.h"
 #include <map>
 #include <set>
+#include <memory>
 
 namespace p2pool {
 
@@ -30,7 +31,9 @@ public:
 	struct Client;
 	typedef Client* (*allocate_client_callback)();
 
-	TCPServer(allocate_client_callback allocate_new_client, const std::string& listen_addresses);
+	// With reuse_port, listening sockets are opened with SO_REUSEPORT so several servers (each with its own event loop)
+	// can listen on the same addresses, and the OS distributes incoming connections between them
+	TCPServer(allocate_client_callback allocate_new_client, const std::string& listen_addresses, bool reuse_port = false);
 	virtual ~TCPServer();
 
 	template<typename T>
@@ -81,6 +84,9 @@ public:
 
 	void ban(const raw_ip& ip, uint64_t seconds);
 
+	// Refcounted data which can be sent to many clients without copying it (block broadcasts)
+	typedef std::shared_ptr<const std::vector<uint8_t>> SharedPayload;
+
 	struct Client
 	{
 		Client();
@@ -119,13 +125,23 @@ public:
 		char m_readBuf[READ_BUF_SIZE];
 		uint32_t m_numRead;
 
+		// Write buffers are sized to the message, the shared payload (if any) is sent right after m_data
 		struct WriteBuf
 		{
 			Client* m_client;
 			uv_write_t m_write;
-			char m_data[WRITE_BUF_SIZE];
+			std::vector<char> m_data;
+			SharedPayload m_payload;
+		};
+
+		// Only small buffers are kept for reuse, so a burst of big messages doesn't pin memory
+		enum {
+			MAX_FREE_WRITE_BUFFERS = 4,
+			MAX_FREE_WRITE_BUFFER_SIZE = 4096,
 		};
 
+		void release_write_buf(WriteBuf* buf);
+
 		uv_mutex_t m_writeBuffersLock;
 		std::vector<WriteBuf*> m_writeBuffers;
 
@@ -153,7 +169,11 @@ public:
 	};
 
 	template<typename T>
-	FORCEINLINE bool send(Client* client, T&& callback) { return send_internal(client, SendCallback<T>(std::move(callback))); }
+	FORCEINLINE bool send(Client* client, T&& callback) { return send_internal(client, SendCallback<T>(std::move(callback)), nullptr); }
+
+	// Sends what the callback writes (message header) followed by the payload in one uv_write call
+	template<typename T>
+	FORCEINLINE bool send(Client* client, T&& callback, const SharedPayload& payload) { return send_internal(client, SendCallback<T>(std::move(callback)), &payload); }
 
 private:
 	static void loop(void* data);
@@ -165,11 +185,11 @@ private:
 
 	bool connect_to_peer_nolock(Client* client, bool is_v6, const sockaddr* addr);
 
-	bool send_internal(Client* client, SendCallbackBase&& callback);
+	bool send_internal(Client* client, SendCallbackBase&& callback, const SharedPayload* payload);
 
 	allocate_client_callback m_allocateNewClient;
 
-	void start_listening(const std::string& listen_addresses);
+	void start_listening(const std::string& listen_addresses, bool reuse_port);
 
 	std::vector<uv_tcp_t*> m_listenSockets6;
 	std::vector<uv_tcp_t*> m_listenSockets;
@@ -184,8 +204,10 @@ protected:
 	uv_mutex_t m_clientsListLock;
 	std::vector<Client*> m_preallocatedClients;
 	Client* m_connectedClientsList;
-	uint32_t m_numConnections;
-	uint32_t m_numIncomingConnections;
+
+	// Read by other event loops (StratumServer shards) and by print_status() from the console thread
+	std::atomic<uint32_t> m_numConnections;
+	std::atomic<uint32_t> m_numIncomingConnections;
 
 	uv_mutex_t m_bansLock;
 	std::map<raw_ip, time_t> m_bans;
@@ -20,7 +20,7 @@ static thread_local bool server_event_loop_thread = false;
 namespace p2pool {
 
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
-TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::TCPServer(allocate_client_callback allocate_new_client, const std::string& listen_addresses)
+TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::TCPServer(allocate_client_callback allocate_new_client, const std::string& listen_addresses, bool reuse_port)
 	: m_allocateNewClient(allocate_new_client)
 	, m_listenPort(-1)
 	, m_numConnections(0)
@@ -45,7 +45,7 @@ TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::TCPServer(allocate_client_callback all
 	m_connectedClientsList->m_next = m_connectedClientsList;
 	m_connectedClientsList->m_prev = m_connectedClientsList;
 
-	start_listening(listen_addresses);
+	start_listening(listen_addresses, reuse_port);
 
 	err = uv_thread_create(&m_loopThread, loop, this);
 	if (err) {
@@ -111,7 +111,7 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::parse_address_list(const std::str
 }
 
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
-void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::start_listening(const std::string& listen_addresses)
+void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::start_listening(const std::string& listen_addresses, bool reuse_port)
 {
 	if (listen_addresses.empty()) {
 		LOGERR(1, "listen address not set");
@@ -119,7 +119,7 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::start_listening(const std::string
 	}
 
 	parse_address_list(listen_addresses,
-		[this](bool is_v6, const std::string& address, const std::string& ip, int port)
+		[this, reuse_port](bool is_v6, const std::string& address, const std::string& ip, int port)
 		{
 			if (m_listenPort < 0) {
 				m_listenPort = port;
@@ -138,12 +138,33 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::start_listening(const std::string
 				m_listenSockets.push_back(socket);
 			}
 
-			int err = uv_tcp_init(&m_loop, socket);
+			// Socket must be created before binding to set SO_REUSEPORT on it
+			int err = reuse_port ? uv_tcp_init_ex(&m_loop, socket, is_v6 ? AF_INET6 : AF_INET) : uv_tcp_init(&m_loop, socket);
 			if (err) {
 				LOGERR(1, "failed to create tcp server handle, error " << uv_err_name(err));
 				panic();
 			}
 
+			if (reuse_port) {
+#ifdef SO_REUSEPORT
+				uv_os_fd_t fd;
+				err = uv_fileno(reinterpret_cast<uv_handle_t*>(socket), &fd);
+				if (err) {
+					LOGERR(1, "failed to get tcp server socket, error " << uv_err_name(err));
+					panic();
+				}
+
+				const int one = 1;
+				if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+					LOGERR(1, "failed to set SO_REUSEPORT on tcp server socket, error " << errno);
+					panic();
+				}
+#else
+				LOGERR(1, "SO_REUSEPORT is not supported on this platform");
+				panic();
+#endif
+			}
+
 			err = uv_tcp_nodelay(socket, 1);
 			if (err) {
 				LOGERR(1, "failed to set tcp_nodelay on tcp server handle, error " << uv_err_name(err));
@@ -410,7 +431,7 @@ template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
 void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::print_status()
 {
 	LOGINFO(0, "status" <<
-		"\nConnections = " << m_numConnections << " (" << m_numIncomingConnections << " incoming)"
+		"\nConnections = " << m_numConnections.load() << " (" << m_numIncomingConnections.load() << " incoming)"
 	);
 }
 
@@ -422,7 +443,7 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::ban(const raw_ip& ip, uint64_t se
 }
 
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
-bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::send_internal(Client* client, SendCallbackBase&& callback)
+bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::send_internal(Client* client, SendCallbackBase&& callback, const SharedPayload* payload)
 {
 	if (!server_event_loop_thread) {
 		LOGERR(1, "sending data from another thread, this is not safe");
@@ -430,6 +451,25 @@ bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::send_internal(Client* client, Sen
 
 	MutexLock lock0(client->m_sendLock);
 
+	// Callback writes to a scratch buffer first because the message size is not known in advance
+	static thread_local std::vector<char> scratch;
+	if (scratch.size() < WRITE_BUF_SIZE) {
+		scratch.resize(WRITE_BUF_SIZE);
+	}
+
+	const size_t bytes_written = callback(scratch.data());
+	const size_t payload_size = payload ? (*payload)->size() : 0;
+
+	if (bytes_written + payload_size > WRITE_BUF_SIZE) {
+		LOGERR(0, "send callback wrote " << bytes_written << " + " << payload_size << " bytes, expected no more than " << WRITE_BUF_SIZE << " bytes");
+		panic();
+	}
+
+	if (bytes_written + payload_size == 0) {
+		LOGWARN(1, "send callback wrote 0 bytes, nothing to do");
+		return true;
+	}
+
 	typename Client::WriteBuf* buf = nullptr;
 
 	{
@@ -444,35 +484,32 @@ bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::send_internal(Client* client, Sen
 		buf = new typename Client::WriteBuf();
 	}
 
-	const size_t bytes_written = callback(buf->m_data);
-
-	if (bytes_written > sizeof(buf->m_data)) {
-		LOGERR(0, "send callback wrote " << bytes_written << " bytes, expected no more than " << sizeof(buf->m_data) << " bytes");
-		panic();
-	}
-
-	if (bytes_written == 0) {
-		LOGWARN(1, "send callback wrote 0 bytes, nothing to do");
-		{
-			MutexLock lock(client->m_writeBuffersLock);
-			client->m_writeBuffers.push_back(buf);
-		}
-		return true;
+	buf->m_data.assign(scratch.data(), scratch.data() + bytes_written);
+	if (payload_size) {
+		buf->m_payload = *payload;
 	}
 
 	buf->m_client = client;
 	buf->m_write.data = buf;
 
-	uv_buf_t bufs[1];
-	bufs[0].base = buf->m_data;
-	bufs[0].len = static_cast<int>(bytes_written);
+	uv_buf_t bufs[2];
+	uint32_t num_bufs = 0;
+
+	if (bytes_written) {
+		bufs[num_bufs].base = buf->m_data.data();
+		bufs[num_bufs].len = static_cast<int>(bytes_written);
+		++num_bufs;
+	}
+
+	if (payload_size) {
+		bufs[num_bufs].base = const_cast<char*>(reinterpret_cast<const char*>(buf->m_payload->data()));
+		bufs[num_bufs].len = static_cast<int>(payload_size);
+		++num_bufs;
+	}
 
-	const int err = uv_write(&buf->m_write, reinterpret_cast<uv_stream_t*>(&client->m_socket), bufs, 1, Client::on_write);
+	const int err = uv_write(&buf->m_write, reinterpret_cast<uv_stream_t*>(&client->m_socket), bufs, num_bufs, Client::on_write);
 	if (err) {
-		{
-			MutexLock lock(client->m_writeBuffersLock);
-			client->m_writeBuffers.push_back(buf);
-		}
+		client->release_write_buf(buf);
 		LOGWARN(1, "failed to start writing data to client connection, error " << uv_err_name(err));
 		return false;
 	}
@@ -795,10 +832,7 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::Client::on_write(uv_write_t* req,
 	Client::WriteBuf* buf = static_cast<Client::WriteBuf*>(req->data);
 	Client* client = buf->m_client;
 
-	{
-		MutexLock lock(client->m_writeBuffersLock);
-		client->m_writeBuffers.push_back(buf);
-	}
+	client->release_write_buf(buf);
 
 	if (status != 0) {
 		LOGWARN(5, "client: failed to write data to client connection, error " << uv_err_name(status));
@@ -806,6 +840,26 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::Client::on_write(uv_write_t* req,
 	}
 }
 
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::Client::release_write_buf(WriteBuf* buf)
+{
+	buf->m_payload.reset();
+
+	if (buf->m_data.capacity() > MAX_FREE_WRITE_BUFFER_SIZE) {
+		std::vector<char>().swap(buf->m_data);
+	}
+
+	{
+		MutexLock lock(m_writeBuffersLock);
+		if (m_writeBuffers.size() < MAX_FREE_WRITE_BUFFERS) {
+			m_writeBuffers.push_back(buf);
+			return;
+		}
+	}
+
+	delete buf;
+}
+
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
 void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::Client::close()
 {